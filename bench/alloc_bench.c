@@ -0,0 +1,145 @@
+/**
+ * Microbenchmark do alocador de clusters. Enche o disco até 95% e mede
+ * quantas alocações por segundo o mapa de bits consegue fazer, comparando
+ * com a busca linear antiga em um array de bytes
+ *
+ * Uso: ./bench_alloc [operações]
+*/
+#include "../src/fat.c"
+#include <time.h>
+
+#define DATA_CLUSTERS (NUM_CLUSTER - DATA_START)
+#define FILL_PERCENT 95
+
+uint8_t *scan_clusters;
+int *used;
+int num_used;
+
+/**
+ * Busca linear usada antes do mapa de bits, mantida aqui como referência
+*/
+int scan_find_free_cluster()
+{
+    for (int cluster_entry = ROOT_CLUSTER; cluster_entry < NUM_CLUSTER; cluster_entry++)
+    {
+        if (scan_clusters[cluster_entry] == CLUSTER_FREE)
+        {
+            scan_clusters[cluster_entry] = CLUSTER_OCCUPIED;
+
+            return cluster_entry;
+        }
+    }
+
+    return -1;
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Preenche a fat como o comando init e ocupa FILL_PERCENT% dos clusters
+ * de dados, liberando clusters aleatórios para fragmentar o disco
+*/
+void fill_disk()
+{
+    for (int i = 0; i < DATA_START; i++)
+        fat[i] = CLUSTER_RESERVED;
+    for (int i = DATA_START; i < NUM_CLUSTER; i++)
+        fat[i] = END_FILE;
+
+    num_used = 0;
+    for (int i = DATA_START; i < NUM_CLUSTER; i++)
+        used[num_used++] = i;
+
+    srand(42);
+    while (num_used > DATA_CLUSTERS * FILL_PERCENT / 100)
+    {
+        int victim = rand() % num_used;
+        fat[used[victim]] = CLUSTER_FREE;
+        used[victim] = used[--num_used];
+    }
+
+    rebuild_free_clusters();
+
+    memset(scan_clusters, CLUSTER_OCCUPIED, NUM_CLUSTER);
+    for (int i = DATA_START; i < NUM_CLUSTER; i++)
+        if (fat[i] == CLUSTER_FREE)
+            scan_clusters[i] = CLUSTER_FREE;
+}
+
+/**
+ * Em regime, libera um cluster aleatório e aloca outro, mantendo o
+ * disco em FILL_PERCENT%
+*/
+double bench_bitmap(long ops)
+{
+    fill_disk();
+    srand(7);
+
+    double start = now();
+    for (long i = 0; i < ops; i++)
+    {
+        int victim = rand() % num_used;
+        release_cluster(used[victim]);
+        used[victim] = find_free_cluster();
+        fat[used[victim]] = END_FILE;
+    }
+    return ops / (now() - start);
+}
+
+double bench_scan(long ops)
+{
+    fill_disk();
+    srand(7);
+
+    double start = now();
+    for (long i = 0; i < ops; i++)
+    {
+        int victim = rand() % num_used;
+        scan_clusters[used[victim]] = CLUSTER_FREE;
+        used[victim] = scan_find_free_cluster();
+    }
+    return ops / (now() - start);
+}
+
+/**
+ * Aloca cadeias de 16 clusters com alloc_chain e as libera em seguida
+*/
+double bench_chain(long ops)
+{
+    fill_disk();
+
+    double start = now();
+    for (long i = 0; i < ops; i++)
+    {
+        int first = find_free_cluster();
+        fat[first] = END_FILE;
+        alloc_chain(first, 15);
+        free_chain(first);
+    }
+    return ops * 16 / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+
+    apply_geometry();
+    scan_clusters = malloc(NUM_CLUSTER);
+    used = malloc(NUM_CLUSTER * sizeof(int));
+
+    double scan = bench_scan(ops);
+    double bitmap = bench_bitmap(ops);
+    double chain = bench_chain(ops / 16);
+
+    printf("disco %d%% cheio, %ld operações\n", FILL_PERCENT, ops);
+    printf("busca linear:   %12.0f alocações/s\n", scan);
+    printf("mapa de bits:   %12.0f alocações/s (%.1fx)\n", bitmap, bitmap / scan);
+    printf("alloc_chain 16: %12.0f alocações/s\n", chain);
+
+    return 0;
+}
@@ -0,0 +1,131 @@
+/**
+ * Microbenchmark da resolução de caminhos. Cria uma árvore de diretórios
+ * cheios, onde o componente procurado é sempre a última entrada, e mede
+ * quantos caminhos por segundo são resolvidos com o índice hash de
+ * diretório e com o cache de caminhos, comparando com a busca linear
+ * por strcmp
+ *
+ * Uso: ./bench_path [repetições]
+*/
+#include "../src/fat.c"
+#include <time.h>
+
+#define DEPTH 8
+
+char path[DEPTH][NAME_SIZE];
+char full_path[DEPTH * NAME_SIZE];
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Cria DEPTH níveis de diretórios, cada um com ENTRY_BY_CLUSTER - 1
+ * irmãos antes do diretório do próximo nível
+*/
+void build_tree()
+{
+    int saved = dup(STDOUT_FILENO), null = open("/dev/null", O_WRONLY);
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+
+    format_image();
+
+    int cluster = ROOT_CLUSTER;
+    for (int level = 0; level < DEPTH; level++)
+    {
+        char name[NAME_SIZE];
+        for (int i = 0; i < ENTRY_BY_CLUSTER - 1; i++)
+        {
+            snprintf(name, sizeof(name), "s%d_%d", level, i);
+            create_entry(name, cluster, IS_FILE);
+        }
+
+        snprintf(path[level], NAME_SIZE, "d%d", level);
+        create_entry(path[level], cluster, IS_DIR);
+
+        cluster = dir_find(cluster, path[level])->first_block;
+
+        strcat(full_path, "/");
+        strcat(full_path, path[level]);
+    }
+    sync_image();
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    close(null);
+}
+
+/**
+ * Resolve o caminho completo procurando cada componente com strcmp
+*/
+int resolve_scan()
+{
+    int cluster = ROOT_CLUSTER;
+    for (int level = 0; level < DEPTH; level++)
+    {
+        data_cluster *dir = load_data(cluster);
+        int i;
+        for (i = 0; i < ENTRY_BY_CLUSTER; i++)
+            if (strcmp(path[level], (char *)dir->dir[i].filename) == 0)
+                break;
+        cluster = entry_cluster(&dir->dir[i]);
+    }
+    return cluster;
+}
+
+/**
+ * Resolve o caminho completo usando o índice de cada diretório
+*/
+int resolve_index()
+{
+    int cluster = ROOT_CLUSTER;
+    for (int level = 0; level < DEPTH; level++)
+        cluster = dir_find(cluster, path[level])->first_block;
+    return cluster;
+}
+
+int main(int argc, char **argv)
+{
+    long reps = argc > 1 ? atol(argv[1]) : 1000000;
+    char dir[] = "/tmp/bench_pathXXXXXX";
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        printf("Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+    strcpy(image_path, "fat.part");
+    build_tree();
+
+    volatile int sink = 0;
+    double start = now();
+    for (long i = 0; i < reps; i++)
+        sink += resolve_scan();
+    double scan = reps / (now() - start);
+
+    start = now();
+    for (long i = 0; i < reps; i++)
+        sink += resolve_index();
+    double index = reps / (now() - start);
+
+    start = now();
+    for (long i = 0; i < reps; i++)
+        sink += lookup_dir(full_path);
+    double dentry = reps / (now() - start);
+
+    printf("%d níveis, %d entradas por diretório, %ld repetições\n", DEPTH, (int)ENTRY_BY_CLUSTER, reps);
+    printf("busca linear: %12.0f caminhos/s\n", scan);
+    printf("índice hash:  %12.0f caminhos/s (%.1fx)\n", index, index / scan);
+    printf("cache de caminhos: %7.0f caminhos/s (%.1fx)\n", dentry, dentry / scan);
+
+    close_image();
+    unlink(image_path);
+    chdir("/");
+    rmdir(dir);
+    return 0;
+}
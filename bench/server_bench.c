@@ -0,0 +1,228 @@
+/**
+ * Benchmark do modo servidor. Inicia ./prog -s em um diretório temporário
+ * e mede quantos comandos por segundo são atendidos com 1, 2, 4 e 8
+ * clientes simultâneos, primeiro com cada cliente escrevendo e lendo no
+ * seu próprio diretório e depois com todos lendo o mesmo arquivo
+ *
+ * Uso: ./bench_server [segundos por medida]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#define SOCKET_NAME "bench.sock"
+#define PROMPT "SHELL V-POWER → "
+#define MAX_CLIENTS 8
+#define FILES 8
+
+typedef struct
+{
+    int id;
+    int shared;
+    double seconds;
+    long commands;
+} client_t;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Envia um comando e espera a resposta, que termina com PROMPT
+ *
+ * @param int descritor da conexão
+ * @param char* comando, sem a quebra de linha
+*/
+void command(int fd, const char *line)
+{
+    static __thread char reply[1 << 16];
+    size_t prompt_len = strlen(PROMPT), len = 0;
+
+    if (line != NULL)
+        dprintf(fd, "%s\n", line);
+    while (len < prompt_len || memcmp(reply + len - prompt_len, PROMPT, prompt_len) != 0)
+    {
+        // só o fim da resposta importa, o começo pode ser descartado
+        if (len > sizeof(reply) / 2)
+        {
+            memmove(reply, reply + len - prompt_len, prompt_len);
+            len = prompt_len;
+        }
+        ssize_t got = read(fd, reply + len, sizeof(reply) - len);
+        if (got <= 0)
+        {
+            printf("O servidor fechou a conexão\n");
+            exit(1);
+        }
+        len += got;
+    }
+}
+
+int connect_server()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, SOCKET_NAME);
+
+    for (int i = 0; i < 100; i++)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+        {
+            command(fd, NULL);
+            return fd;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    printf("Não foi possível conectar ao servidor\n");
+    exit(1);
+}
+
+/**
+ * Cria o diretório do cliente com FILES arquivos
+*/
+void prepare(int fd, int id)
+{
+    char line[128];
+
+    snprintf(line, sizeof(line), "mkdir /c%d", id);
+    command(fd, line);
+    for (int i = 0; i < FILES; i++)
+    {
+        snprintf(line, sizeof(line), "create /c%d/f%d", id, i);
+        command(fd, line);
+        snprintf(line, sizeof(line), "write \"conteudo inicial do arquivo %d\" /c%d/f%d", i, id, i);
+        command(fd, line);
+    }
+}
+
+void *run_client(void *arg)
+{
+    client_t *client = arg;
+    int fd = connect_server();
+    char line[128];
+    double end = now() + client->seconds;
+
+    while (now() < end)
+    {
+        for (int i = 0; i < 64; i++, client->commands++)
+        {
+            int file = client->commands % FILES;
+
+            if (client->shared)
+                snprintf(line, sizeof(line), "read /c0/f0");
+            else if (client->commands % 4 == 0)
+                snprintf(line, sizeof(line), "write \"linha %ld do cliente\" /c%d/f%d", client->commands, client->id, file);
+            else if (client->commands % 4 == 1)
+                snprintf(line, sizeof(line), "append \" mais\" /c%d/f%d", client->id, file);
+            else if (client->commands % 4 == 2)
+                snprintf(line, sizeof(line), "read /c%d/f%d", client->id, file);
+            else
+                snprintf(line, sizeof(line), "ls /c%d", client->id);
+            command(fd, line);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Mede a vazão com count clientes
+ *
+ * @return double comandos por segundo
+*/
+double measure(int count, int shared, double seconds)
+{
+    pthread_t threads[MAX_CLIENTS];
+    client_t clients[MAX_CLIENTS];
+
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        clients[i] = (client_t){i, shared, seconds, 0};
+        pthread_create(&threads[i], NULL, run_client, &clients[i]);
+    }
+
+    long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total += clients[i].commands;
+    }
+    return total / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+    char dir[] = "/tmp/bench_serverXXXXXX";
+    char *prog = realpath("prog", NULL);
+
+    if (prog == NULL)
+    {
+        printf("Compile o shell com make antes do benchmark\n");
+        return 1;
+    }
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        printf("Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+
+    // cria a imagem no modo não interativo, respondendo à confirmação
+    char script[4096];
+    snprintf(script, sizeof(script), "printf 'init 4096 65000\\ns\\n' | '%s' > /dev/null 2>&1", prog);
+    if (system(script) != 0)
+    {
+        printf("Erro ao criar a imagem\n");
+        return 1;
+    }
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        freopen("/dev/null", "w", stdout);
+        execl(prog, prog, "-s", SOCKET_NAME, (char *)NULL);
+        _exit(1);
+    }
+
+    int fd = connect_server();
+    for (int i = 0; i < MAX_CLIENTS; i++)
+        prepare(fd, i);
+    close(fd);
+
+    printf("%ld núcleos, %.1fs por medida\n", sysconf(_SC_NPROCESSORS_ONLN), seconds);
+    double base = 0, shared_base = 0;
+    for (int count = 1; count <= MAX_CLIENTS; count *= 2)
+    {
+        double own = measure(count, 0, seconds);
+        double shared = measure(count, 1, seconds);
+        if (count == 1)
+        {
+            base = own;
+            shared_base = shared;
+        }
+        printf("%d clientes: %9.0f comandos/s em diretórios próprios (%.1fx), %9.0f lendo o mesmo arquivo (%.1fx)\n",
+               count, own, own / base, shared, shared / shared_base);
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    unlink("fat.part");
+    chdir("/");
+    rmdir(dir);
+    free(prog);
+    return 0;
+}
@@ -0,0 +1,428 @@
+/**
+ * Conjunto de benchmarks do sistema de arquivos, usado por make bench.
+ * Cada carga de trabalho começa com uma imagem nova e chama as funções
+ * do núcleo diretamente, sem o laço do shell. O resultado é um JSON com
+ * operações por segundo, latências p50/p99 e syscalls por operação. As
+ * syscalls são as de leitura e escrita contadas em /proc/self/io (read,
+ * write, pread, pwrite, preadv, pwritev e semelhantes), ou null se o
+ * kernel não tiver essa contagem
+ *
+ * Uso: ./bench_suite [-m] [-u profundidade] [-s escala]
+*/
+#include "../src/fat.c"
+
+#define SUITE_CLUSTER_SIZE 4096
+#define SUITE_NUM_CLUSTER 131072
+#define STORM_DIRS 64
+#define STORM_FILES 64
+#define SMALL_FILE_MAX 4096
+#define SEQ_FILE_SIZE (32 << 20)
+#define SEQ_REPS 8
+#define SEQ_CHUNK (64 << 10)
+#define LOG_RECORDS 100000
+#define LOG_RECORD_SIZE 100
+#define PATH_DEPTH 16
+#define PATH_BRANCHES 4
+#define PATH_LOOKUPS 1000000
+#define ALLOC_OPS 1000000
+#define FILL_PERCENT 95
+
+typedef struct
+{
+    const char *name;
+    long ops;
+    double *latency;
+    double elapsed;
+    double bytes;
+    long syscalls;
+} workload_t;
+
+int scale = 1;
+int first_result = 1;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Soma as syscalls de leitura e escrita feitas pelo processo até agora
+ *
+ * @return long total de syscalls, ou -1 se /proc/self/io não existir
+*/
+long syscall_count()
+{
+    FILE *io = fopen("/proc/self/io", "r");
+    char key[32];
+    long value, total = 0;
+    int found = 0;
+
+    if (io == NULL)
+        return -1;
+    while (fscanf(io, "%31s %ld", key, &value) == 2)
+    {
+        if (strcmp(key, "syscr:") == 0 || strcmp(key, "syscw:") == 0)
+        {
+            total += value;
+            found++;
+        }
+    }
+    fclose(io);
+    return found == 2 ? total : -1;
+}
+
+/**
+ * Formata uma imagem nova e começa a medir a carga de trabalho
+ *
+ * @param workload_t* carga de trabalho
+ * @param char* nome da carga no JSON
+ * @param long número de operações
+*/
+void begin(workload_t *w, const char *name, long ops)
+{
+    geometry = (geometry_t){GEOMETRY_MAGIC, SUITE_CLUSTER_SIZE, SUITE_NUM_CLUSTER, 32, 0};
+    apply_geometry();
+    format_image();
+
+    w->name = name;
+    w->ops = ops;
+    w->latency = malloc(ops * sizeof(double));
+    w->elapsed = 0;
+    w->bytes = 0;
+    w->syscalls = syscall_count();
+}
+
+/**
+ * Executa uma operação da carga medindo a sua latência
+*/
+#define TIMED(w, i, ...)                    \
+    do                                      \
+    {                                       \
+        double start_ = now();              \
+        __VA_ARGS__;                        \
+        (w)->latency[i] = now() - start_;   \
+        (w)->elapsed += (w)->latency[i];    \
+    } while (0)
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Termina a carga de trabalho, gravando os metadados pendentes como o
+ * shell faria ao fim do comando, e mostra o resultado em JSON
+ *
+ * @param workload_t* carga de trabalho
+*/
+void finish(workload_t *w)
+{
+    double start = now();
+    sync_image();
+    w->elapsed += now() - start;
+
+    long syscalls = syscall_count();
+    qsort(w->latency, w->ops, sizeof(double), compare_double);
+
+    printf("%s    {\"name\": \"%s\", \"ops\": %ld, \"ops_per_s\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f",
+           first_result ? "" : ",\n", w->name, w->ops, w->ops / w->elapsed,
+           w->latency[w->ops / 2] * 1e6, w->latency[w->ops * 99 / 100] * 1e6);
+    if (w->syscalls >= 0 && syscalls >= 0)
+        printf(", \"syscalls_per_op\": %.3f", (double)(syscalls - w->syscalls) / w->ops);
+    else
+        printf(", \"syscalls_per_op\": null");
+    if (w->bytes > 0)
+        printf(", \"mb_per_s\": %.1f", w->bytes / w->elapsed / 1e6);
+    printf("}");
+    fflush(stdout);
+
+    first_result = 0;
+    free(w->latency);
+}
+
+/**
+ * Cria STORM_DIRS diretórios na raiz e STORM_FILES arquivos em cada um
+*/
+void bench_create_storm()
+{
+    workload_t w;
+    long ops = (long)STORM_DIRS * scale * (STORM_FILES + 1), i = 0;
+    char name[NAME_SIZE];
+
+    begin(&w, "mkdir_create_storm", ops);
+    for (int d = 0; d < STORM_DIRS * scale; d++)
+    {
+        int ref;
+        snprintf(name, sizeof(name), "d%d", d);
+        TIMED(&w, i, ref = create_entry(name, ROOT_CLUSTER, IS_DIR));
+        i++;
+
+        int cluster = entry_cluster(entry_at(ref));
+        for (int f = 0; f < STORM_FILES; f++)
+        {
+            snprintf(name, sizeof(name), "f%d", f);
+            TIMED(&w, i, create_entry(name, cluster, IS_FILE));
+            i++;
+        }
+    }
+    finish(&w);
+}
+
+/**
+ * Escreve arquivos pequenos, de 1 a SMALL_FILE_MAX bytes, cada um com
+ * a sua entrada
+*/
+void bench_small_writes()
+{
+    workload_t w;
+    long ops = (long)STORM_DIRS * STORM_FILES * scale;
+    int *refs = malloc(ops * sizeof(int));
+    char name[NAME_SIZE], data[SMALL_FILE_MAX];
+
+    memset(data, 'x', sizeof(data));
+    begin(&w, "small_file_write", ops);
+    for (long i = 0; i < ops; i++)
+    {
+        snprintf(name, sizeof(name), "s%ld", i);
+        refs[i] = create_entry(name, ROOT_CLUSTER, IS_FILE);
+    }
+
+    srand(1);
+    for (long i = 0; i < ops; i++)
+    {
+        int len = 1 + rand() % SMALL_FILE_MAX;
+        TIMED(&w, i, {
+            entry_at(refs[i])->size = write_file(data, len, entry_cluster(entry_at(refs[i])));
+            save_entry(refs[i]);
+        });
+        w.bytes += len;
+    }
+    finish(&w);
+    free(refs);
+}
+
+/**
+ * Escreve e depois lê um arquivo de SEQ_FILE_SIZE bytes SEQ_REPS vezes,
+ * inteiro e em pedaços de SEQ_CHUNK bytes por um fs_file_t, que guarda
+ * a posição na cadeia entre as leituras
+*/
+void bench_sequential()
+{
+    workload_t w;
+    char *data = malloc(SEQ_FILE_SIZE), *back = malloc(SEQ_FILE_SIZE);
+    int reps = SEQ_REPS * scale;
+
+    for (int i = 0; i < SEQ_FILE_SIZE; i++)
+        data[i] = (char)i;
+
+    begin(&w, "large_sequential_write", reps);
+    int ref = create_entry("big", ROOT_CLUSTER, IS_FILE);
+    int first = entry_cluster(entry_at(ref));
+    for (int i = 0; i < reps; i++)
+    {
+        TIMED(&w, i, write_file(data, SEQ_FILE_SIZE, first));
+        w.bytes += SEQ_FILE_SIZE;
+    }
+    entry_at(ref)->size = SEQ_FILE_SIZE;
+    save_entry(ref);
+    finish(&w);
+
+    // a leitura usa o arquivo gravado acima, sem formatar a imagem
+    w.name = "large_sequential_read";
+    w.latency = malloc(reps * sizeof(double));
+    w.elapsed = 0;
+    w.bytes = 0;
+    w.syscalls = syscall_count();
+    for (int i = 0; i < reps; i++)
+    {
+        TIMED(&w, i, read_range(first, SEQ_FILE_SIZE, back, SEQ_FILE_SIZE, 0, NULL));
+        w.bytes += SEQ_FILE_SIZE;
+    }
+    if (memcmp(data, back, SEQ_FILE_SIZE) != 0)
+        fprintf(stderr, "large_sequential_read: o conteúdo lido é diferente do escrito\n");
+    finish(&w);
+
+    long chunks = (long)reps * (SEQ_FILE_SIZE / SEQ_CHUNK), i = 0;
+    fs_file_t file;
+
+    memset(back, 0, SEQ_FILE_SIZE);
+    w.name = "large_chunked_read";
+    w.ops = chunks;
+    w.latency = malloc(chunks * sizeof(double));
+    w.elapsed = 0;
+    w.bytes = 0;
+    w.syscalls = syscall_count();
+    for (int r = 0; r < reps; r++)
+    {
+        memset(&file, 0, sizeof(file));
+        for (int offset = 0; offset < SEQ_FILE_SIZE; offset += SEQ_CHUNK, i++)
+        {
+            TIMED(&w, i, read_range(first, SEQ_FILE_SIZE, back + offset, SEQ_CHUNK, offset, &file));
+            w.bytes += SEQ_CHUNK;
+        }
+    }
+    if (memcmp(data, back, SEQ_FILE_SIZE) != 0)
+        fprintf(stderr, "large_chunked_read: o conteúdo lido é diferente do escrito\n");
+    finish(&w);
+
+    free(data);
+    free(back);
+}
+
+/**
+ * Acrescenta registros de LOG_RECORD_SIZE bytes a um único arquivo,
+ * como um log
+*/
+void bench_append_log()
+{
+    workload_t w;
+    long ops = (long)LOG_RECORDS * scale;
+    char record[LOG_RECORD_SIZE];
+
+    memset(record, 'l', sizeof(record));
+    record[LOG_RECORD_SIZE - 1] = '\n';
+
+    begin(&w, "append_log", ops);
+    int ref = create_entry("log", ROOT_CLUSTER, IS_FILE);
+    int first = entry_cluster(entry_at(ref)), size = 0;
+    for (long i = 0; i < ops; i++)
+    {
+        TIMED(&w, i, {
+            size = append_file(record, sizeof(record), first, size);
+            entry_at(ref)->size = size;
+            save_entry(ref);
+        });
+        w.bytes += sizeof(record);
+    }
+    finish(&w);
+}
+
+/**
+ * Resolve os caminhos completos de PATH_BRANCHES ramos de uma árvore
+ * com PATH_DEPTH níveis, alternando entre eles
+*/
+void bench_path_resolution()
+{
+    workload_t w;
+    long ops = (long)PATH_LOOKUPS * scale;
+    int branches = PATH_BRANCHES;
+    char (*paths)[PATH_DEPTH * 8] = malloc(branches * sizeof(*paths));
+    volatile int sink = 0;
+
+    begin(&w, "deep_path_resolution", ops);
+    for (int b = 0; b < branches; b++)
+    {
+        int cluster = ROOT_CLUSTER;
+        char name[NAME_SIZE];
+
+        paths[b][0] = '\0';
+        for (int level = 0; level < PATH_DEPTH; level++)
+        {
+            snprintf(name, sizeof(name), "b%dl%d", b, level);
+            int ref = dir_lookup(cluster, name);
+            if (ref == -1)
+                ref = create_entry(name, cluster, IS_DIR);
+            cluster = entry_cluster(entry_at(ref));
+            strcat(paths[b], "/");
+            strcat(paths[b], name);
+        }
+    }
+
+    for (long i = 0; i < ops; i++)
+        TIMED(&w, i, sink += lookup_dir(paths[i % branches]));
+    finish(&w);
+    free(paths);
+}
+
+/**
+ * Com o disco FILL_PERCENT% cheio e fragmentado, libera um cluster
+ * aleatório e aloca outro a cada operação
+*/
+void bench_alloc_full()
+{
+    workload_t w;
+    long ops = (long)ALLOC_OPS * scale;
+
+    begin(&w, "alloc_nearly_full", ops);
+    int data_clusters = JOURNAL_START - DATA_START;
+    int *used = malloc(data_clusters * sizeof(int)), num_used = 0;
+    for (int i = DATA_START; i < JOURNAL_START; i++)
+        used[num_used++] = i;
+
+    srand(42);
+    while (num_used > (long)data_clusters * FILL_PERCENT / 100)
+    {
+        int victim = rand() % num_used;
+        used[victim] = used[--num_used];
+    }
+    for (int i = 0; i < num_used; i++)
+    {
+        mark_used(used[i]);
+        set_fat(used[i], END_FILE);
+    }
+
+    for (long i = 0; i < ops; i++)
+    {
+        int victim = rand() % num_used;
+        TIMED(&w, i, {
+            release_cluster(used[victim]);
+            used[victim] = find_free_cluster();
+            set_fat(used[victim], END_FILE);
+        });
+    }
+    finish(&w);
+    free(used);
+}
+
+int main(int argc, char **argv)
+{
+    int depth = 0;
+    char dir[] = "/tmp/bench_suiteXXXXXX";
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0)
+            use_mmap = 1;
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+            depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Uso: %s [-m] [-u profundidade] [-s escala]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (scale < 1)
+        scale = 1;
+    if (depth > 0 && (use_mmap || uring_setup(depth) == -1))
+        depth = 0;
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        fprintf(stderr, "Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+    strcpy(image_path, "fat.part");
+
+    printf("{\n  \"cluster_size\": %d,\n  \"num_clusters\": %d,\n  \"mode\": \"%s\",\n  \"uring_depth\": %d,\n  \"scale\": %d,\n  \"workloads\": [\n",
+           SUITE_CLUSTER_SIZE, SUITE_NUM_CLUSTER, use_mmap ? "mmap" : "stdio", depth, scale);
+
+    bench_create_storm();
+    bench_small_writes();
+    bench_sequential();
+    bench_append_log();
+    bench_path_resolution();
+    bench_alloc_full();
+
+    printf("\n  ]\n}\n");
+
+    close_image();
+    unlink(image_path);
+    chdir("/");
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * Benchmark da libfat no modo com threads. Mede quantas operações por
+ * segundo são feitas com 1, 2, 4 e 8 threads, cada uma no seu próprio
+ * diretório: primeiro só com fs_readdir e fs_lookup, e depois criando e
+ * excluindo arquivos com fs_create e fs_unlink entre as listagens
+ *
+ * Uso: ./bench_thread [segundos por medida]
+*/
+#include "../src/fat.c"
+
+#include <time.h>
+
+#define MAX_THREADS 8
+#define FILES 8
+#define CHURN_FILES 32
+
+typedef struct
+{
+    fs_t *fs;
+    int id;
+    int churn;
+    long ops;
+} worker_t;
+
+static volatile int stop_workers = 0;
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Repete as operações da medida no diretório da thread até stop_workers
+*/
+void *run_worker(void *arg)
+{
+    worker_t *worker = arg;
+    fs_stat_t entries[FILES + CHURN_FILES];
+    char dir[64], path[96];
+
+    snprintf(dir, sizeof(dir), "/t%d/a/b", worker->id);
+    for (long i = 0; !stop_workers; i++)
+    {
+        if (worker->churn)
+        {
+            snprintf(path, sizeof(path), "%s/c%ld", dir, i % CHURN_FILES);
+            if (fs_create(worker->fs, path) == 0)
+                fs_unlink(worker->fs, path);
+            worker->ops += 2;
+        }
+        else
+        {
+            fs_lookup(worker->fs, dir, entries);
+            worker->ops++;
+        }
+        fs_readdir(worker->fs, dir, entries, FILES + CHURN_FILES);
+        worker->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * Mede a vazão com count threads
+ *
+ * @return double operações por segundo
+*/
+double measure(fs_t *fs, int count, int churn, double seconds)
+{
+    pthread_t threads[MAX_THREADS];
+    worker_t workers[MAX_THREADS];
+
+    stop_workers = 0;
+    double start = now();
+    for (int i = 0; i < count; i++)
+    {
+        workers[i] = (worker_t){fs, i, churn, 0};
+        pthread_create(&threads[i], NULL, run_worker, &workers[i]);
+    }
+    usleep(seconds * 1e6);
+    stop_workers = 1;
+
+    long total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+        total += workers[i].ops;
+    }
+    return total / (now() - start);
+}
+
+int main(int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+    fs_options_t options = {1, 0, 1};
+    char dir[] = "/tmp/bench_threadXXXXXX", path[96];
+    fs_t *fs;
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        printf("Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+    if (fs_mount("fat.part", &options, &fs) != 0 || fs_format(fs, 4096, 65536, 0) != 0)
+    {
+        printf("Erro ao criar a imagem\n");
+        return 1;
+    }
+
+    // cada thread usa um diretório três níveis abaixo da raiz
+    for (int i = 0; i < MAX_THREADS; i++)
+    {
+        snprintf(path, sizeof(path), "/t%d", i);
+        fs_mkdir(fs, path);
+        strcat(path, "/a");
+        fs_mkdir(fs, path);
+        strcat(path, "/b");
+        fs_mkdir(fs, path);
+        for (int j = 0; j < FILES; j++)
+        {
+            snprintf(path, sizeof(path), "/t%d/a/b/f%d", i, j);
+            fs_create(fs, path);
+        }
+    }
+
+    printf("%ld núcleos, %.1fs por medida\n", sysconf(_SC_NPROCESSORS_ONLN), seconds);
+    double base = 0, churn_base = 0;
+    for (int count = 1; count <= MAX_THREADS; count *= 2)
+    {
+        double reads = measure(fs, count, 0, seconds);
+        double churn = measure(fs, count, 1, seconds);
+        if (count == 1)
+        {
+            base = reads;
+            churn_base = churn;
+        }
+        printf("%d threads: %9.0f operações/s só lendo (%.1fx), %9.0f criando e excluindo (%.1fx)\n",
+               count, reads, reads / base, churn, churn / churn_base);
+    }
+
+    fs_unmount(fs);
+    unlink("fat.part");
+    chdir("/");
+    rmdir(dir);
+    return 0;
+}
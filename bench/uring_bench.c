@@ -0,0 +1,113 @@
+/**
+ * Benchmark do io_uring. Fragmenta o disco para que um arquivo grande
+ * fique espalhado em extensões de um cluster e mede a vazão de
+ * write_file e read_range com E/S síncrona e com o io_uring em várias
+ * profundidades de fila. Antes de cada leitura o cache de páginas do
+ * arquivo da imagem é descartado, para que as leituras cheguem ao disco
+ *
+ * Uso: ./bench_uring [MiB do arquivo]
+*/
+#include "../src/fat.c"
+
+#define BENCH_CLUSTER_SIZE 4096
+#define REPS 3
+
+int depths[] = {0, 1, 4, 16, 64, 256};
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Cria a imagem e ocupa clusters alternados, para que os clusters
+ * livres não tenham vizinhos livres
+ *
+ * @param int número de clusters que o arquivo vai ocupar
+ *
+ * @return int primeiro cluster do arquivo
+*/
+int build_image(int file_clusters)
+{
+    geometry = (geometry_t){GEOMETRY_MAGIC, BENCH_CLUSTER_SIZE, file_clusters * 2 + 4096, 32, 0};
+    apply_geometry();
+    format_image();
+
+    for (int i = DATA_START; i < DATA_START + file_clusters * 2; i += 2)
+    {
+        mark_used(i);
+        set_fat(i, END_FILE);
+    }
+
+    int first = find_free_cluster();
+    set_fat(first, END_FILE);
+    return first;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = (size_t)(argc > 1 ? atol(argv[1]) : 64) << 20;
+    char dir[] = "/tmp/bench_uringXXXXXX";
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        printf("Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+    strcpy(image_path, "fat.part");
+
+    char *data = malloc(len), *back = malloc(len);
+    for (size_t i = 0; i < len; i++)
+        data[i] = (char)(i * 2654435761u >> 24);
+
+    int first = build_image(len / BENCH_CLUSTER_SIZE);
+    printf("arquivo de %zu MiB em extensões de um cluster de %d bytes\n", len >> 20, BENCH_CLUSTER_SIZE);
+
+    for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++)
+    {
+        uring_teardown();
+        if (depths[d] > 0 && uring_setup(depths[d]) == -1)
+        {
+            printf("io_uring indisponível\n");
+            break;
+        }
+
+        double write_time = 0, read_time = 0;
+        for (int rep = 0; rep < REPS; rep++)
+        {
+            double start = now();
+            write_file(data, len, first);
+            fdatasync(image_fd);
+            write_time += now() - start;
+
+            posix_fadvise(image_fd, 0, 0, POSIX_FADV_DONTNEED);
+            start = now();
+            read_range(first, len, back, len, 0, NULL);
+            read_time += now() - start;
+
+            if (memcmp(data, back, len) != 0)
+            {
+                printf("O conteúdo lido é diferente do escrito\n");
+                return 1;
+            }
+        }
+
+        char label[32];
+        if (depths[d] == 0)
+            snprintf(label, sizeof(label), "síncrono    ");
+        else
+            snprintf(label, sizeof(label), "io_uring %3d", depths[d]);
+        printf("%s escrita %8.1f MB/s, leitura %8.1f MB/s\n", label,
+               len * REPS / write_time / 1e6, len * REPS / read_time / 1e6);
+    }
+
+    close_image();
+    unlink(image_path);
+    chdir("/");
+    rmdir(dir);
+    free(data);
+    free(back);
+    return 0;
+}
@@ -0,0 +1,5617 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING
+#endif
+#include "fat.h"
+
+#define SECTOR_SIZE 512
+
+/**
+ * A geometria da imagem é lida do boot block. Um binário especializado
+ * pode fixar parte dela em tempo de compilação (por exemplo com
+ * -DFIXED_CLUSTER_SIZE=4096), e então só abre imagens com essa geometria
+*/
+#ifdef FIXED_CLUSTER_SIZE
+#define CLUSTER_SIZE FIXED_CLUSTER_SIZE
+#else
+#define CLUSTER_SIZE ((int)geometry.cluster_size)
+#endif
+#ifdef FIXED_NUM_CLUSTER
+#define NUM_CLUSTER FIXED_NUM_CLUSTER
+#else
+#define NUM_CLUSTER ((int)geometry.num_clusters)
+#endif
+#ifdef FIXED_FAT_BITS
+#define FAT_BITS FIXED_FAT_BITS
+#else
+#define FAT_BITS ((int)geometry.fat_bits)
+#endif
+
+#define LEGACY_CLUSTER_SIZE 1024
+#define LEGACY_NUM_CLUSTER 4096
+#ifdef FIXED_CLUSTER_SIZE
+#define DEFAULT_CLUSTER_SIZE FIXED_CLUSTER_SIZE
+#else
+#define DEFAULT_CLUSTER_SIZE LEGACY_CLUSTER_SIZE
+#endif
+#ifdef FIXED_NUM_CLUSTER
+#define DEFAULT_NUM_CLUSTER FIXED_NUM_CLUSTER
+#else
+#define DEFAULT_NUM_CLUSTER LEGACY_NUM_CLUSTER
+#endif
+#ifdef FIXED_FAT_BITS
+#define DEFAULT_FAT_BITS FIXED_FAT_BITS
+#else
+#define DEFAULT_FAT_BITS 16
+#endif
+#define MIN_CLUSTER_SIZE 512
+#define MAX_CLUSTER_SIZE 65536
+#define FAT16_MAX_CLUSTER 0xfff0
+#define FAT32_MAX_CLUSTER 0x0ffffff0
+#define GEOMETRY_MAGIC "SHELLFAT"
+#define ENTRY_BY_CLUSTER (CLUSTER_SIZE / (int)sizeof(dir_entry_t))
+#define END_FILE 0xffffffffu
+#define CLUSTER_RESERVED 0xfffffffeu
+#define CLUSTER_BOOT 0xfffffffdu
+#define IMAGE_SIZE ((off_t)NUM_CLUSTER * CLUSTER_SIZE)
+#define FAT_ENTRY_SIZE (FAT_BITS / 8)
+#define FAT_CLUSTERS ((NUM_CLUSTER * FAT_ENTRY_SIZE + CLUSTER_SIZE - 1) / CLUSTER_SIZE)
+#define FAT_SECTORS (FAT_CLUSTERS * CLUSTER_SIZE / SECTOR_SIZE)
+#define FAT_BY_SECTOR (SECTOR_SIZE / FAT_ENTRY_SIZE)
+#define ROOT_CLUSTER (1 + FAT_CLUSTERS)
+#define DATA_START (ROOT_CLUSTER + 1)
+#define FREE_MAP_WORDS ((NUM_CLUSTER + 63) / 64)
+#define NAME_SIZE 18
+#define DIR_INDEX_COUNT 256
+#define INDEX_LOCKS 32
+#define INDEX_BY_LOCK (DIR_INDEX_COUNT / INDEX_LOCKS)
+#define INDEX_EMPTY -1
+#define INDEX_DELETED -2
+#define DENTRY_COUNT 256
+#define ENTRY_REF(cluster, i) ((cluster) * (int)ENTRY_BY_CLUSTER + (i))
+#define REF_CLUSTER(ref) ((ref) / (int)ENTRY_BY_CLUSTER)
+#define REF_INDEX(ref) ((ref) % (int)ENTRY_BY_CLUSTER)
+#define IN_CHAIN(cluster) ((cluster) >= ROOT_CLUSTER && (cluster) < NUM_CLUSTER)
+#define DENTRY_PATH 128
+#define STREAM_CLUSTERS 64
+#define JOURNAL_FAT_BLOCKS 64
+#define JOURNAL_MIN_BLOCKS (CACHE_SIZE + JOURNAL_FAT_BLOCKS)
+#define JOURNAL_MAX_SIZE (32 << 20)
+#define JOURNAL_PERCENT 1
+#define JOURNAL_HEADER_CLUSTERS ((int)geometry.journal_clusters - journal_blocks)
+#define JOURNAL_START (NUM_CLUSTER - (int)geometry.journal_clusters)
+#define JOURNAL_MAGIC 0x4a524e4c
+#define ENTRY_LONG_NAME -ENAMETOOLONG
+#define ENTRY_IN_USE -EEXIST
+#define ENTRY_DISK_FULL -ENOSPC
+#define IS_FILE 0
+#define IS_DIR 1
+#define CLUSTER_FREE 0
+#define CLUSTER_OCCUPIED 1
+#define CACHE_SIZE 64
+#define CACHE_NONE -1
+#define DIR_LOCKS 256
+#define DIR_LOCK_TRIES 64
+#define DIR_READ 0
+#define DIR_WRITE 1
+#define READ_RETRIES 8
+#define STATS_BUCKETS 64
+#define STAT_LOAD_DATA 0
+#define STAT_WRITE_DATA 1
+#define STAT_WRITE_FAT 2
+#define STAT_FIND_FREE 3
+#define STAT_FORMAT 4
+#define STAT_LOAD 5
+#define STAT_SYNC 6
+#define STAT_LOOKUP 7
+#define STAT_READDIR 8
+#define STAT_MKDIR 9
+#define STAT_CREATE 10
+#define STAT_UNLINK 11
+#define STAT_OPEN 12
+#define STAT_PREAD 13
+#define STAT_PWRITE 14
+#define STAT_REPLACE 15
+#define STAT_APPEND 16
+#define STAT_IMPORT 17
+#define STAT_IMPORT_TREE 18
+#define STAT_EXPORT 19
+#define STAT_TRUNCATE 20
+#define STAT_COUNT 21
+#define SYSCALL(call) (thread_stats.syscalls++, (call))
+#define STATS_BEGIN() (stats_enabled ? stats_start() : (stats_mark_t){0, 0, 0})
+#define STATS_END(op, mark)                  \
+    do                                       \
+    {                                        \
+        if ((mark).start_ns != 0)            \
+            stats_record((op), &(mark));     \
+    } while (0)
+#define IMPORT_THREADS 16
+#define IMPORT_OPEN_FILES 256
+
+/**
+ * Estrutura que representa uma entrada de arquivo ou diretório
+*/
+typedef struct
+{
+    uint8_t filename[18];
+    uint8_t attributes;
+    uint8_t reserved[5];
+    uint16_t first_block_hi;
+    uint16_t first_block;
+    uint32_t size;
+} dir_entry_t;
+
+/**
+ * Estrutura que representa um cluster na memoria, e pode conter dados ou
+ * entradas para outros diretórios. O tamanho depende da geometria, então
+ * o cluster é sempre acessado por ponteiro
+*/
+typedef union
+{
+    dir_entry_t dir[0];
+    uint8_t data[0];
+} data_cluster;
+
+/**
+ * Geometria da imagem, gravada no início do boot block. journal_clusters
+ * é o tamanho do diário no fim da imagem, ou 0 se ela não tiver diário.
+ * Imagens sem GEOMETRY_MAGIC usam a geometria original de 4096 clusters
+ * de 1 KiB com fat de 16 bits
+*/
+typedef struct
+{
+    char magic[8];
+    uint32_t cluster_size;
+    uint32_t num_clusters;
+    uint32_t fat_bits;
+    uint32_t journal_clusters;
+} geometry_t;
+
+static geometry_t geometry = {GEOMETRY_MAGIC, DEFAULT_CLUSTER_SIZE, DEFAULT_NUM_CLUSTER, DEFAULT_FAT_BITS, 0};
+
+static uint8_t *boot_block_buf;
+static uint8_t *fat_raw_buf;
+static dir_entry_t *root_dir_buf;
+
+/**
+ * No modo padrão apontam para as cópias em memória acima. No modo
+ * mmap apontam diretamente para as regiões correspondentes do arquivo.
+ * fat_raw é a fat no formato do disco, com entradas de FAT_BITS bits, e
+ * fat a mesma tabela em memória com entradas de 32 bits
+*/
+static uint8_t *boot_block;
+static uint8_t *fat_raw;
+static dir_entry_t *root_dir;
+static uint32_t *fat;
+
+/**
+ * Mapa de bits dos clusters livres: o bit i da palavra i / 64 é 1 quando
+ * o cluster i está livre. free_hint guarda onde a última alocação da
+ * thread terminou, para que a próxima busca continue dali (next-fit).
+ * No modo com threads e durante fs_import_tree o mapa e free_count são
+ * alterados com operações atômicas, para que as threads aloquem sem travas
+*/
+static uint64_t *free_clusters;
+static int free_count = 0;
+static __thread int free_hint = 0;
+
+/**
+ * Último cluster de cada arquivo, indexado pelo primeiro cluster dele,
+ * para que append não precise percorrer a cadeia. 0 quando desconhecido
+*/
+static uint32_t *file_tail;
+
+/**
+ * Quantas vezes a cadeia de cada arquivo foi truncada ou liberada,
+ * indexado pelo primeiro cluster. Uma posição guardada em fs_file_t só
+ * é usada enquanto essa contagem não muda, já que os clusters depois do
+ * primeiro podem ter sido devolvidos e ocupados por outro arquivo
+*/
+static uint32_t *file_gen;
+
+/**
+ * Quantas vezes um arquivo que começava em cada cluster foi excluído. O
+ * arquivo aberto guarda essa contagem, para que uma entrada nova no mesmo
+ * lugar e com o mesmo primeiro cluster não seja confundida com a antiga
+*/
+static uint32_t *entry_gen;
+
+/**
+ * Buffers de trabalho cujo tamanho depende do tamanho do cluster.
+ * stream_buffer é de cada thread e só é alocado no primeiro uso, por
+ * get_stream_buffer. Todas as partes de zero_iov apontam para
+ * zero_cluster, para que uma extensão de zeros seja escrita com uma
+ * única chamada
+*/
+static uint8_t *zero_cluster;
+static struct iovec zero_iov[IOV_MAX];
+static uint8_t *journal_buffer;
+static __thread uint8_t *stream_buffer = NULL;
+static __thread size_t stream_buffer_size = 0;
+
+/**
+ * Primeiro erro de E/S ou de memória da função da interface em execução
+ * na thread. As funções internas que não retornam códigos de erro o
+ * guardam aqui, e fs_leave o devolve no lugar do resultado da função
+*/
+static __thread int pending_error = 0;
+
+/**
+ * fat_dirty indica que a fat em memória tem alterações ainda não
+ * gravadas, e fat_dirty_sector quais setores da fat foram alterados.
+ * image_mtime guarda a data de modificação do arquivo após a última
+ * sincronização, para detectar alterações feitas por outro processo
+*/
+static int fat_dirty = 0, fat_dirty_clusters = 0;
+static uint8_t *fat_dirty_sector;
+static struct timespec image_mtime;
+
+/**
+ * Cabeçalho do diário, gravado no cluster JOURNAL_START e seguido pelas
+ * cópias dos count clusters da transação. targets[i] é o cluster onde a
+ * cópia i deve ser gravada, e checksum cobre o cabeçalho e as cópias.
+ * O cabeçalho ocupa os primeiros clusters do diário, com espaço para um
+ * alvo por cluster do diário, e os demais guardam as cópias
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t count;
+    uint64_t sequence;
+    uint64_t checksum;
+    uint32_t targets[];
+} journal_header_t;
+
+/**
+ * journal_enabled indica que a imagem reserva a área do diário,
+ * journal_pending que o diário tem uma transação que ainda não foi
+ * apagada, e checkpointing que as alterações já estão no diário e
+ * podem ser gravadas nos seus lugares. journal_blocks é o número de
+ * cópias que cabem no diário, e journal_iov tem espaço para o cabeçalho
+ * e para todas elas
+*/
+static int journal_enabled = 0, journal_pending = 0;
+static int journal_blocks = 0;
+static struct iovec *journal_iov;
+static int checkpointing = 0;
+static uint64_t journal_sequence = 0;
+
+/**
+ * Entrada do cache de clusters. As entradas formam uma lista
+ * duplamente encadeada em ordem de uso (LRU), onde cache_head
+ * é a mais recente e cache_tail a próxima a ser descartada
+*/
+typedef struct
+{
+    int cluster;
+    int dirty;
+    int prev;
+    int next;
+    data_cluster *data;
+} cache_entry_t;
+
+/**
+ * Posição de uma tabela hash de diretório. pos é a referência da entrada
+ * (ENTRY_REF, o cluster do diretório onde ela está e o índice dentro
+ * dele), ou INDEX_EMPTY / INDEX_DELETED. first_block e attributes são
+ * copiados da entrada para que a resolução de caminhos não precise ler
+ * o cluster do diretório
+*/
+typedef struct
+{
+    char name[NAME_SIZE];
+    uint8_t attributes;
+    uint32_t first_block;
+    int32_t pos;
+} index_slot_t;
+
+/**
+ * Índice em memória das entradas de um diretório, uma tabela hash com
+ * endereçamento aberto e sondagem linear indexada pelo nome da entrada.
+ * free_refs é uma pilha com as referências das entradas livres de todos
+ * os clusters do diretório, e tail o último cluster da cadeia. O índice
+ * do diretório que começa no cluster c fica entre os INDEX_BY_LOCK
+ * índices da trava c % INDEX_LOCKS, reaproveitados em ordem circular
+*/
+typedef struct
+{
+    int cluster;
+    int tail;
+    int capacity;
+    int used;
+    int count;
+    index_slot_t *slots;
+    int *free_refs;
+    int free_count;
+    int free_capacity;
+} dir_index_t;
+
+static dir_index_t dir_indexes[DIR_INDEX_COUNT];
+static int16_t *dir_index_slot;
+static int dir_index_ready = 0, dir_index_next[INDEX_LOCKS];
+
+/**
+ * Entrada do cache de caminhos, que associa um caminho de diretório
+ * (sem a barra inicial, como "a/b/c") ao cluster do diretório. O cache
+ * é mapeado diretamente pelo hash do caminho. seq é ímpar enquanto a
+ * entrada é alterada, e quem a lê sem trava descarta a leitura se seq
+ * mudar durante ela
+*/
+typedef struct
+{
+    uint32_t seq;
+    int cluster;
+    char path[DENTRY_PATH];
+} dentry_t;
+
+static dentry_t dentries[DENTRY_COUNT];
+
+/**
+ * Contagem de exclusões de diretório, ímpar durante uma delas. Os
+ * caminhos são resolvidos sem trava, e quem resolve um caminho repete a
+ * busca se um diretório foi excluído durante ela
+*/
+static uint32_t dir_removals = 0;
+
+/**
+ * Descritor e caminho do arquivo da imagem montada. image_loaded indica
+ * que a imagem foi carregada ou formatada e pode ser usada
+*/
+static int image_fd = -1;
+static char image_path[PATH_MAX];
+static int image_loaded = 0;
+static int use_mmap = 0;
+
+/**
+ * Requisição de E/S de uma extensão, guardada enquanto um grupo de
+ * requisições é montado. len é o total de bytes dos iovecs, e done
+ * marca as que o io_uring já completou. Requisições de até duas partes
+ * têm os iovecs copiados em iov; as maiores usam os do chamador por vec
+*/
+typedef struct
+{
+    int write;
+    off_t offset;
+    size_t len;
+    struct iovec iov[2];
+    const struct iovec *vec;
+    int iovcnt;
+    int done;
+} io_request_t;
+
+#ifdef HAVE_IO_URING
+/**
+ * Anel do io_uring, com as filas de envio (sq) e de conclusões (cq)
+ * mapeadas do kernel. depth é o número máximo de requisições enviadas
+ * de uma vez
+*/
+typedef struct
+{
+    int fd;
+    unsigned depth;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring_t;
+
+static uring_t ring = {.fd = -1};
+#endif
+
+/**
+ * Com a opção uring_depth de fs_mount, write_chain e read_range agrupam
+ * as extensões de uma operação entre io_batch_begin e io_batch_end e as
+ * enviam juntas ao io_uring. io_batching conta os grupos abertos na
+ * thread, e as threads que não abrem grupos continuam com E/S síncrona.
+ * O io_uring não é usado com a opção threads, então io_requests não tem trava
+*/
+static int uring_depth = 0;
+static io_request_t *io_requests;
+static int io_pending = 0;
+static __thread int io_batching = 0;
+
+/**
+ * Trava de um diretório no modo com threads. O diretório que começa no
+ * cluster c usa dir_locks[c % DIR_LOCKS], tomada para escrita por quem
+ * altera as suas entradas ou o conteúdo dos seus arquivos. seq conta as
+ * escritas e é ímpar durante uma delas, para que ls e read leiam sem
+ * travar e repitam a leitura se ela mudar
+*/
+typedef struct
+{
+    pthread_rwlock_t lock;
+    uint32_t seq;
+} __attribute__((aligned(64))) dir_lock_t;
+
+/**
+ * Arquivo do host copiado por fs_import_tree. As threads ocupam os clusters
+ * de cada parte de STREAM_CLUSTERS clusters e os guardam em clusters, na
+ * ordem do arquivo. Quando chunks_left chega a zero o arquivo vai para
+ * a lista done, de onde o committer o encadeia na fat. error guarda o
+ * primeiro erro de uma das partes
+*/
+typedef struct import_file
+{
+    int fd;
+    int ref;
+    off_t size;
+    int num_blocks;
+    uint32_t *clusters;
+    int chunks_left;
+    int error;
+    struct import_file *next;
+    char host[];
+} import_file_t;
+
+typedef struct
+{
+    import_file_t *file;
+    int chunk;
+} import_job_t;
+
+/**
+ * Fila de tarefas de uma thread de fs_import_tree. A dona tira as tarefas do
+ * fim (tail) e as outras threads roubam do começo (head) quando as suas
+ * filas esvaziam
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    import_job_t *jobs;
+    int head;
+    int tail;
+    int capacity;
+} __attribute__((aligned(64))) job_queue_t;
+
+/**
+ * Estado de um fs_import_tree. queued conta as tarefas ainda nas filas e é
+ * incrementado com lock tomada, para que work_cond não perca avisos.
+ * in_flight conta os arquivos entregues às threads e ainda não
+ * encadeados pelo committer, e result recebe as contagens e os erros
+ * da importação. worker_syscalls e worker_bytes somam as
+ * estatísticas das threads, que são creditadas a fs_import_tree no fim
+*/
+typedef struct
+{
+    job_queue_t queues[IMPORT_THREADS];
+    pthread_t threads[IMPORT_THREADS];
+    int workers;
+    int started;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    int queued;
+    int stop;
+    import_file_t *done;
+    int in_flight;
+    int next_queue;
+    fs_import_t *result;
+    int disk_full;
+    uint64_t worker_syscalls;
+    uint64_t worker_bytes;
+} import_t;
+
+/**
+ * threaded indica a opção threads de fs_mount, sem a qual nenhuma trava
+ * é usada. index_locks[c % INDEX_LOCKS] protege o índice do diretório
+ * que começa no cluster c, é sempre tomada depois da trava do diretório
+ * e nunca junto com outra de index_locks. sync_lock é
+ * tomada para leitura por cada função da interface e para escrita por
+ * quem grava ou troca a imagem inteira. shared_alloc faz o alocador de
+ * clusters usar operações atômicas, no modo com threads e enquanto as
+ * threads de fs_import_tree alocam
+*/
+static int threaded = 0;
+static int shared_alloc = 0;
+static dir_lock_t dir_locks[DIR_LOCKS];
+static pthread_mutex_t index_locks[INDEX_LOCKS];
+static pthread_rwlock_t sync_lock;
+static uint8_t *image_map = NULL;
+static cache_entry_t cache[CACHE_SIZE];
+static int16_t *cache_slot;
+static int cache_head = CACHE_NONE, cache_tail = CACHE_NONE;
+static uint64_t cache_hits, cache_misses;
+
+/**
+ * Contadores da thread, sempre incrementados: syscalls conta as chamadas
+ * de E/S feitas pela biblioteca, e bytes os bytes lidos ou gravados na imagem
+ * e nos arquivos do host. As estatísticas de uma operação guardam a
+ * diferença desses contadores entre o começo e o fim dela
+*/
+typedef struct
+{
+    uint64_t syscalls;
+    uint64_t bytes;
+} thread_stats_t;
+
+/**
+ * Estatísticas acumuladas de uma função. histogram[i] conta
+ * as chamadas que levaram de 2^(i-1) a 2^i nanossegundos
+*/
+typedef struct
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t syscalls;
+    uint64_t bytes;
+    uint64_t histogram[STATS_BUCKETS];
+} op_stats_t;
+
+/**
+ * Início de uma medida, com start_ns 0 quando a coleta está desligada
+*/
+typedef struct
+{
+    uint64_t start_ns;
+    uint64_t syscalls;
+    uint64_t bytes;
+} stats_mark_t;
+
+/**
+ * A coleta é ligada por fs_stats_enable. Desligada, cada ponto medido
+ * custa apenas o teste de stats_enabled. Os nomes seguem a ordem das
+ * constantes STAT_*, com as funções da interface a partir de STAT_FORMAT
+*/
+static int stats_enabled = 0;
+static op_stats_t op_stats[STAT_COUNT];
+static __thread thread_stats_t thread_stats;
+static const char *stat_names[STAT_COUNT] = {
+    "load_data", "write_data", "write_fat", "find_free_cluster",
+    "fs_format", "fs_load", "fs_sync", "fs_lookup", "fs_readdir", "fs_mkdir",
+    "fs_create", "fs_unlink", "fs_open", "fs_pread", "fs_pwrite", "fs_replace",
+    "fs_append", "fs_import", "fs_import_tree", "fs_export", "fs_truncate",
+};
+
+static void close_image();
+static void journal_clear();
+static void free_chain(int cluster);
+static void write_fat();
+static void fat_encode();
+static void remember_mtime();
+static void sync_image();
+
+/**
+ * Retorna o primeiro cluster da entrada. Com a fat de 32 bits a parte
+ * alta do número fica em first_block_hi
+ *
+ * @param dir_entry_t* entrada do diretório
+ *
+ * @return uint32_t primeiro cluster da entrada
+*/
+static uint32_t entry_cluster(const dir_entry_t *entry)
+{
+    if (FAT_BITS == 16)
+        return entry->first_block;
+    return entry->first_block | (uint32_t)entry->first_block_hi << 16;
+}
+
+/**
+ * Altera o primeiro cluster da entrada
+ *
+ * @param dir_entry_t* entrada do diretório
+ * @param uint32_t primeiro cluster da entrada
+*/
+static void set_entry_cluster(dir_entry_t *entry, uint32_t cluster)
+{
+    entry->first_block = cluster & 0xffff;
+    entry->first_block_hi = FAT_BITS == 16 ? 0 : cluster >> 16;
+}
+
+/**
+ * Guarda error em pending_error, se a função da interface em execução
+ * ainda não tiver falhado
+ *
+ * @param int código de erro negativo
+*/
+static void set_error(int error)
+{
+    if (pending_error == 0)
+        pending_error = error;
+}
+
+/**
+ * Verifica o retorno de uma chamada de E/S sobre a imagem, guardando
+ * -EIO se ela falhou ou transferiu menos bytes
+ *
+ * @param ssize_t retorno da chamada
+ * @param size_t retorno esperado, os bytes pedidos ou 0 para fdatasync,
+ * msync e ftruncate
+*/
+static void io_check(ssize_t result, size_t expected)
+{
+    if (result != (ssize_t)expected)
+        set_error(-EIO);
+}
+
+/**
+ * Mapeia os IMAGE_SIZE bytes do arquivo image_path na memória e faz
+ * boot_block, fat_raw e root_dir apontarem para dentro do mapeamento
+ *
+ * @return int 0, -EINVAL se o arquivo for menor que a imagem ou -ENOMEM
+ * se o mapeamento falhar
+*/
+static int map_image()
+{
+    struct stat st;
+    if (fstat(image_fd, &st) == -1 || st.st_size < IMAGE_SIZE)
+        return -EINVAL;
+
+    void *map = mmap(NULL, IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, image_fd, 0);
+    if (map == MAP_FAILED)
+        return -ENOMEM;
+
+    image_map = map;
+    boot_block = image_map;
+    fat_raw = image_map + CLUSTER_SIZE;
+    root_dir = (dir_entry_t *)(image_map + (off_t)ROOT_CLUSTER * CLUSTER_SIZE);
+    return 0;
+}
+
+/**
+ * Desfaz o mapeamento do arquivo image_path, gravando antes as páginas
+ * alteradas, e volta a usar as cópias em memória
+*/
+static void unmap_image()
+{
+    if (image_map == NULL)
+        return;
+
+    io_check(SYSCALL(msync(image_map, IMAGE_SIZE, MS_SYNC)), 0);
+    munmap(image_map, IMAGE_SIZE);
+    image_map = NULL;
+    boot_block = boot_block_buf;
+    fat_raw = fat_raw_buf;
+    root_dir = root_dir_buf;
+}
+
+/**
+ * Calcula quantas cópias de clusters cabem em um diário de clusters
+ * clusters, descontado o cabeçalho
+ *
+ * @param uint64_t tamanho do diário em clusters
+ * @param uint32_t tamanho do cluster em bytes
+ *
+ * @return uint64_t número de cópias
+*/
+static uint64_t journal_capacity(uint64_t clusters, uint32_t size)
+{
+    uint64_t header = (sizeof(journal_header_t) + clusters * sizeof(uint32_t) + size - 1) / size;
+    return clusters > header ? clusters - header : 0;
+}
+
+/**
+ * Retorna o maior número de cópias do diário para o tamanho de cluster,
+ * limitado a JOURNAL_MAX_SIZE bytes mas nunca menor que JOURNAL_MIN_BLOCKS
+ *
+ * @param uint32_t tamanho do cluster em bytes
+ *
+ * @return uint64_t número de cópias
+*/
+static uint64_t journal_max_blocks(uint32_t size)
+{
+    uint64_t blocks = JOURNAL_MAX_SIZE / size;
+    return blocks < JOURNAL_MIN_BLOCKS ? JOURNAL_MIN_BLOCKS : blocks;
+}
+
+/**
+ * Escolhe o tamanho do diário de uma imagem nova: JOURNAL_PERCENT por
+ * cento dos clusters em cópias, entre JOURNAL_MIN_BLOCKS, que comportam
+ * uma transação com o cache inteiro, e journal_max_blocks
+ *
+ * @param uint32_t número de clusters da imagem
+ * @param uint32_t tamanho do cluster em bytes
+ *
+ * @return uint32_t tamanho do diário em clusters, com o cabeçalho
+*/
+static uint32_t journal_size(uint32_t num_clusters, uint32_t size)
+{
+    uint64_t blocks = (uint64_t)num_clusters * JOURNAL_PERCENT / 100;
+    if (blocks > journal_max_blocks(size))
+        blocks = journal_max_blocks(size);
+    if (blocks < JOURNAL_MIN_BLOCKS)
+        blocks = JOURNAL_MIN_BLOCKS;
+
+    uint64_t clusters = blocks;
+    while (journal_capacity(clusters, size) < blocks)
+        clusters++;
+    return clusters;
+}
+
+/**
+ * Verifica se a geometria g é válida e suportada por este binário
+ *
+ * @param geometry_t* geometria a verificar
+ *
+ * @return int 1 se a geometria for válida, 0 caso contrário
+*/
+static int geometry_valid(const geometry_t *g)
+{
+    uint32_t size = g->cluster_size;
+    if (size < MIN_CLUSTER_SIZE || size > MAX_CLUSTER_SIZE || (size & (size - 1)) != 0)
+        return 0;
+    if (g->fat_bits != 16 && g->fat_bits != 32)
+        return 0;
+    if (g->num_clusters > (g->fat_bits == 16 ? FAT16_MAX_CLUSTER : FAT32_MAX_CLUSTER))
+        return 0;
+
+    // referências de entradas de diretório precisam caber em um int
+    if ((uint64_t)g->num_clusters * (size / sizeof(dir_entry_t)) > INT32_MAX)
+        return 0;
+
+    uint64_t fat_clusters = ((uint64_t)g->num_clusters * (g->fat_bits / 8) + size - 1) / size;
+    if (g->num_clusters < 2 + fat_clusters + g->journal_clusters + 1)
+        return 0;
+
+    // o diário precisa comportar uma transação com o cache inteiro
+    uint64_t blocks = journal_capacity(g->journal_clusters, size);
+    if (g->journal_clusters != 0 && (blocks < JOURNAL_MIN_BLOCKS || blocks > journal_max_blocks(size)))
+        return 0;
+
+#ifdef FIXED_CLUSTER_SIZE
+    if (size != FIXED_CLUSTER_SIZE)
+        return 0;
+#endif
+#ifdef FIXED_NUM_CLUSTER
+    if (g->num_clusters != FIXED_NUM_CLUSTER)
+        return 0;
+#endif
+#ifdef FIXED_FAT_BITS
+    if (g->fat_bits != FIXED_FAT_BITS)
+        return 0;
+#endif
+    return 1;
+}
+
+/**
+ * Aloca as tabelas e buffers cujo tamanho depende da geometria atual,
+ * descartando os anteriores
+ *
+ * @return int 0, ou -ENOMEM, quando a imagem não pode ser usada até a
+ * próxima chamada
+*/
+static int apply_geometry()
+{
+    free(boot_block_buf);
+    free(fat_raw_buf);
+    free(root_dir_buf);
+    free(fat);
+    free(free_clusters);
+    free(file_tail);
+    free(file_gen);
+    free(entry_gen);
+    free(fat_dirty_sector);
+    free(dir_index_slot);
+    free(cache_slot);
+    free(zero_cluster);
+    free(journal_buffer);
+    free(journal_iov);
+    if (cache[0].data != NULL)
+        free(cache[0].data);
+
+    boot_block = boot_block_buf = malloc(CLUSTER_SIZE);
+    fat_raw = fat_raw_buf = calloc(FAT_CLUSTERS, CLUSTER_SIZE);
+    root_dir = root_dir_buf = malloc(CLUSTER_SIZE);
+    fat = calloc(NUM_CLUSTER, sizeof(uint32_t));
+    free_clusters = calloc(FREE_MAP_WORDS, sizeof(uint64_t));
+    file_tail = calloc(NUM_CLUSTER, sizeof(uint32_t));
+    file_gen = calloc(NUM_CLUSTER, sizeof(uint32_t));
+    entry_gen = calloc(NUM_CLUSTER, sizeof(uint32_t));
+    fat_dirty_sector = calloc(FAT_SECTORS, 1);
+    dir_index_slot = malloc(NUM_CLUSTER * sizeof(int16_t));
+    cache_slot = malloc(NUM_CLUSTER * sizeof(int16_t));
+    zero_cluster = calloc(1, CLUSTER_SIZE);
+    journal_blocks = journal_capacity(geometry.journal_clusters, CLUSTER_SIZE);
+    // imagens sem diário ainda recebem um cluster, para que malloc não retorne NULL
+    journal_buffer = malloc(((size_t)geometry.journal_clusters + 1) * CLUSTER_SIZE);
+    journal_iov = malloc((1 + (size_t)journal_blocks) * sizeof(struct iovec));
+
+    uint8_t *cache_data = malloc((size_t)CACHE_SIZE * CLUSTER_SIZE);
+    for (int i = 0; i < CACHE_SIZE; i++)
+        cache[i].data = (data_cluster *)(cache_data + (size_t)i * CLUSTER_SIZE);
+
+    if (boot_block == NULL || fat_raw == NULL || root_dir == NULL || fat == NULL || free_clusters == NULL ||
+        file_tail == NULL || file_gen == NULL || entry_gen == NULL || fat_dirty_sector == NULL || dir_index_slot == NULL || cache_slot == NULL ||
+        zero_cluster == NULL || journal_buffer == NULL || journal_iov == NULL || cache_data == NULL)
+        return -ENOMEM;
+    for (int i = 0; i < IOV_MAX; i++)
+        zero_iov[i] = (struct iovec){zero_cluster, CLUSTER_SIZE};
+    fat_dirty = fat_dirty_clusters = 0;
+
+    // o cache e os índices de diretório são recriados no próximo acesso
+    cache_head = cache_tail = CACHE_NONE;
+    dir_index_ready = 0;
+    return 0;
+}
+
+/**
+ * Retorna o buffer de STREAM_CLUSTERS clusters da thread atual,
+ * realocando-o se o tamanho do cluster mudou desde o último uso
+ *
+ * @return uint8_t* buffer da thread, ou NULL se não houver memória
+*/
+static uint8_t *get_stream_buffer()
+{
+    size_t size = (size_t)STREAM_CLUSTERS * CLUSTER_SIZE;
+
+    if (stream_buffer_size != size)
+    {
+        free(stream_buffer);
+        stream_buffer = malloc(size);
+        stream_buffer_size = stream_buffer == NULL ? 0 : size;
+    }
+    return stream_buffer;
+}
+
+/**
+ * Lê a geometria do boot block do arquivo image_path. Imagens sem
+ * GEOMETRY_MAGIC recebem a geometria original
+ *
+ * @param geometry_t* geometria lida
+ *
+ * @return int 0 em caso de sucesso ou -1 se a geometria for inválida
+*/
+static int read_geometry(geometry_t *g)
+{
+    if (pread(image_fd, g, sizeof(*g), 0) != sizeof(*g) || memcmp(g->magic, GEOMETRY_MAGIC, sizeof(g->magic)) != 0)
+    {
+        memcpy(g->magic, GEOMETRY_MAGIC, sizeof(g->magic));
+        g->cluster_size = LEGACY_CLUSTER_SIZE;
+        g->num_clusters = LEGACY_NUM_CLUSTER;
+        g->fat_bits = 16;
+        g->journal_clusters = 0;
+    }
+    return geometry_valid(g) ? 0 : -1;
+}
+
+/**
+ * Abre o arquivo image_path, caso ainda não esteja aberto. O descritor
+ * é mantido até fs_unmount ou até a saída do programa
+ *
+ * @param int flags extras para o open, como O_CREAT e O_TRUNC
+ *
+ * @return int 0 em caso de sucesso ou o erro do open
+*/
+static int open_image(int flags)
+{
+    if (image_fd != -1 && !(flags & O_TRUNC))
+        return 0;
+
+    if (image_fd != -1)
+        close_image();
+
+    image_fd = open(image_path, O_RDWR | flags, 0644);
+    if (image_fd == -1)
+        return -errno;
+
+    static int registered = 0;
+    if (!registered)
+    {
+        atexit(close_image);
+        registered = 1;
+    }
+    return 0;
+}
+
+/**
+ * Remove a entrada slot da lista LRU
+ *
+ * @param int posição da entrada no cache
+*/
+static void cache_unlink(int slot)
+{
+    cache_entry_t *entry = &cache[slot];
+
+    if (entry->prev != CACHE_NONE)
+        cache[entry->prev].next = entry->next;
+    else
+        cache_head = entry->next;
+
+    if (entry->next != CACHE_NONE)
+        cache[entry->next].prev = entry->prev;
+    else
+        cache_tail = entry->prev;
+
+    entry->prev = entry->next = CACHE_NONE;
+}
+
+/**
+ * Coloca a entrada slot no início da lista LRU
+ *
+ * @param int posição da entrada no cache
+*/
+static void cache_push_front(int slot)
+{
+    cache[slot].prev = CACHE_NONE;
+    cache[slot].next = cache_head;
+    if (cache_head != CACHE_NONE)
+        cache[cache_head].prev = slot;
+    cache_head = slot;
+    if (cache_tail == CACHE_NONE)
+        cache_tail = slot;
+}
+
+/**
+ * Grava no disco o cluster da entrada slot, caso ele tenha sido alterado
+ *
+ * @param int posição da entrada no cache
+*/
+static void cache_write_back(int slot)
+{
+    cache_entry_t *entry = &cache[slot];
+
+    if (!entry->dirty)
+        return;
+
+    // com o diário, um cluster só vai para o seu lugar depois de ser
+    // registrado, então todas as alterações pendentes são confirmadas.
+    // Isso só acontece antes de uma leitura direta, já que cache_victim
+    // não escolhe clusters alterados
+    if (journal_enabled && !checkpointing)
+    {
+        sync_image();
+        return;
+    }
+
+    open_image(0);
+    io_check(SYSCALL(pwrite(image_fd, entry->data, CLUSTER_SIZE, (off_t)entry->cluster * CLUSTER_SIZE)), CLUSTER_SIZE);
+    thread_stats.bytes += CLUSTER_SIZE;
+    entry->dirty = 0;
+}
+
+/**
+ * Inicializa o cache vazio, descartando qualquer conteúdo anterior
+ * sem gravá-lo no disco
+*/
+static void cache_reset()
+{
+    cache_head = cache_tail = CACHE_NONE;
+    for (int i = 0; i < NUM_CLUSTER; i++)
+        cache_slot[i] = CACHE_NONE;
+
+    for (int i = 0; i < CACHE_SIZE; i++)
+    {
+        cache[i].cluster = CACHE_NONE;
+        cache[i].dirty = 0;
+        cache_push_front(i);
+    }
+}
+
+/**
+ * Grava no disco os clusters alterados no cache entre start e
+ * start + count, antes de uma leitura direta do arquivo
+ *
+ * @param int primeiro cluster
+ * @param int número de clusters
+*/
+static void cache_write_range(int start, int count)
+{
+    if (cache_head == CACHE_NONE)
+        return;
+
+    for (int i = 0; i < count; i++)
+        if (cache_slot[start + i] != CACHE_NONE)
+            cache_write_back(cache_slot[start + i]);
+}
+
+/**
+ * Remove o cluster do cache sem gravá-lo, usado quando o cluster vai
+ * ser sobrescrito diretamente no disco
+ *
+ * @param int posição do cluster
+*/
+static void cache_drop(int cluster)
+{
+    if (cache_head == CACHE_NONE || cache_slot[cluster] == CACHE_NONE)
+        return;
+
+    int slot = cache_slot[cluster];
+    cache_slot[cluster] = CACHE_NONE;
+    cache[slot].cluster = CACHE_NONE;
+    cache[slot].dirty = 0;
+
+    // a entrada vazia passa a ser a primeira a ser reaproveitada
+    cache_unlink(slot);
+    cache[slot].prev = cache_tail;
+    if (cache_tail != CACHE_NONE)
+        cache[cache_tail].next = slot;
+    cache_tail = slot;
+    if (cache_head == CACHE_NONE)
+        cache_head = slot;
+}
+
+/**
+ * Grava no disco todos os clusters alterados que estão no cache
+*/
+static void cache_flush()
+{
+    if (cache_head == CACHE_NONE)
+        return;
+
+    for (int i = 0; i < CACHE_SIZE; i++)
+        if (cache[i].cluster != CACHE_NONE)
+            cache_write_back(i);
+}
+
+/**
+ * Escolhe a entrada do cache que será reaproveitada. Com o diário, os
+ * clusters alterados ficam no cache até a próxima transação, então a
+ * escolhida é a menos usada que não foi alterada. Só quando todas foram
+ * alteradas a transação é confirmada, o que grava todas de uma vez
+ *
+ * @return int posição da entrada
+*/
+static int cache_victim()
+{
+    if (!journal_enabled || checkpointing)
+        return cache_tail;
+
+    for (int slot = cache_tail; slot != CACHE_NONE; slot = cache[slot].prev)
+        if (!cache[slot].dirty)
+            return slot;
+
+    sync_image();
+    return cache_tail;
+}
+
+/**
+ * Retorna a entrada do cache que contém o cluster, trazendo-a para o
+ * início da lista LRU. Em caso de falta, a entrada menos usada é
+ * reaproveitada e, se fill for verdadeiro, o cluster é lido do disco
+ *
+ * @param int posição do cluster
+ * @param int flag se o conteúdo deve ser lido do disco em caso de falta
+ *
+ * @return cache_entry_t* entrada que contém o cluster
+*/
+static cache_entry_t *cache_get(int cluster, int fill)
+{
+    if (cache_head == CACHE_NONE)
+        cache_reset();
+
+    int slot = cache_slot[cluster];
+    if (slot != CACHE_NONE)
+    {
+        cache_hits++;
+        cache_unlink(slot);
+        cache_push_front(slot);
+        return &cache[slot];
+    }
+
+    cache_misses++;
+    slot = cache_victim();
+    cache_write_back(slot);
+    if (cache[slot].cluster != CACHE_NONE)
+        cache_slot[cache[slot].cluster] = CACHE_NONE;
+
+    cache[slot].cluster = cluster;
+    cache_slot[cluster] = slot;
+    cache_unlink(slot);
+    cache_push_front(slot);
+
+    if (fill)
+    {
+        open_image(0);
+        io_check(SYSCALL(pread(image_fd, cache[slot].data, CLUSTER_SIZE, (off_t)cluster * CLUSTER_SIZE)), CLUSTER_SIZE);
+        thread_stats.bytes += CLUSTER_SIZE;
+    }
+
+    return &cache[slot];
+}
+
+/**
+ * Grava os clusters pendentes e fecha o arquivo image_path
+*/
+static void close_image()
+{
+    if (image_fd == -1)
+        return;
+
+    unmap_image();
+    cache_flush();
+    if (journal_pending)
+        journal_clear();
+    close(image_fd);
+    image_fd = -1;
+}
+
+/**
+ * Calcula o hash FNV-1a de 64 bits do cabeçalho do diário, com o campo
+ * checksum zerado, e das cópias dos clusters da transação
+ *
+ * @param uint8_t* clusters do cabeçalho
+ * @param struct iovec* cópias dos clusters
+ * @param int número de cópias
+ *
+ * @return uint64_t hash da transação
+*/
+static uint64_t journal_checksum(const uint8_t *header, const struct iovec *blocks, int count)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (int i = 0; i < JOURNAL_HEADER_CLUSTERS * CLUSTER_SIZE; i++)
+    {
+        hash ^= header[i];
+        hash *= 1099511628211ull;
+    }
+    for (int b = 0; b < count; b++)
+    {
+        for (size_t i = 0; i < blocks[b].iov_len; i++)
+        {
+            hash ^= ((uint8_t *)blocks[b].iov_base)[i];
+            hash *= 1099511628211ull;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Registra no diário, em uma única transação, os clusters da fat com
+ * setores alterados e todos os clusters alterados no cache. Só depois
+ * da transação estar no disco eles podem ser gravados nos seus lugares.
+ * Como o cache tem CACHE_SIZE clusters e set_fat confirma a transação
+ * antes de alterar mais de journal_blocks - CACHE_SIZE clusters da fat,
+ * ela sempre cabe nas journal_blocks cópias do diário
+*/
+static void journal_commit()
+{
+    uint8_t *header_buf = journal_buffer;
+    size_t header_size = (size_t)JOURNAL_HEADER_CLUSTERS * CLUSTER_SIZE;
+    journal_header_t *header = (journal_header_t *)header_buf;
+    struct iovec *iov = journal_iov;
+    int count = 0;
+
+    memset(header_buf, 0x00, header_size);
+    fat_encode();
+
+    for (int c = 0; c < (int)FAT_CLUSTERS; c++)
+    {
+        int sectors = CLUSTER_SIZE / SECTOR_SIZE, dirty = 0;
+        for (int i = 0; i < sectors; i++)
+            dirty |= fat_dirty_sector[c * sectors + i];
+        if (!dirty)
+            continue;
+
+        header->targets[count] = 1 + c;
+        iov[1 + count].iov_base = fat_raw + (size_t)c * CLUSTER_SIZE;
+        iov[1 + count].iov_len = CLUSTER_SIZE;
+        count++;
+    }
+
+    for (int i = 0; cache_head != CACHE_NONE && i < CACHE_SIZE; i++)
+    {
+        if (cache[i].cluster == CACHE_NONE || !cache[i].dirty)
+            continue;
+
+        header->targets[count] = cache[i].cluster;
+        iov[1 + count].iov_base = cache[i].data;
+        iov[1 + count].iov_len = CLUSTER_SIZE;
+        count++;
+    }
+
+    if (count == 0)
+        return;
+
+    header->magic = JOURNAL_MAGIC;
+    header->count = count;
+    header->sequence = ++journal_sequence;
+    header->checksum = journal_checksum(header_buf, iov + 1, count);
+    iov[0].iov_base = header_buf;
+    iov[0].iov_len = header_size;
+
+    // a transação anterior e os dados gravados diretamente precisam estar
+    // no disco antes que o diário seja sobrescrito
+    io_check(SYSCALL(fdatasync(image_fd)), 0);
+
+    // pwritev aceita no máximo IOV_MAX partes por chamada
+    off_t offset = (off_t)JOURNAL_START * CLUSTER_SIZE;
+    for (int i = 0; i < count + 1; i += IOV_MAX)
+    {
+        int parts = count + 1 - i < IOV_MAX ? count + 1 - i : IOV_MAX;
+        size_t len = (size_t)parts * CLUSTER_SIZE + (i == 0 ? header_size - CLUSTER_SIZE : 0);
+        io_check(SYSCALL(pwritev(image_fd, iov + i, parts, offset)), len);
+        offset += len;
+    }
+    io_check(SYSCALL(fdatasync(image_fd)), 0);
+    journal_pending = 1;
+}
+
+/**
+ * Apaga o cabeçalho do diário depois que a última transação foi gravada
+ * nos seus lugares, para que ela não seja refeita na próxima carga
+*/
+static void journal_clear()
+{
+    size_t header_size = (size_t)JOURNAL_HEADER_CLUSTERS * CLUSTER_SIZE;
+
+    io_check(SYSCALL(fdatasync(image_fd)), 0);
+    memset(journal_buffer, 0x00, header_size);
+    io_check(SYSCALL(pwrite(image_fd, journal_buffer, header_size, (off_t)JOURNAL_START * CLUSTER_SIZE)), header_size);
+    io_check(SYSCALL(fdatasync(image_fd)), 0);
+    journal_pending = 0;
+}
+
+/**
+ * Refaz a última transação do diário, caso ela esteja completa, e limpa
+ * o diário. Como as cópias são dos clusters inteiros, refazer uma
+ * transação que já foi gravada nos seus lugares não altera nada
+ *
+ * @return int número de clusters recuperados do diário
+*/
+static int journal_replay()
+{
+    if (geometry.journal_clusters == 0)
+        return 0;
+
+    uint8_t *header_buf = journal_buffer;
+    ssize_t header_size = (ssize_t)JOURNAL_HEADER_CLUSTERS * CLUSTER_SIZE;
+    uint8_t *blocks = journal_buffer + header_size;
+    journal_header_t *header = (journal_header_t *)header_buf;
+    struct iovec *iov = journal_iov;
+
+    if (pread(image_fd, header_buf, header_size, (off_t)JOURNAL_START * CLUSTER_SIZE) != header_size ||
+        header->magic != JOURNAL_MAGIC || header->count == 0 || header->count > (uint32_t)journal_blocks)
+        return 0;
+
+    int count = header->count;
+    ssize_t blocks_size = (ssize_t)count * CLUSTER_SIZE;
+    if (pread(image_fd, blocks, blocks_size, (off_t)JOURNAL_START * CLUSTER_SIZE + header_size) != blocks_size)
+        return 0;
+
+    uint64_t checksum = header->checksum;
+    header->checksum = 0;
+    for (int i = 0; i < count; i++)
+    {
+        iov[i].iov_base = blocks + (size_t)i * CLUSTER_SIZE;
+        iov[i].iov_len = CLUSTER_SIZE;
+    }
+
+    // uma transação incompleta é descartada, e os clusters continuam
+    // com o conteúdo anterior a ela
+    if (journal_checksum(header_buf, iov, count) != checksum)
+        return 0;
+
+    for (int i = 0; i < count; i++)
+        if (header->targets[i] >= 1 && header->targets[i] < (uint32_t)JOURNAL_START)
+            io_check(SYSCALL(pwrite(image_fd, blocks + (size_t)i * CLUSTER_SIZE, CLUSTER_SIZE,
+                                    (off_t)header->targets[i] * CLUSTER_SIZE)), CLUSTER_SIZE);
+    io_check(SYSCALL(fdatasync(image_fd)), 0);
+
+    journal_sequence = header->sequence;
+    journal_clear();
+    return count;
+}
+
+/**
+ * Garante que as alterações feitas até aqui cheguem ao arquivo
+ * image_path. Chamada por fs_sync. Com o diário,
+ * as alterações são antes confirmadas nele como uma única transação
+*/
+static void sync_image()
+{
+    if (image_fd == -1 || checkpointing)
+        return;
+
+    int journaled = journal_enabled && image_map == NULL;
+    if (journaled)
+        journal_commit();
+
+    checkpointing = journaled;
+    if (fat_dirty)
+        write_fat();
+
+    if (image_map != NULL)
+        io_check(SYSCALL(msync(image_map, IMAGE_SIZE, MS_SYNC)), 0);
+    else
+        cache_flush();
+    checkpointing = 0;
+
+    remember_mtime();
+}
+
+/**
+ * Mostra o número de acertos e faltas do cache de clusters
+ *
+ * @param FILE* saída
+*/
+static void cache_stats(FILE *out)
+{
+    uint64_t total = cache_hits + cache_misses;
+    fprintf(out, "Cache: %d clusters, %lu acertos, %lu faltas (%.1f%% de acerto)\n",
+           CACHE_SIZE, cache_hits, cache_misses, total ? 100.0 * cache_hits / total : 0.0);
+}
+
+/**
+ * Retorna o tempo do relógio monotônico em nanossegundos
+ *
+ * @return uint64_t tempo atual
+*/
+static uint64_t stats_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/**
+ * Começa a medir uma operação, usada por STATS_BEGIN
+ *
+ * @return stats_mark_t tempo e contadores da thread no início
+*/
+static stats_mark_t stats_start()
+{
+    return (stats_mark_t){stats_now(), thread_stats.syscalls, thread_stats.bytes};
+}
+
+/**
+ * Soma às estatísticas de op a operação que começou em mark. No modo
+ * servidor várias threads registram ao mesmo tempo, por isso as somas
+ * são atômicas
+ *
+ * @param int operação, uma das constantes STAT_*
+ * @param stats_mark_t* início da operação
+*/
+static void stats_record(int op, const stats_mark_t *mark)
+{
+    op_stats_t *stats = &op_stats[op];
+    uint64_t ns = stats_now() - mark->start_ns;
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    __atomic_add_fetch(&stats->count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->syscalls, thread_stats.syscalls - mark->syscalls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->bytes, thread_stats.bytes - mark->bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->histogram[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&stats->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * Estima um percentil da latência pelo histograma, retornando o limite
+ * superior do intervalo onde ele cai, sem passar da maior latência
+ *
+ * @param op_stats_t* estatísticas da operação
+ * @param double fração das chamadas, como 0.99
+ *
+ * @return double latência em microssegundos
+*/
+static double stats_percentile(const op_stats_t *stats, double fraction)
+{
+    uint64_t target = (uint64_t)ceil(stats->count * fraction), seen = 0;
+    int i;
+
+    for (i = 0; i < STATS_BUCKETS; i++)
+    {
+        seen += stats->histogram[i];
+        if (seen >= target)
+            break;
+    }
+    return (i < STATS_BUCKETS && (1ULL << i) < stats->max_ns ? 1ULL << i : stats->max_ns) / 1000.0;
+}
+
+/**
+ * Mostra as estatísticas das operações que já foram chamadas e as do
+ * cache de clusters. p50 e p99 são limites superiores, com a precisão
+ * de uma potência de 2 do histograma
+ *
+ * @param FILE* saída
+*/
+static void stats_show(FILE *out)
+{
+    fprintf(out, "operação              chamadas    média us      p50 us      p99 us      máx us  syscalls/op     bytes/op\n");
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        const op_stats_t *stats = &op_stats[i];
+        if (stats->count == 0)
+            continue;
+
+        fprintf(out, "%-20s %10lu %11.2f %11.2f %11.2f %11.2f %12.2f %12.1f\n", stat_names[i], stats->count,
+                stats->total_ns / 1000.0 / stats->count, stats_percentile(stats, 0.5),
+                stats_percentile(stats, 0.99), stats->max_ns / 1000.0,
+                (double)stats->syscalls / stats->count, (double)stats->bytes / stats->count);
+    }
+    cache_stats(out);
+}
+
+/**
+ * Zera as estatísticas das operações e do cache
+*/
+static void stats_reset()
+{
+    memset(op_stats, 0x00, sizeof(op_stats));
+    cache_hits = cache_misses = 0;
+}
+
+/**
+ * Altera uma entrada da fat e marca o seu setor para ser gravado. Com o
+ * diário, a transação é confirmada antes que os clusters da fat e o
+ * cache inteiro deixem de caber nas journal_blocks cópias
+ *
+ * @param int posição do cluster na tabela fat
+ * @param uint32_t novo valor da entrada
+*/
+static void set_fat(int cluster, uint32_t value)
+{
+    int sector = cluster / FAT_BY_SECTOR;
+
+    // no modo com threads, escritores de diretórios diferentes alteram a
+    // fat ao mesmo tempo e as leituras sem trava percorrem as cadeias
+    __atomic_store_n(&fat[cluster], value, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&fat_dirty_sector[sector], __ATOMIC_RELAXED))
+        return;
+
+    // só o diário precisa contar os clusters da fat alterados
+    if (journal_enabled && image_map == NULL)
+    {
+        int sectors = CLUSTER_SIZE / SECTOR_SIZE, first = sector - sector % sectors, dirty = 0;
+        for (int i = first; i < first + sectors; i++)
+            dirty |= fat_dirty_sector[i];
+
+        if (!dirty)
+        {
+            if (fat_dirty_clusters == journal_blocks - CACHE_SIZE)
+                sync_image();
+            fat_dirty_clusters++;
+        }
+    }
+    __atomic_store_n(&fat_dirty_sector[sector], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fat_dirty, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lê uma entrada da fat. A leitura é atômica porque, no modo com threads,
+ * as cadeias são percorridas sem trava enquanto set_fat altera outras
+ *
+ * @param int posição do cluster na tabela fat
+ *
+ * @return uint32_t valor da entrada
+*/
+static inline uint32_t fat_get(int cluster)
+{
+    return __atomic_load_n(&fat[cluster], __ATOMIC_RELAXED);
+}
+
+/**
+ * Marca o cluster como livre no mapa de bits free_clusters
+ *
+ * @param int posição do cluster na tabela fat
+*/
+static void mark_free(int cluster)
+{
+    if (!shared_alloc)
+    {
+        free_clusters[cluster / 64] |= 1ULL << (cluster % 64);
+        free_count++;
+        return;
+    }
+
+    __atomic_or_fetch(&free_clusters[cluster / 64], 1ULL << (cluster % 64), __ATOMIC_RELEASE);
+    __atomic_add_fetch(&free_count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Marca o cluster como ocupado no mapa de bits free_clusters, se
+ * nenhuma outra thread o tiver ocupado antes
+ *
+ * @param int posição do cluster na tabela fat
+ *
+ * @return int 1 se o cluster estava livre, 0 caso contrário
+*/
+static int mark_used(int cluster)
+{
+    uint64_t bit = 1ULL << (cluster % 64);
+
+    if (!shared_alloc)
+    {
+        free_clusters[cluster / 64] &= ~bit;
+        free_count--;
+        return 1;
+    }
+
+    // com a liberação em mark_free, quem ocupa o cluster vê tudo o que
+    // foi feito com ele antes de ser liberado
+    if (!(__atomic_fetch_and(&free_clusters[cluster / 64], ~bit, __ATOMIC_ACQ_REL) & bit))
+        return 0;
+    __atomic_sub_fetch(&free_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * Procura o primeiro cluster livre a partir de start, sem dar a
+ * volta no disco, testando 64 clusters por vez
+ *
+ * @param int posição onde a busca começa
+ *
+ * @return int posição do cluster livre, ou -1 se não houver nenhum
+*/
+static int next_free(int start)
+{
+    int word = start / 64;
+    if (word >= FREE_MAP_WORDS)
+        return -1;
+
+    uint64_t bits = __atomic_load_n(&free_clusters[word], __ATOMIC_RELAXED) & (~0ULL << (start % 64));
+    while (bits == 0)
+    {
+        if (++word == FREE_MAP_WORDS)
+            return -1;
+        bits = __atomic_load_n(&free_clusters[word], __ATOMIC_RELAXED);
+    }
+
+    int cluster = word * 64 + __builtin_ctzll(bits);
+    return cluster < NUM_CLUSTER ? cluster : -1;
+}
+
+/**
+ * Conta quantos clusters livres consecutivos existem a partir de start,
+ * parando em max
+ *
+ * @param int primeiro cluster, que deve estar livre
+ * @param int tamanho máximo da sequência
+ *
+ * @return int tamanho da sequência de clusters livres
+*/
+static int free_run(int start, int max)
+{
+    int len = 0, cluster = start;
+
+    while (len < max && cluster < NUM_CLUSTER)
+    {
+        int offset = cluster % 64;
+        uint64_t used = ~__atomic_load_n(&free_clusters[cluster / 64], __ATOMIC_RELAXED) >> offset;
+        int avail = used ? __builtin_ctzll(used) : 64 - offset;
+
+        len += avail;
+        cluster += avail;
+        if (avail < 64 - offset)
+            break;
+    }
+
+    if (len > max)
+        len = max;
+    if (start + len > NUM_CLUSTER)
+        len = NUM_CLUSTER - start;
+    return len;
+}
+
+/**
+ * Encontra um cluster livre na tabela fat, continuando a busca de onde a
+ * última alocação parou, e o marca como ocupado
+ *
+ * @return int representa o posição do cluster na tabela fat
+*/
+static int find_free_cluster()
+{
+    stats_mark_t mark = STATS_BEGIN();
+    int cluster_entry;
+
+    do
+    {
+        cluster_entry = -1;
+        if (__atomic_load_n(&free_count, __ATOMIC_RELAXED) == 0)
+            break;
+
+        cluster_entry = next_free(free_hint);
+        if (cluster_entry == -1)
+            cluster_entry = next_free(0);
+        if (cluster_entry == -1)
+            break;
+
+        // outra thread pode ter ocupado o cluster depois da busca
+        free_hint = cluster_entry + 1;
+    } while (!mark_used(cluster_entry));
+
+    STATS_END(STAT_FIND_FREE, mark);
+    return cluster_entry;
+}
+
+/**
+ * Aloca count clusters e os encadeia na fat após o cluster tail, dando
+ * preferência a uma única sequência contígua. Se não houver uma
+ * sequência grande o bastante, usa os clusters livres na ordem em que
+ * aparecem a partir de free_hint
+ *
+ * @param int último cluster da cadeia que será estendida
+ * @param int quantidade de clusters a alocar
+ *
+ * @return int último cluster da cadeia, ou -1 se o disco não tiver
+ * espaço, caso em que nada é alocado
+*/
+static int alloc_chain(int tail, int count)
+{
+    if (count > __atomic_load_n(&free_count, __ATOMIC_RELAXED))
+        return -1;
+
+    int start = -1;
+    for (int pass = 0, cluster = free_hint; pass < 2 && start == -1; pass++, cluster = 0)
+    {
+        int limit = pass == 0 ? NUM_CLUSTER : free_hint;
+        while ((cluster = next_free(cluster)) != -1 && cluster < limit)
+        {
+            int len = free_run(cluster, count);
+            if (len == count)
+            {
+                start = cluster;
+                break;
+            }
+            cluster += len;
+        }
+    }
+
+    if (start != -1)
+        free_hint = start;
+
+    int first_tail = tail;
+    for (int i = 0; i < count; i++)
+    {
+        int cluster = find_free_cluster();
+
+        // no modo com threads outras threads podem ter ocupado os clusters
+        if (cluster == -1)
+        {
+            set_fat(tail, END_FILE);
+            free_chain(fat_get(first_tail));
+            set_fat(first_tail, END_FILE);
+            return -1;
+        }
+        set_fat(tail, cluster);
+        tail = cluster;
+    }
+    set_fat(tail, END_FILE);
+
+    return tail;
+}
+
+/**
+ * Marca o cluster como livre na fat e no mapa free_clusters
+ *
+ * @param int posição do cluster na tabela fat
+*/
+static void release_cluster(int cluster)
+{
+    set_fat(cluster, CLUSTER_FREE);
+    mark_free(cluster);
+}
+
+/**
+ * Libera todos os clusters da cadeia que começa em cluster
+ *
+ * @param int primeiro cluster da cadeia
+*/
+static void free_chain(int cluster)
+{
+    if (IN_CHAIN(cluster))
+        file_tail[cluster] = 0;
+
+    while (IN_CHAIN(cluster))
+    {
+        int next = fat_get(cluster);
+        release_cluster(cluster);
+        cluster = next;
+    }
+}
+
+/**
+ * Reconstrói o mapa de bits free_clusters a partir da fat
+*/
+static void rebuild_free_clusters()
+{
+    memset(free_clusters, 0x00, FREE_MAP_WORDS * sizeof(uint64_t));
+    free_count = 0;
+    free_hint = DATA_START;
+
+    for (int i = DATA_START; i < NUM_CLUSTER; i++)
+    {
+        if (fat[i] == CLUSTER_FREE)
+            mark_free(i);
+    }
+}
+
+/**
+ * Guarda a data de modificação atual do arquivo image_path
+*/
+static void remember_mtime()
+{
+    struct stat st;
+    if (image_fd != -1 && fstat(image_fd, &st) == 0)
+        image_mtime = st.st_mtim;
+}
+
+/**
+ * Verifica se o arquivo image_path foi alterado por outro processo
+ * desde a última sincronização
+ *
+ * @return int 1 se o arquivo foi alterado, 0 caso contrário
+*/
+static int image_changed()
+{
+    struct stat st;
+    if (image_fd == -1 || fstat(image_fd, &st) != 0)
+        return 0;
+
+    return st.st_mtim.tv_sec != image_mtime.tv_sec || st.st_mtim.tv_nsec != image_mtime.tv_nsec;
+}
+
+/**
+ * Retorna um buffer para o cluster sem ler o seu conteúdo atual do
+ * disco, para ser preenchido por completo e depois passado a write_data.
+ * O ponteiro é válido até o próximo acesso a outro cluster
+ *
+ * @param int posição do cluster que será escrito
+ *
+ * @return data_cluster* buffer do cluster
+*/
+static data_cluster *map_data(int cluster)
+{
+    if (image_map != NULL)
+        return (data_cluster *)(image_map + (off_t)cluster * CLUSTER_SIZE);
+    if (cluster == ROOT_CLUSTER)
+        return (data_cluster *)root_dir;
+
+    return cache_get(cluster, 0)->data;
+}
+
+/**
+ * Escreve no arquivo image_path os dados de um cluster. Se data for o
+ * próprio buffer do cluster, obtido por load_data ou map_data, nenhuma
+ * cópia é feita
+ *
+ * @param int posição do cluster que será salvo
+ * @param data_cluster* cluster que será salvo
+*/
+static void write_data(int cluster, data_cluster *data)
+{
+    stats_mark_t mark = STATS_BEGIN();
+
+    if (image_map != NULL)
+    {
+        data_cluster *dest = (data_cluster *)(image_map + (off_t)cluster * CLUSTER_SIZE);
+        if (dest != data)
+            memcpy(dest, data, CLUSTER_SIZE);
+    }
+    else
+    {
+        if (cluster == ROOT_CLUSTER && data != (data_cluster *)root_dir)
+            memcpy(root_dir, data, CLUSTER_SIZE);
+
+        cache_entry_t *entry = cache_get(cluster, 0);
+        if (entry->data != data)
+            memcpy(entry->data, data, CLUSTER_SIZE);
+        entry->dirty = 1;
+    }
+
+    STATS_END(STAT_WRITE_DATA, mark);
+}
+
+/**
+ * Lê do arquivo image_path os dados de um cluster. O ponteiro retornado
+ * aponta para o cache (ou para o mapeamento no modo mmap) e é válido
+ * até o próximo acesso a outro cluster
+ * 
+ * @param int posição do cluster que será lido
+ * 
+ * @return data_cluster* cluster lido pela função, ou NULL para um cluster
+ * antes do diretório raiz, que só aparece em uma imagem corrompida
+*/
+static data_cluster *load_data(int cluster)
+{
+    stats_mark_t mark = STATS_BEGIN();
+    data_cluster *data;
+
+    if (cluster < ROOT_CLUSTER)
+    {
+        set_error(-EIO);
+        data = NULL;
+    }
+    else if (cluster == ROOT_CLUSTER)
+    {
+        data = (data_cluster *)root_dir;
+    }
+    else if (image_map != NULL)
+    {
+        data = (data_cluster *)(image_map + (off_t)cluster * CLUSTER_SIZE);
+    }
+    else
+    {
+        data = cache_get(cluster, 1)->data;
+    }
+
+    STATS_END(STAT_LOAD_DATA, mark);
+    return data;
+}
+
+/**
+ * Conta quantos clusters da cadeia, a partir de cluster, estão em
+ * posições consecutivas do disco e formam uma única extensão
+ *
+ * @param int primeiro cluster da extensão
+ * @param int número máximo de clusters
+ *
+ * @return int tamanho da extensão em clusters
+*/
+static int extent_length(int cluster, int max)
+{
+    int length = 1;
+    while (length < max && fat_get(cluster) == (uint32_t)cluster + 1)
+    {
+        cluster++;
+        length++;
+    }
+    return length;
+}
+
+/**
+ * Retorna os iovecs da requisição
+ *
+ * @param io_request_t* requisição
+ *
+ * @return struct iovec* iovecs copiados na requisição ou os do chamador
+*/
+static const struct iovec *io_vec(const io_request_t *request)
+{
+    return request->vec != NULL ? request->vec : request->iov;
+}
+
+/**
+ * Executa a requisição com pwritev ou preadv
+ *
+ * @param io_request_t* requisição
+*/
+static void io_sync(const io_request_t *request)
+{
+    if (request->write)
+        io_check(SYSCALL(pwritev(image_fd, io_vec(request), request->iovcnt, request->offset)), request->len);
+    else
+        io_check(SYSCALL(preadv(image_fd, io_vec(request), request->iovcnt, request->offset)), request->len);
+}
+
+/**
+ * Cria o anel do io_uring com depth entradas
+ *
+ * @param int número máximo de requisições enviadas de uma vez
+ *
+ * @return int 0 em caso de sucesso ou -1 se o io_uring não estiver disponível
+*/
+static int uring_setup(int depth)
+{
+#ifdef HAVE_IO_URING
+    struct io_uring_params params;
+    memset(&params, 0x00, sizeof(params));
+
+    int fd = syscall(__NR_io_uring_setup, depth, &params);
+    if (fd == -1)
+        return -1;
+
+    ring.fd = fd;
+    ring.depth = depth;
+    ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // em kernels recentes as duas filas ficam no mesmo mapeamento
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_ring_size > ring.sq_ring_size)
+            ring.sq_ring_size = ring.cq_ring_size;
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring.sq_ring :
+                   mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+        close(fd);
+        ring.fd = -1;
+        return -1;
+    }
+
+    ring.sq_tail = (unsigned *)((uint8_t *)ring.sq_ring + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)((uint8_t *)ring.sq_ring + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((uint8_t *)ring.sq_ring + params.sq_off.array);
+    ring.cq_head = (unsigned *)((uint8_t *)ring.cq_ring + params.cq_off.head);
+    ring.cq_tail = (unsigned *)((uint8_t *)ring.cq_ring + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)((uint8_t *)ring.cq_ring + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((uint8_t *)ring.cq_ring + params.cq_off.cqes);
+
+    io_requests = malloc(depth * sizeof(io_request_t));
+    uring_depth = depth;
+    return 0;
+#else
+    (void)depth;
+    return -1;
+#endif
+}
+
+/**
+ * Desfaz o anel do io_uring, voltando à E/S síncrona
+*/
+static void uring_teardown()
+{
+#ifdef HAVE_IO_URING
+    if (ring.fd == -1)
+        return;
+
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+    ring.fd = -1;
+#endif
+    free(io_requests);
+    io_requests = NULL;
+    uring_depth = 0;
+}
+
+/**
+ * Envia ao io_uring as requisições guardadas e espera todas terminarem.
+ * Uma requisição que falhe ou transfira menos bytes é refeita de forma
+ * síncrona. Se o próprio io_uring falhar, as requisições já enviadas são
+ * esperadas, as que faltam são feitas de forma síncrona e ele é desativado
+*/
+static void io_flush()
+{
+#ifdef HAVE_IO_URING
+    if (io_pending == 0)
+        return;
+
+    unsigned tail = *ring.sq_tail;
+    for (int i = 0; i < io_pending; i++)
+    {
+        unsigned index = (tail + i) & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[index];
+
+        memset(sqe, 0x00, sizeof(*sqe));
+        sqe->opcode = io_requests[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = image_fd;
+        sqe->addr = (uint64_t)(uintptr_t)io_vec(&io_requests[i]);
+        sqe->len = io_requests[i].iovcnt;
+        sqe->off = io_requests[i].offset;
+        sqe->user_data = i;
+        ring.sq_array[index] = index;
+    }
+    __atomic_store_n(ring.sq_tail, tail + io_pending, __ATOMIC_RELEASE);
+
+    // depois de uma falha nada mais é enviado, mas as requisições que o
+    // kernel já recebeu ainda usam os buffers e precisam ser esperadas
+    // antes que sejam refeitas de forma síncrona
+    int to_submit = io_pending, completed = 0, failed = 0;
+    while (completed < io_pending - (failed ? to_submit : 0))
+    {
+        int submitted = SYSCALL(syscall(__NR_io_uring_enter, ring.fd, failed ? 0 : to_submit, 1,
+                                        IORING_ENTER_GETEVENTS, NULL, 0));
+        if (submitted == -1 && errno != EINTR)
+        {
+            if (!failed)
+            {
+                failed = 1;
+                continue;
+            }
+            // durante a espera, EAGAIN e EBUSY só indicam que ainda há requisições no kernel
+            if (errno != EAGAIN && errno != EBUSY)
+                break;
+        }
+        if (submitted > 0 && !failed)
+            to_submit -= submitted;
+
+        unsigned head = *ring.cq_head;
+        unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, completed++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            io_request_t *request = &io_requests[cqe->user_data];
+
+            if (cqe->res < 0 || (size_t)cqe->res != request->len)
+                io_sync(request);
+            request->done = 1;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (failed)
+    {
+        for (int i = 0; i < io_pending; i++)
+            if (!io_requests[i].done)
+                io_sync(&io_requests[i]);
+        uring_teardown();
+    }
+#endif
+    io_pending = 0;
+}
+
+/**
+ * Lê ou escreve os iovecs na posição offset do arquivo image_path. Dentro
+ * de um grupo aberto por io_batch_begin, com o io_uring ativo, a
+ * requisição só é guardada, e os dados devem continuar válidos até
+ * io_batch_end. Com mais de dois buffers, o mesmo vale para os iovecs
+ *
+ * @param int flag se é uma escrita
+ * @param off_t posição no arquivo
+ * @param struct iovec* buffers
+ * @param int número de buffers, no máximo IOV_MAX
+*/
+static void io_request(int write, off_t offset, const struct iovec *iov, int iovcnt)
+{
+    io_request_t request = {write, offset, 0, {{0}}, iovcnt > 2 ? iov : NULL, iovcnt, 0};
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iovcnt <= 2)
+            request.iov[i] = iov[i];
+        request.len += iov[i].iov_len;
+    }
+
+    thread_stats.bytes += request.len;
+    if (io_batching == 0 || uring_depth == 0)
+    {
+        io_sync(&request);
+        return;
+    }
+
+    io_requests[io_pending++] = request;
+    if (io_pending == uring_depth)
+        io_flush();
+}
+
+/**
+ * Abre um grupo de requisições de E/S na thread atual
+*/
+static void io_batch_begin()
+{
+    io_batching++;
+}
+
+/**
+ * Fecha o grupo aberto por io_batch_begin. Ao fechar o último, as
+ * requisições guardadas são enviadas e concluídas
+*/
+static void io_batch_end()
+{
+    if (--io_batching == 0)
+        io_flush();
+}
+
+/**
+ * Escreve len bytes de buffer nos count clusters consecutivos que
+ * começam em start, completando o restante com zeros, sem passar pelo
+ * cache. Várias threads podem chamá-la ao mesmo tempo para clusters
+ * diferentes, desde que nenhum deles esteja no cache. Sem dados, os
+ * zeros são escritos a partir de zero_iov, IOV_MAX clusters por chamada
+ *
+ * @param int primeiro cluster da extensão
+ * @param int número de clusters da extensão
+ * @param char* dados que serão escritos
+ * @param size_t quantidade de bytes de buffer, no máximo count * CLUSTER_SIZE
+*/
+static void store_extent(int start, int count, const char *buffer, size_t len)
+{
+    size_t total = (size_t)count * CLUSTER_SIZE;
+
+    if (image_map != NULL)
+    {
+        uint8_t *dest = image_map + (off_t)start * CLUSTER_SIZE;
+        memcpy(dest, buffer, len);
+        memset(dest + len, 0x00, total - len);
+        thread_stats.bytes += total;
+        return;
+    }
+
+    if (len == 0)
+    {
+        for (int done = 0; done < count; done += IOV_MAX)
+        {
+            int parts = count - done < IOV_MAX ? count - done : IOV_MAX;
+            io_request(1, (off_t)(start + done) * CLUSTER_SIZE, zero_iov, parts);
+        }
+        return;
+    }
+
+    struct iovec iov[2] = {
+        {(void *)buffer, len},
+        {(void *)zero_cluster, total - len},
+    };
+    io_request(1, (off_t)start * CLUSTER_SIZE, iov, len < total ? 2 : 1);
+}
+
+/**
+ * Escreve len bytes de buffer nos count clusters consecutivos que
+ * começam em start, completando o restante com zeros. No modo padrão
+ * a extensão inteira é gravada com um único pwritev
+ *
+ * @param int primeiro cluster da extensão
+ * @param int número de clusters da extensão
+ * @param char* dados que serão escritos
+ * @param size_t quantidade de bytes de buffer, no máximo count * CLUSTER_SIZE
+*/
+static void write_extent(int start, int count, const char *buffer, size_t len)
+{
+    if (image_map == NULL)
+    {
+        // o disco passa a ter a versão mais nova desses clusters
+        for (int i = 0; i < count; i++)
+            cache_drop(start + i);
+        open_image(0);
+    }
+
+    store_extent(start, count, buffer, len);
+}
+
+/**
+ * Lê os count clusters consecutivos que começam em start para buffer.
+ * No modo padrão a extensão inteira é lida com uma única chamada
+ *
+ * @param int primeiro cluster da extensão
+ * @param int número de clusters da extensão
+ * @param char* buffer com espaço para count * CLUSTER_SIZE bytes
+*/
+static void read_extent(int start, int count, char *buffer)
+{
+    size_t total = (size_t)count * CLUSTER_SIZE;
+
+    if (image_map != NULL)
+    {
+        memcpy(buffer, image_map + (off_t)start * CLUSTER_SIZE, total);
+        thread_stats.bytes += total;
+        return;
+    }
+
+    cache_write_range(start, count);
+
+    struct iovec iov = {buffer, total};
+    open_image(0);
+    io_request(0, (off_t)start * CLUSTER_SIZE, &iov, 1);
+}
+
+/**
+ * Escreve len bytes de stream na cadeia que começa em cluster, uma
+ * extensão contígua por vez. Com o io_uring as escritas de todas as
+ * extensões são enviadas juntas
+ *
+ * @param int primeiro cluster a ser escrito
+ * @param int número de clusters a escrever
+ * @param char* dados que serão escritos
+ * @param size_t quantidade de bytes de stream
+*/
+static void write_chain(int cluster, int num_blocks, const char *stream, size_t len)
+{
+    io_batch_begin();
+    while (num_blocks > 0)
+    {
+        int count = extent_length(cluster, num_blocks);
+        size_t bytes = len < (size_t)count * CLUSTER_SIZE ? len : (size_t)count * CLUSTER_SIZE;
+
+        write_extent(cluster, count, stream, bytes);
+        stream += bytes;
+        len -= bytes;
+        num_blocks -= count;
+        cluster = fat_get(cluster + count - 1);
+    }
+    io_batch_end();
+}
+
+/**
+ * Converte os setores alterados da fat em memória para o formato do
+ * disco em fat_raw, com entradas de FAT_BITS bits
+*/
+static void fat_encode()
+{
+    for (int sector = 0; sector < FAT_SECTORS; sector++)
+    {
+        if (!fat_dirty_sector[sector])
+            continue;
+
+        int first = sector * FAT_BY_SECTOR, last = first + FAT_BY_SECTOR;
+        if (last > NUM_CLUSTER)
+            last = NUM_CLUSTER;
+
+        if (FAT_BITS == 16)
+            for (int i = first; i < last; i++)
+                ((uint16_t *)fat_raw)[i] = fat[i];
+        else
+            for (int i = first; i < last; i++)
+                ((uint32_t *)fat_raw)[i] = fat[i];
+    }
+}
+
+/**
+ * Preenche a fat em memória a partir de fat_raw. Na fat de 16 bits os
+ * valores especiais, a partir de FAT16_MAX_CLUSTER, são estendidos para
+ * os mesmos valores de 32 bits
+*/
+static void fat_decode()
+{
+    if (FAT_BITS == 32)
+    {
+        memcpy(fat, fat_raw, NUM_CLUSTER * sizeof(uint32_t));
+        return;
+    }
+
+    for (int i = 0; i < NUM_CLUSTER; i++)
+    {
+        uint32_t value = ((uint16_t *)fat_raw)[i];
+        fat[i] = value >= FAT16_MAX_CLUSTER ? value | 0xffff0000u : value;
+    }
+}
+
+/**
+ * Atualiza a tabela fat no arquivo image_path, gravando apenas os setores
+ * alterados. Setores alterados vizinhos são gravados em uma única escrita
+*/
+static void write_fat()
+{
+    stats_mark_t mark = STATS_BEGIN();
+    open_image(0);
+    fat_encode();
+
+    for (int sector = 0; sector < FAT_SECTORS; sector++)
+    {
+        if (!fat_dirty_sector[sector])
+            continue;
+
+        int end = sector;
+        while (end < FAT_SECTORS && fat_dirty_sector[end])
+            fat_dirty_sector[end++] = 0;
+
+        if (image_map == NULL)
+        {
+            io_check(SYSCALL(pwrite(image_fd, fat_raw + sector * SECTOR_SIZE, (end - sector) * SECTOR_SIZE,
+                                    CLUSTER_SIZE + sector * SECTOR_SIZE)), (size_t)(end - sector) * SECTOR_SIZE);
+            thread_stats.bytes += (end - sector) * SECTOR_SIZE;
+        }
+        sector = end;
+    }
+    fat_dirty = fat_dirty_clusters = 0;
+    STATS_END(STAT_WRITE_FAT, mark);
+}
+
+/**
+ * Calcula o hash FNV-1a de um nome de entrada
+ *
+ * @param char* nome da entrada
+ *
+ * @return uint32_t hash do nome
+*/
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < NAME_SIZE && name[i] != '\0'; i++)
+    {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Calcula o hash FNV-1a de um caminho
+ *
+ * @param char* caminho
+ *
+ * @return uint32_t hash do caminho
+*/
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261u;
+    for (; *path != '\0'; path++)
+    {
+        hash ^= (uint8_t)*path;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Trava o índice do diretório que começa em cluster no modo com threads,
+ * junto com os índices que ele pode reaproveitar
+ *
+ * @param int cluster do diretório
+*/
+static void index_acquire(int cluster)
+{
+    if (threaded)
+        pthread_mutex_lock(&index_locks[cluster % INDEX_LOCKS]);
+}
+
+/**
+ * Libera a trava tomada por index_acquire
+ *
+ * @param int cluster do diretório
+*/
+static void index_release(int cluster)
+{
+    if (threaded)
+        pthread_mutex_unlock(&index_locks[cluster % INDEX_LOCKS]);
+}
+
+/**
+ * Trava o diretório que começa em cluster no modo com threads. Com
+ * DIR_WRITE a contagem seq fica ímpar até dir_unlock
+ *
+ * @param int cluster do diretório
+ * @param int DIR_READ ou DIR_WRITE
+*/
+static void dir_lock(int cluster, int mode)
+{
+    if (!threaded)
+        return;
+
+    dir_lock_t *lock = &dir_locks[cluster % DIR_LOCKS];
+    if (mode == DIR_WRITE)
+    {
+        pthread_rwlock_wrlock(&lock->lock);
+        __atomic_add_fetch(&lock->seq, 1, __ATOMIC_SEQ_CST);
+    }
+    else
+        pthread_rwlock_rdlock(&lock->lock);
+}
+
+/**
+ * Libera a trava tomada por dir_lock
+ *
+ * @param int cluster do diretório
+ * @param int modo usado em dir_lock
+*/
+static void dir_unlock(int cluster, int mode)
+{
+    if (!threaded)
+        return;
+
+    dir_lock_t *lock = &dir_locks[cluster % DIR_LOCKS];
+    if (mode == DIR_WRITE)
+        __atomic_add_fetch(&lock->seq, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&lock->lock);
+}
+
+/**
+ * Trava para escrita o subdiretório cluster de parent, que já está
+ * travado para escrita. Como a ordem entre as travas não é garantida
+ * quando duas caem na mesma posição de dir_locks, a trava é só tentada
+ * algumas vezes, e quem não a consegue desiste da operação
+ *
+ * @param int cluster do diretório pai, travado para escrita
+ * @param int cluster do subdiretório
+ *
+ * @return int 1 se o subdiretório foi travado, 0 se ele estiver em uso
+*/
+static int dir_lock_child(int parent, int cluster)
+{
+    if (!threaded || cluster % DIR_LOCKS == parent % DIR_LOCKS)
+        return 1;
+
+    dir_lock_t *lock = &dir_locks[cluster % DIR_LOCKS];
+    for (int i = 0; i < DIR_LOCK_TRIES; i++)
+    {
+        if (pthread_rwlock_trywrlock(&lock->lock) == 0)
+        {
+            __atomic_add_fetch(&lock->seq, 1, __ATOMIC_SEQ_CST);
+            return 1;
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+/**
+ * Libera a trava tomada por dir_lock_child
+ *
+ * @param int cluster do diretório pai
+ * @param int cluster do subdiretório
+*/
+static void dir_unlock_child(int parent, int cluster)
+{
+    if (cluster % DIR_LOCKS != parent % DIR_LOCKS)
+        dir_unlock(cluster, DIR_WRITE);
+}
+
+/**
+ * Começa uma leitura sem trava do diretório que começa em cluster
+ *
+ * @param int cluster do diretório
+ *
+ * @return uint32_t contagem de escritas, ímpar se houver uma em andamento
+*/
+static uint32_t dir_read_begin(int cluster)
+{
+    return threaded ? __atomic_load_n(&dir_locks[cluster % DIR_LOCKS].seq, __ATOMIC_ACQUIRE) : 0;
+}
+
+/**
+ * Verifica se o diretório foi alterado durante uma leitura sem trava
+ *
+ * @param int cluster do diretório
+ * @param uint32_t contagem retornada por dir_read_begin
+ *
+ * @return int 1 se a leitura precisa ser repetida, 0 caso contrário
+*/
+static int dir_read_retry(int cluster, uint32_t seq)
+{
+    if (!threaded)
+        return 0;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&dir_locks[cluster % DIR_LOCKS].seq, __ATOMIC_RELAXED) != seq;
+}
+
+/**
+ * Começa a resolução sem trava de um caminho, esperando o fim da
+ * exclusão de diretório em andamento
+ *
+ * @return uint32_t contagem de exclusões de diretório
+*/
+static uint32_t removal_begin()
+{
+    uint32_t removals;
+    while ((removals = __atomic_load_n(&dir_removals, __ATOMIC_SEQ_CST)) & 1)
+        sched_yield();
+    return removals;
+}
+
+/**
+ * Verifica se algum diretório foi excluído desde removal_begin, quando
+ * o cluster encontrado para o caminho pode não ser mais um diretório
+ *
+ * @param uint32_t contagem retornada por removal_begin
+ *
+ * @return int 1 se o caminho precisa ser resolvido de novo, 0 caso contrário
+*/
+static int removal_retry(uint32_t removals)
+{
+    return __atomic_load_n(&dir_removals, __ATOMIC_SEQ_CST) != removals;
+}
+
+/**
+ * Descarta todos os índices de diretório
+*/
+static void dir_index_reset()
+{
+    for (int i = 0; i < DIR_INDEX_COUNT; i++)
+    {
+        free(dir_indexes[i].slots);
+        free(dir_indexes[i].free_refs);
+        dir_indexes[i].slots = NULL;
+        dir_indexes[i].free_refs = NULL;
+        dir_indexes[i].cluster = CACHE_NONE;
+    }
+    for (int i = 0; i < NUM_CLUSTER; i++)
+        dir_index_slot[i] = CACHE_NONE;
+    memset(dir_index_next, 0x00, sizeof(dir_index_next));
+
+    dir_index_ready = 1;
+}
+
+/**
+ * Descarta o índice do diretório que está em cluster, se houver
+ *
+ * @param int cluster do diretório
+*/
+static void dir_index_drop(int cluster)
+{
+    if (!dir_index_ready || dir_index_slot[cluster] == CACHE_NONE)
+        return;
+
+    dir_index_t *index = &dir_indexes[dir_index_slot[cluster]];
+    free(index->slots);
+    free(index->free_refs);
+    index->slots = NULL;
+    index->free_refs = NULL;
+    index->cluster = CACHE_NONE;
+    dir_index_slot[cluster] = CACHE_NONE;
+}
+
+/**
+ * Procura no índice a posição da tabela que contém name, ou
+ * onde name deve ser inserido
+ *
+ * @param dir_index_t* índice do diretório
+ * @param char* nome da entrada
+ * @param int flag se a busca é para inserção
+ *
+ * @return int posição na tabela, ou -1 se name não estiver no índice
+*/
+static int index_probe(dir_index_t *index, const char *name, int insert)
+{
+    int mask = index->capacity - 1, tombstone = -1;
+
+    for (int i = name_hash(name) & mask;; i = (i + 1) & mask)
+    {
+        index_slot_t *slot = &index->slots[i];
+        if (slot->pos == INDEX_EMPTY)
+            return insert ? (tombstone != -1 ? tombstone : i) : -1;
+        if (slot->pos == INDEX_DELETED)
+        {
+            if (tombstone == -1)
+                tombstone = i;
+        }
+        else if (strncmp(slot->name, name, NAME_SIZE) == 0)
+            return i;
+    }
+}
+
+/**
+ * Empilha ref entre as entradas livres do diretório
+ *
+ * @param dir_index_t* índice do diretório
+ * @param int referência da entrada livre
+ *
+ * @return int 0, ou -ENOMEM, quando o índice não é alterado
+*/
+static int index_push_free(dir_index_t *index, int ref)
+{
+    if (index->free_count == index->free_capacity)
+    {
+        int capacity = index->free_capacity ? 2 * index->free_capacity : ENTRY_BY_CLUSTER;
+        int *refs = realloc(index->free_refs, capacity * sizeof(int));
+        if (refs == NULL)
+            return -ENOMEM;
+        index->free_refs = refs;
+        index->free_capacity = capacity;
+    }
+    index->free_refs[index->free_count++] = ref;
+    return 0;
+}
+
+/**
+ * Empilha como livres todas as entradas de um cluster vazio do diretório,
+ * de forma que a primeira delas seja a próxima a ser usada
+ *
+ * @param dir_index_t* índice do diretório
+ * @param int cluster vazio do diretório
+ *
+ * @return int 0 ou -ENOMEM
+*/
+static int index_push_cluster(dir_index_t *index, int cluster)
+{
+    for (int i = ENTRY_BY_CLUSTER - 1; i >= 0; i--)
+        if (index_push_free(index, ENTRY_REF(cluster, i)) != 0)
+            return -ENOMEM;
+    return 0;
+}
+
+/**
+ * Insere entry no índice, apontando para a entrada pos do diretório
+ *
+ * @param dir_index_t* índice do diretório
+ * @param dir_entry_t* entrada do diretório
+ * @param int referência da entrada no diretório
+ *
+ * @return int 0, ou -ENOMEM, quando o índice não é alterado
+*/
+static int index_insert(dir_index_t *index, dir_entry_t *entry, int pos)
+{
+    // mantém a tabela no máximo metade cheia, contando as remoções
+    if ((index->used + 1) * 2 > index->capacity)
+    {
+        index_slot_t *old = index->slots;
+        int old_capacity = index->capacity, capacity = index->capacity;
+
+        while ((index->count + 1) * 2 > capacity / 2)
+            capacity *= 2;
+        index_slot_t *slots = malloc(capacity * sizeof(index_slot_t));
+        if (slots == NULL)
+            return -ENOMEM;
+        index->slots = slots;
+        index->capacity = capacity;
+        for (int i = 0; i < index->capacity; i++)
+            index->slots[i].pos = INDEX_EMPTY;
+
+        index->used = 0;
+        for (int i = 0; i < old_capacity; i++)
+        {
+            if (old[i].pos >= 0)
+            {
+                index->slots[index_probe(index, old[i].name, 1)] = old[i];
+                index->used++;
+            }
+        }
+        free(old);
+    }
+
+    int i = index_probe(index, (char *)entry->filename, 1);
+    if (index->slots[i].pos == INDEX_EMPTY)
+        index->used++;
+    strncpy(index->slots[i].name, (char *)entry->filename, NAME_SIZE);
+    index->slots[i].attributes = entry->attributes;
+    index->slots[i].first_block = entry_cluster(entry);
+    index->slots[i].pos = pos;
+    index->count++;
+    return 0;
+}
+
+/**
+ * Remove name do índice
+ *
+ * @param dir_index_t* índice do diretório
+ * @param char* nome da entrada
+*/
+static void index_remove(dir_index_t *index, const char *name)
+{
+    int i = index_probe(index, name, 0);
+    if (i == -1)
+        return;
+
+    // sem memória a entrada só deixa de ser reaproveitada até o índice
+    // ser reconstruído
+    index_push_free(index, index->slots[i].pos);
+    index->slots[i].pos = INDEX_DELETED;
+    index->count--;
+}
+
+/**
+ * Retorna o índice do diretório que começa em cluster, construindo-o
+ * na primeira vez que o diretório é acessado. Todos os clusters da
+ * cadeia do diretório são percorridos. No modo com threads o diretório
+ * deve estar travado e o seu índice também, por index_acquire
+ *
+ * @param int cluster do diretório
+ *
+ * @return dir_index_t* índice do diretório, ou NULL se não houver memória
+ * para construí-lo, quando -ENOMEM é guardado em pending_error
+*/
+static dir_index_t *dir_index_get(int cluster)
+{
+    if (!dir_index_ready)
+        dir_index_reset();
+
+    if (dir_index_slot[cluster] != CACHE_NONE)
+        return &dir_indexes[dir_index_slot[cluster]];
+
+    // reaproveita em ordem circular os índices da mesma trava
+    int lock = cluster % INDEX_LOCKS;
+    int victim = lock * INDEX_BY_LOCK + dir_index_next[lock];
+    dir_index_next[lock] = (dir_index_next[lock] + 1) % INDEX_BY_LOCK;
+    if (dir_indexes[victim].cluster != CACHE_NONE)
+        dir_index_drop(dir_indexes[victim].cluster);
+
+    dir_index_t *index = &dir_indexes[victim];
+    index->cluster = cluster;
+    index->capacity = 2 * ENTRY_BY_CLUSTER;
+    index->used = index->count = 0;
+    index->free_refs = NULL;
+    index->free_count = index->free_capacity = 0;
+    index->slots = malloc(index->capacity * sizeof(index_slot_t));
+    if (index->slots == NULL)
+    {
+        index->cluster = CACHE_NONE;
+        set_error(-ENOMEM);
+        return NULL;
+    }
+    for (int i = 0; i < index->capacity; i++)
+        index->slots[i].pos = INDEX_EMPTY;
+    dir_index_slot[cluster] = victim;
+
+    // a cadeia é percorrida uma vez, do começo para o fim, sem guardar os
+    // clusters, já que o seu tamanho vem do disco
+    for (int curr = cluster; IN_CHAIN(curr); curr = fat_get(curr))
+    {
+        data_cluster *dir = load_data(curr);
+        index->tail = curr;
+        for (int i = 0; i < ENTRY_BY_CLUSTER; i++)
+        {
+            int error = dir->dir[i].filename[0] == '\0' ? index_push_free(index, ENTRY_REF(curr, i))
+                                                        : index_insert(index, &dir->dir[i], ENTRY_REF(curr, i));
+            if (error)
+            {
+                dir_index_drop(cluster);
+                set_error(error);
+                return NULL;
+            }
+        }
+    }
+
+    // a pilha de entradas livres é invertida, para que as primeiras do
+    // diretório sejam reaproveitadas antes
+    for (int i = 0, j = index->free_count - 1; i < j; i++, j--)
+    {
+        int ref = index->free_refs[i];
+        index->free_refs[i] = index->free_refs[j];
+        index->free_refs[j] = ref;
+    }
+
+    return index;
+}
+
+/**
+ * Procura a entrada name no diretório que está em cluster
+ *
+ * @param int cluster do diretório
+ * @param char* nome da entrada
+ *
+ * @return index_slot_t* posição do índice com a entrada, ou NULL se não existir
+*/
+static index_slot_t *dir_find(int cluster, const char *name)
+{
+    dir_index_t *index = dir_index_get(cluster);
+    int i = index == NULL ? -1 : index_probe(index, name, 0);
+
+    return i == -1 ? NULL : &index->slots[i];
+}
+
+/**
+ * Procura a entrada name no diretório que está em cluster
+ *
+ * @param int cluster do diretório
+ * @param char* nome da entrada
+ *
+ * @return int referência da entrada no diretório, ou -1 se não existir
+*/
+static int dir_lookup(int cluster, const char *name)
+{
+    index_acquire(cluster);
+    index_slot_t *slot = dir_find(cluster, name);
+    int ref = slot == NULL ? -1 : slot->pos;
+    index_release(cluster);
+
+    return ref;
+}
+
+/**
+ * Retira uma entrada livre do diretório que começa em cluster. Se todas
+ * estiverem ocupadas, o diretório cresce um cluster no fim da sua cadeia
+ *
+ * @param int cluster do diretório
+ *
+ * @return int referência da entrada livre, ou -1 se o disco estiver cheio
+ * ou se faltar memória para o índice, quando -ENOMEM é guardado em
+ * pending_error
+*/
+static int dir_free_entry(int cluster)
+{
+    dir_index_t *index = dir_index_get(cluster);
+    if (index == NULL)
+        return -1;
+
+    if (index->free_count == 0)
+    {
+        int tail = alloc_chain(index->tail, 1);
+        if (tail == -1)
+            return -1;
+
+        data_cluster *data = map_data(tail);
+        memset(data, 0x00, CLUSTER_SIZE);
+        write_data(tail, data);
+
+        // o cluster novo já faz parte do diretório, e o índice
+        // reconstruído o encontra vazio
+        index->tail = tail;
+        if (index_push_cluster(index, tail) != 0)
+        {
+            dir_index_drop(cluster);
+            set_error(-ENOMEM);
+            return -1;
+        }
+    }
+
+    return index->free_refs[--index->free_count];
+}
+
+/**
+ * Retorna a entrada de diretório ref. O ponteiro é válido até o
+ * próximo acesso a outro cluster
+ *
+ * @param int referência da entrada
+ *
+ * @return dir_entry_t* entrada do diretório
+*/
+static dir_entry_t *entry_at(int ref)
+{
+    return &load_data(REF_CLUSTER(ref))->dir[REF_INDEX(ref)];
+}
+
+/**
+ * Grava a entrada de diretório ref, após ter sido alterada por entry_at
+ *
+ * @param int referência da entrada
+*/
+static void save_entry(int ref)
+{
+    write_data(REF_CLUSTER(ref), load_data(REF_CLUSTER(ref)));
+}
+
+/**
+ * Esvazia o cache de caminhos
+*/
+static void dentry_reset()
+{
+    for (int i = 0; i < DENTRY_COUNT; i++)
+        dentries[i].cluster = CACHE_NONE;
+}
+
+/**
+ * Trava uma entrada do cache de caminhos, deixando a sua contagem seq
+ * ímpar. Sem wait a função desiste se outra thread estiver alterando
+ * a entrada
+ *
+ * @param dentry_t* entrada do cache
+ * @param int flag se a trava deve ser esperada
+ *
+ * @return int 1 se a entrada foi travada, 0 caso contrário
+*/
+static int dentry_lock(dentry_t *dentry, int wait)
+{
+    uint32_t seq = __atomic_load_n(&dentry->seq, __ATOMIC_RELAXED);
+
+    while ((seq & 1) || !__atomic_compare_exchange_n(&dentry->seq, &seq, seq + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        if (!wait)
+            return 0;
+        sched_yield();
+        seq = __atomic_load_n(&dentry->seq, __ATOMIC_RELAXED);
+    }
+    return 1;
+}
+
+/**
+ * Libera a trava tomada por dentry_lock
+ *
+ * @param dentry_t* entrada do cache
+*/
+static void dentry_unlock(dentry_t *dentry)
+{
+    __atomic_add_fetch(&dentry->seq, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove do cache de caminhos todos os caminhos que levam a cluster,
+ * usado quando o diretório é excluído, com dir_removals ímpar. As
+ * entradas que não levam a cluster e não estão sendo alteradas não são
+ * travadas, porque as inserções que começarem depois não serão feitas
+ *
+ * @param int cluster do diretório
+*/
+static void dentry_forget(int cluster)
+{
+    for (int i = 0; i < DENTRY_COUNT; i++)
+    {
+        dentry_t *dentry = &dentries[i];
+        if (!(__atomic_load_n(&dentry->seq, __ATOMIC_SEQ_CST) & 1) && dentry->cluster != cluster)
+            continue;
+
+        dentry_lock(dentry, 1);
+        if (dentry->cluster == cluster)
+            dentry->cluster = CACHE_NONE;
+        dentry_unlock(dentry);
+    }
+}
+
+/**
+ * Procura um caminho de diretório no cache de caminhos, sem trava
+ *
+ * @param char* caminho do diretório
+ *
+ * @return int cluster do diretório, ou -1 se o caminho não estiver no cache
+*/
+static int dentry_lookup(const char *path)
+{
+    dentry_t *dentry = &dentries[path_hash(path) % DENTRY_COUNT];
+    uint32_t seq = __atomic_load_n(&dentry->seq, __ATOMIC_ACQUIRE);
+    int cluster = dentry->cluster;
+    int found = !(seq & 1) && cluster != CACHE_NONE && strncmp(dentry->path, path, DENTRY_PATH) == 0;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!found || __atomic_load_n(&dentry->seq, __ATOMIC_RELAXED) != seq)
+        return -1;
+    return cluster;
+}
+
+/**
+ * Guarda um caminho de diretório no cache de caminhos, a não ser que
+ * algum diretório tenha sido excluído desde que a busca começou. Se
+ * outra thread estiver alterando a mesma entrada o caminho não é guardado
+ *
+ * @param char* caminho do diretório
+ * @param int cluster do diretório
+ * @param uint32_t contagem retornada por removal_begin no começo da busca
+*/
+static void dentry_insert(const char *path, int cluster, uint32_t removals)
+{
+    if (strlen(path) >= DENTRY_PATH)
+        return;
+
+    dentry_t *dentry = &dentries[path_hash(path) % DENTRY_COUNT];
+    if (!dentry_lock(dentry, 0))
+        return;
+    if (!removal_retry(removals))
+    {
+        strcpy(dentry->path, path);
+        dentry->cluster = cluster;
+    }
+    dentry_unlock(dentry);
+}
+
+/**
+ * Procura o subdiretório name do diretório que começa em cluster. Sem
+ * threads, e com threads nos diretórios de mais de um cluster, o índice
+ * do diretório é consultado com ele travado para leitura. Nos diretórios
+ * de um cluster só, ou se algum diretório foi excluído desde
+ * removal_begin, o cluster é lido sem trava e a leitura é repetida se
+ * ele mudar durante ela; depois de READ_RETRIES tentativas ele é travado
+ * para leitura. Assim nenhum índice é montado para um diretório que
+ * pode estar sendo excluído
+ *
+ * @param int cluster do diretório
+ * @param char* nome do subdiretório
+ * @param uint32_t contagem retornada por removal_begin
+ *
+ * @return int primeiro cluster do subdiretório, ou -1 se ele não existir
+*/
+static int dir_subdir(int cluster, const char *name, uint32_t removals)
+{
+    if (!threaded)
+    {
+        index_slot_t *slot = dir_find(cluster, name);
+        return slot == NULL || slot->attributes != IS_DIR ? -1 : (int)slot->first_block;
+    }
+
+    if (IN_CHAIN((int)fat_get(cluster)))
+    {
+        dir_lock(cluster, DIR_READ);
+        if (!removal_retry(removals))
+        {
+            index_acquire(cluster);
+            index_slot_t *slot = dir_find(cluster, name);
+            int found = slot == NULL || slot->attributes != IS_DIR ? -1 : (int)slot->first_block;
+            index_release(cluster);
+            dir_unlock(cluster, DIR_READ);
+            return found;
+        }
+        dir_unlock(cluster, DIR_READ);
+    }
+
+    for (int attempt = 0;; attempt++)
+    {
+        int locked = attempt >= READ_RETRIES, found = -1;
+        uint32_t seq = 0;
+
+        if (locked)
+            dir_lock(cluster, DIR_READ);
+        else if ((seq = dir_read_begin(cluster)) & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // a cadeia é limitada porque ela pode mudar durante a leitura
+        for (int curr = cluster, steps = 0; found == -1 && IN_CHAIN(curr) && steps < NUM_CLUSTER; curr = fat_get(curr), steps++)
+        {
+            dir_entry_t *entries = load_data(curr)->dir;
+            for (int i = 0; i < ENTRY_BY_CLUSTER; i++)
+            {
+                if (entries[i].attributes == IS_DIR && strncmp((char *)entries[i].filename, name, NAME_SIZE) == 0)
+                {
+                    found = entry_cluster(&entries[i]);
+                    break;
+                }
+            }
+        }
+
+        if (locked)
+            dir_unlock(cluster, DIR_READ);
+        if (locked || !dir_read_retry(cluster, seq))
+            return found;
+    }
+}
+
+/**
+ * Percorre o caminho normalizado key a partir da raiz, guardando cada
+ * prefixo no cache de caminhos
+ *
+ * @param char* caminho normalizado, alterado durante a busca e restaurado
+ * @param int tamanho do caminho
+ * @param uint32_t contagem retornada por removal_begin
+ *
+ * @return int cluster do diretório, ou -1 se algum componente não existir
+*/
+static int walk_path(char *key, int key_len, uint32_t removals)
+{
+    char name[NAME_SIZE];
+    int cluster = ROOT_CLUSTER;
+
+    for (int start = 0; start < key_len;)
+    {
+        int end = start;
+        while (end < key_len && key[end] != '/')
+            end++;
+
+        if (end - start >= NAME_SIZE)
+            return -1;
+        memcpy(name, key + start, end - start);
+        name[end - start] = '\0';
+
+        if ((cluster = dir_subdir(cluster, name, removals)) == -1)
+            return -1;
+
+        key[end] = '\0';
+        dentry_insert(key, cluster, removals);
+        if (end < key_len)
+            key[end] = '/';
+        start = end + 1;
+    }
+
+    return cluster;
+}
+
+/**
+ * Encontra o cluster do diretório path, consultando primeiro o cache
+ * de caminhos. Em caso de falta, o caminho é percorrido a partir da raiz
+ * e cada prefixo é guardado no cache. Caminhos que não cabem em
+ * DENTRY_PATH são sempre percorridos. Nenhuma trava é tomada: se um
+ * diretório for excluído durante a busca ela é repetida
+ *
+ * @param char* caminho do diretório, com componentes separados por '/'
+ *
+ * @return int cluster do diretório, ou -1 se algum componente não existir
+*/
+static int lookup_dir(const char *path)
+{
+    char key[PATH_MAX];
+    int key_len = 0;
+
+    // normaliza o caminho, removendo barras repetidas e nas pontas
+    for (const char *c = path; *c != '\0'; c++)
+    {
+        if (key_len == PATH_MAX - 1)
+            return -1;
+        if (*c != '/' || (key_len > 0 && key[key_len - 1] != '/'))
+            key[key_len++] = *c;
+    }
+    if (key_len > 0 && key[key_len - 1] == '/')
+        key_len--;
+    key[key_len] = '\0';
+
+    if (key_len == 0)
+        return ROOT_CLUSTER;
+
+    while (1)
+    {
+        uint32_t removals = removal_begin();
+        int cluster = key_len < DENTRY_PATH ? dentry_lookup(key) : -1;
+        if (cluster == -1)
+            cluster = walk_path(key, key_len, removals);
+        if (!removal_retry(removals))
+            return cluster;
+    }
+}
+
+/**
+ * Separa path no diretório pai e no nome do último componente, e
+ * encontra o cluster do pai. O caminho é alterado para terminar o nome
+ * do pai
+ *
+ * @param char* caminho, com componentes separados por '/'
+ * @param int* onde é guardado o cluster do diretório pai
+ * @param char** onde é guardado o nome do último componente, ou NULL se
+ * o caminho for a raiz
+ *
+ * @return int 0, ou -2 se algum diretório do caminho não existir
+*/
+static int split_path(char *path, int *parent_cluster, char **name)
+{
+    int len = path == NULL ? 0 : strlen(path);
+    while (len > 0 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    *name = NULL;
+    *parent_cluster = ROOT_CLUSTER;
+    if (len == 0)
+        return 0;
+
+    char *slash = strrchr(path, '/');
+    if (slash == NULL)
+        *name = path;
+    else
+    {
+        *slash = '\0';
+        *name = slash + 1;
+        if ((*parent_cluster = lookup_dir(path)) == -1)
+            return -2;
+    }
+    return 0;
+}
+
+/**
+ * Resolve path, separando-o no diretório pai e no nome do último
+ * componente. O caminho é alterado para terminar o nome do pai
+ *
+ * @param char* caminho, com componentes separados por '/'
+ * @param int* onde é guardado o cluster do diretório pai
+ * @param char** onde é guardado o nome do último componente, ou NULL se
+ * o caminho for a raiz
+ *
+ * @return int referência da entrada no diretório pai, -1 se ela não
+ * existir ou -2 se algum diretório do caminho não existir
+*/
+static int resolve_path(char *path, int *parent_cluster, char **name)
+{
+    if (split_path(path, parent_cluster, name) == -2)
+        return -2;
+    return *name == NULL ? -1 : dir_lookup(*parent_cluster, *name);
+}
+
+/**
+ * Resolve path como resolve_path e trava o diretório pai no modo mode.
+ * Como o pai pode ser excluído enquanto a trava é esperada, o caminho
+ * é resolvido de novo se algum diretório foi excluído desde o começo
+ * da busca, e o índice do pai só é consultado com ele travado. Fora do
+ * modo com threads equivale a resolve_path
+ *
+ * @param char* caminho, com componentes separados por '/'
+ * @param int* onde é guardado o cluster do diretório pai
+ * @param char** onde é guardado o nome do último componente
+ * @param int DIR_READ ou DIR_WRITE
+ *
+ * @return int o mesmo que resolve_path. O pai fica travado, e deve ser
+ * liberado com dir_unlock, sempre que o retorno não for -2
+*/
+static int lock_path(char *path, int *parent_cluster, char **name, int mode)
+{
+    if (!threaded)
+        return resolve_path(path, parent_cluster, name);
+
+    uint32_t removals = removal_begin();
+    if (split_path(path, parent_cluster, name) == -2)
+        return -2;
+
+    while (1)
+    {
+        dir_lock(*parent_cluster, mode);
+        if (!removal_retry(removals))
+            return *name == NULL ? -1 : dir_lookup(*parent_cluster, *name);
+        dir_unlock(*parent_cluster, mode);
+
+        removals = removal_begin();
+        int parent = *name == NULL || *name == path ? ROOT_CLUSTER : lookup_dir(path);
+        if (parent == -1)
+            return -2;
+        *parent_cluster = parent;
+    }
+}
+
+/**
+ * Cria o arquivo image_path com os dados padrões determinados pelo PDF
+ * da atividade, apagando o conteúdo anterior
+ *
+ * @return int 0 em caso de sucesso, o erro do open, -ENOMEM ou o erro
+ * de map_image. Os erros de escrita ficam em pending_error
+*/
+static int format_image()
+{
+    //Descarta o cache sem gravá-lo, já que todo o conteúdo anterior será apagado
+    cache_head = cache_tail = CACHE_NONE;
+    int error = open_image(O_CREAT | O_TRUNC);
+    if (error)
+        return error;
+
+    //A geometria escolhida passa a valer, com o diário no fim da imagem
+    memcpy(geometry.magic, GEOMETRY_MAGIC, sizeof(geometry.magic));
+    geometry.journal_clusters = journal_size(NUM_CLUSTER, CLUSTER_SIZE);
+    image_loaded = 0;
+    if ((error = apply_geometry()) != 0)
+        return error;
+    cache_reset();
+    dir_index_reset();
+    dentry_reset();
+
+    //Os clusters de dados não são escritos: o arquivo é estendido até o
+    //tamanho da imagem e o trecho novo é esparso, lido como zeros
+    io_check(SYSCALL(ftruncate(image_fd, IMAGE_SIZE)), 0);
+    if (use_mmap && (error = map_image()) != 0)
+        return error;
+
+    //Preenche o boot block com a geometria seguida do padrão 0xbb, e o escreve no arquivo
+    memset(boot_block, 0xbb, CLUSTER_SIZE);
+    memcpy(boot_block, &geometry, sizeof(geometry));
+    if (image_map == NULL)
+        io_check(SYSCALL(pwrite(image_fd, boot_block, CLUSTER_SIZE, 0)), CLUSTER_SIZE);
+
+    //Preenche a fat
+    fat[0] = CLUSTER_BOOT;
+    for (int i = 1; i < ROOT_CLUSTER; i++)
+        fat[i] = CLUSTER_RESERVED;
+    fat[ROOT_CLUSTER] = END_FILE;
+    for (int i = DATA_START; i < JOURNAL_START; i++)
+        fat[i] = CLUSTER_FREE;
+    for (int i = JOURNAL_START; i < NUM_CLUSTER; i++)
+        fat[i] = CLUSTER_RESERVED;
+    memset(fat_dirty_sector, 1, FAT_SECTORS);
+    write_fat();
+    rebuild_free_clusters();
+
+    //Preenche o root_dir com o padrão 0x00, e o escreve no arquivo
+    memset(root_dir, 0x00, CLUSTER_SIZE);
+    if (image_map == NULL)
+        io_check(SYSCALL(pwrite(image_fd, root_dir, CLUSTER_SIZE, (off_t)ROOT_CLUSTER * CLUSTER_SIZE)), CLUSTER_SIZE);
+
+    journal_enabled = 1;
+    sync_image();
+    image_loaded = 1;
+    return 0;
+}
+
+/**
+ * Carrega o boot block, a fat e o root dir do 
+ * arquivo da imagem para a memória
+ *
+ * @return int número de clusters recuperados do diário, o erro do open,
+ * -EINVAL se a geometria da imagem não for suportada ou o arquivo for
+ * menor que ela, ou -ENOMEM. Se a leitura falhar a imagem não é carregada
+ * e -EIO fica em pending_error
+*/
+static int load()
+{
+    geometry_t g;
+
+    int error = open_image(0);
+    if (error)
+        return error;
+    if (read_geometry(&g) == -1)
+        return -EINVAL;
+
+    //Descarta o cache, cujo conteúdo pode não refletir mais o disco, e
+    //recria as tabelas para a geometria da imagem
+    unmap_image();
+    geometry = g;
+    image_loaded = 0;
+    if ((error = apply_geometry()) != 0 || (use_mmap && (error = map_image()) != 0))
+        return error;
+
+    int recovered = journal_replay();
+    cache_reset();
+    dir_index_reset();
+    dentry_reset();
+
+    //No modo mmap boot_block, fat_raw e root_dir já apontam para o arquivo
+    if (image_map == NULL)
+    {
+        io_check(SYSCALL(pread(image_fd, boot_block, CLUSTER_SIZE, 0)), CLUSTER_SIZE);
+        io_check(SYSCALL(pread(image_fd, fat_raw, (size_t)FAT_CLUSTERS * CLUSTER_SIZE, CLUSTER_SIZE)),
+                 (size_t)FAT_CLUSTERS * CLUSTER_SIZE);
+        io_check(SYSCALL(pread(image_fd, root_dir, CLUSTER_SIZE, (off_t)ROOT_CLUSTER * CLUSTER_SIZE)), CLUSTER_SIZE);
+    }
+    fat_decode();
+
+    // imagens criadas antes do diário usam a área dele para dados
+    journal_enabled = geometry.journal_clusters != 0;
+    rebuild_free_clusters();
+    remember_mtime();
+    image_loaded = pending_error == 0;
+    return recovered;
+}
+
+/**
+ * Cria uma nova entrada de nome dir no diretório pai, sem mostrar
+ * mensagens. Os attributes podem ser ou IS_DIR para criar um diretório
+ * ou IS_FILE para criar um arquivo
+ *
+ * @param char* nome da entrada que será adicionada
+ * @param int primeiro cluster do diretório pai
+ * @param int atributos da entrada
+ *
+ * @return int referência da nova entrada, ou ENTRY_LONG_NAME,
+ * ENTRY_IN_USE ou ENTRY_DISK_FULL
+*/
+static int create_entry(const char *dir, int parent_cluster, int attributes)
+{
+    if (strlen(dir) >= NAME_SIZE)
+        return ENTRY_LONG_NAME;
+
+    if (dir_lookup(parent_cluster, dir) != -1)
+        return ENTRY_IN_USE;
+
+    int cluster_entry = find_free_cluster();
+    if (cluster_entry == -1)
+        return ENTRY_DISK_FULL;
+
+    set_fat(cluster_entry, END_FILE);
+
+    // limpa a memória para a nova entrada antes que ela fique visível
+    data_cluster *new_entry = map_data(cluster_entry);
+    memset(new_entry, 0x00, CLUSTER_SIZE);
+    write_data(cluster_entry, new_entry);
+
+    // o índice do pai não pode ser trocado entre a escolha da entrada
+    // livre e a inserção do novo nome
+    index_acquire(parent_cluster);
+    int ref = dir_free_entry(parent_cluster);
+    if (ref == -1)
+    {
+        index_release(parent_cluster);
+        release_cluster(cluster_entry);
+        return ENTRY_DISK_FULL;
+    }
+
+    dir_entry_t entry;
+    memset(&entry, 0x00, sizeof(entry));
+    strcpy((char *)entry.filename, dir);
+    entry.attributes = attributes;
+    set_entry_cluster(&entry, cluster_entry);
+    entry.size = attributes == IS_DIR ? CLUSTER_SIZE : 0;
+
+    // sem memória para o índice, ele é descartado e reconstruído do
+    // diretório, onde a entrada já está
+    *entry_at(ref) = entry;
+    dir_index_t *index = dir_index_get(parent_cluster);
+    if (index != NULL && index_insert(index, &entry, ref) != 0)
+        dir_index_drop(parent_cluster);
+    index_release(parent_cluster);
+
+    // atualiza a pasta pai
+    save_entry(ref);
+    return ref;
+}
+
+/**
+ * Preenche st com os dados da entrada
+ *
+ * @param dir_entry_t* entrada do diretório
+ * @param fs_stat_t* onde os dados são guardados
+*/
+static void entry_stat(const dir_entry_t *entry, fs_stat_t *st)
+{
+    memcpy(st->name, entry->filename, NAME_SIZE);
+    st->name[NAME_SIZE - 1] = '\0';
+    st->is_dir = entry->attributes == IS_DIR;
+    st->size = entry->size;
+    st->first_cluster = entry_cluster(entry);
+}
+
+/**
+ * Copia para entries as entradas válidas de todos os clusters do
+ * diretório, até max entradas
+ *
+ * @param int primeiro cluster do diretório
+ * @param fs_stat_t* entradas lidas
+ * @param int espaço em entries
+ *
+ * @return int número de entradas do diretório, que pode passar de max
+*/
+static int list_dir(int cluster, fs_stat_t *entries, int max)
+{
+    int found = 0;
+
+    // a cadeia é limitada porque no modo com threads ela pode mudar durante a leitura
+    for (int steps = 0; IN_CHAIN(cluster) && steps < NUM_CLUSTER; cluster = fat_get(cluster), steps++)
+    {
+        data_cluster *parent_dir = load_data(cluster);
+        for (int i = 0; i < ENTRY_BY_CLUSTER; i++)
+        {
+            dir_entry_t *entry = &parent_dir->dir[i];
+            if (entry->filename[0] == '\0')
+                continue;
+
+            if (found < max)
+                entry_stat(entry, &entries[found]);
+            found++;
+        }
+    }
+    return found;
+}
+
+/**
+ * Exclui a entrada dir no diretório pai
+ * 
+ * @param char* nome da entrada a ser excluída
+ * @param int primeiro cluster do diretório pai
+ *
+ * @return int 0 em caso de sucesso, -ENOENT se a entrada não existir,
+ * -EBUSY se o diretório estiver em uso ou -ENOTEMPTY se ele não estiver vazio
+*/
+static int del(const char *dir, int parent_cluster)
+{
+    index_acquire(parent_cluster);
+    index_slot_t *slot = dir_find(parent_cluster, dir);
+    if (slot == NULL)
+    {
+        index_release(parent_cluster);
+        return -ENOENT;
+    }
+    int ref = slot->pos, cluster = slot->first_block, attributes = slot->attributes;
+    index_release(parent_cluster);
+
+    // ninguém pode estar usando o diretório quando ele for excluído
+    if (attributes == IS_DIR && !dir_lock_child(parent_cluster, cluster))
+        return -EBUSY;
+
+    if (attributes == IS_DIR)
+    {
+        index_acquire(cluster);
+        dir_index_t *index = dir_index_get(cluster);
+        int count = index == NULL ? -1 : index->count;
+        if (count == 0)
+            dir_index_drop(cluster);
+        index_release(cluster);
+        if (count != 0)
+        {
+            dir_unlock_child(parent_cluster, cluster);
+            return count == -1 ? -ENOMEM : -ENOTEMPTY;
+        }
+
+        // quem resolve caminhos sem trava espera até a entrada sair do pai
+        __atomic_add_fetch(&dir_removals, 1, __ATOMIC_SEQ_CST);
+        dentry_forget(cluster);
+    }
+
+    index_acquire(parent_cluster);
+    dir_index_t *index = dir_index_get(parent_cluster);
+    if (index != NULL)
+        index_remove(index, dir);
+    memset(entry_at(ref), 0x00, sizeof(dir_entry_t));
+    index_release(parent_cluster);
+    save_entry(ref);
+    if (attributes == IS_DIR)
+        __atomic_add_fetch(&dir_removals, 1, __ATOMIC_SEQ_CST);
+
+    file_gen[cluster]++;
+    entry_gen[cluster]++;
+    free_chain(cluster);
+    if (attributes == IS_DIR)
+        dir_unlock_child(parent_cluster, cluster);
+    return 0;
+}
+
+/**
+ * Retorna o último cluster do arquivo que começa em first_cluster. A
+ * cadeia só é percorrida quando o último cluster não está em file_tail
+ *
+ * @param int primeiro bloco do arquivo
+ *
+ * @return int último bloco do arquivo
+*/
+static int file_last_cluster(int first_cluster)
+{
+    int tail = file_tail[first_cluster];
+
+    if (tail == 0 || fat_get(tail) != END_FILE)
+    {
+        for (tail = first_cluster; fat_get(tail) != END_FILE; tail = fat_get(tail))
+            ;
+        file_tail[first_cluster] = tail;
+    }
+    return tail;
+}
+
+/**
+ * Escreve os len bytes de stream no arquivo que começa no
+ * bloco first_cluster, substituindo o conteúdo anterior
+ * 
+ * @param char* dados que serão escritos, que podem conter zeros
+ * @param size_t quantidade de bytes de stream
+ * @param int primeiro bloco do arquivo
+ * 
+ * @return off_t com o tamanho do arquivo, ou -ENOSPC se o disco encher,
+ * quando o arquivo fica vazio
+*/
+static off_t write_file(const char *stream, size_t len, int first_cluster)
+{
+    size_t num_blocks = (len + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+
+    file_gen[first_cluster]++;
+    free_chain(fat_get(first_cluster));
+    set_fat(first_cluster, END_FILE);
+    file_tail[first_cluster] = first_cluster;
+
+    if (num_blocks > 1)
+    {
+        int tail = alloc_chain(first_cluster, num_blocks - 1);
+        if (tail == -1)
+            return -ENOSPC;
+        file_tail[first_cluster] = tail;
+    }
+
+    write_chain(first_cluster, num_blocks, stream, len);
+    return len;
+}
+
+/**
+ * Copia bytes do arquivo image_path, a partir de offset, para fd. Se fd
+ * for um arquivo comum a cópia é feita pelo kernel com copy_file_range
+ * ou, se fd não permitir, sendfile. Caso contrário, ou quando nenhum dos
+ * dois funciona, os dados passam por um buffer de STREAM_CLUSTERS clusters
+ *
+ * @param int descritor de saída
+ * @param off_t posição dos dados no arquivo
+ * @param size_t quantidade de bytes
+ * @param int flag se fd é um arquivo comum
+ *
+ * @return int 0 em caso de sucesso ou -1 se a escrita falhar ou não
+ * houver memória para o buffer, quando -ENOMEM é guardado em pending_error
+*/
+static int send_extent(int fd, off_t offset, size_t bytes, int regular)
+{
+    size_t buffer_size = (size_t)STREAM_CLUSTERS * CLUSTER_SIZE;
+    uint8_t *buffer = get_stream_buffer();
+    if (buffer == NULL)
+    {
+        set_error(-ENOMEM);
+        return -1;
+    }
+
+    open_image(0);
+    if (image_map == NULL)
+        cache_write_range(offset / CLUSTER_SIZE, (bytes + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    thread_stats.bytes += bytes;
+
+    // em um pipe o sendfile entrega as próprias páginas do arquivo, e uma
+    // escrita posterior na imagem mudaria os dados ainda não lidos
+    while (regular && bytes > 0)
+    {
+        ssize_t sent = SYSCALL(copy_file_range(image_fd, &offset, fd, NULL, bytes, 0));
+        if (sent <= 0)
+            sent = SYSCALL(sendfile(fd, image_fd, &offset, bytes));
+        if (sent <= 0)
+            break;
+        bytes -= sent;
+    }
+
+    while (bytes > 0)
+    {
+        size_t chunk = bytes < buffer_size ? bytes : buffer_size;
+        char *data = (char *)buffer;
+
+        if (image_map != NULL)
+            data = (char *)image_map + offset;
+        else if (SYSCALL(pread(image_fd, buffer, chunk, offset)) != (ssize_t)chunk)
+            return -1;
+
+        offset += chunk;
+        bytes -= chunk;
+        while (chunk > 0)
+        {
+            ssize_t written = SYSCALL(write(fd, data, chunk));
+            if (written <= 0)
+                return -1;
+            data += written;
+            chunk -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Escreve em fd os size bytes do arquivo que começa no bloco first_cluster,
+ * uma extensão contígua por vez, sem passar os dados pelo cache
+ *
+ * @param int primeiro bloco do arquivo
+ * @param off_t tamanho atual do arquivo
+ * @param int descritor de saída
+ *
+ * @return int 0 em caso de sucesso ou -1 se a escrita falhar
+*/
+static int stream_file(int first_cluster, off_t size, int fd)
+{
+    int curr_cluster = first_cluster, num_blocks = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    struct stat st;
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    while (num_blocks > 0 && IN_CHAIN(curr_cluster))
+    {
+        int count = extent_length(curr_cluster, num_blocks);
+        size_t bytes = (size_t)count * CLUSTER_SIZE;
+        off_t offset = (off_t)curr_cluster * CLUSTER_SIZE;
+
+        num_blocks -= count;
+        curr_cluster = fat_get(curr_cluster + count - 1);
+
+        if (bytes > (size_t)size)
+            bytes = size;
+        size -= (off_t)bytes;
+
+        if (send_extent(fd, offset, bytes, regular) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Escreve os len bytes de stream no final do arquivo que começa no
+ * bloco first_cluster
+ * 
+ * @param char* dados que serão inseridos no final do arquivo
+ * @param size_t quantidade de bytes de stream
+ * @param int primeiro bloco do arquivo
+ * @param off_t tamanho atual do arquivo
+ * 
+ * @return off_t com o tamanho do arquivo, ou -ENOSPC se o disco encher,
+ * quando nada é escrito
+*/
+static off_t append_file(const char *stream, size_t len, int first_cluster, off_t curr_size)
+{
+    int final_cluster = file_last_cluster(first_cluster);
+    size_t appended = len;
+
+    // bytes já ocupados no último cluster, que só está vazio se o arquivo estiver
+    size_t len_final_cluster = curr_size == 0 ? 0 : (curr_size - 1) % CLUSTER_SIZE + 1;
+    size_t room = CLUSTER_SIZE - len_final_cluster;
+    size_t new_blocks = len > room ? (len - room + CLUSTER_SIZE - 1) / CLUSTER_SIZE : 0;
+
+    if (new_blocks > 0)
+    {
+        int tail = alloc_chain(final_cluster, new_blocks);
+        if (tail == -1)
+            return -ENOSPC;
+        file_tail[first_cluster] = tail;
+    }
+
+    if (room > 0)
+    {
+        size_t bytes = len < room ? len : room;
+        data_cluster *data = load_data(final_cluster);
+
+        memcpy(data->data + len_final_cluster, stream, bytes);
+        write_data(final_cluster, data);
+        stream += bytes;
+        len -= bytes;
+    }
+
+    if (new_blocks > 0)
+        write_chain(fat_get(final_cluster), new_blocks, stream, len);
+
+    return curr_size + (off_t)appended;
+}
+
+/**
+ * Retorna o cluster de posição index na cadeia do arquivo. Se file
+ * guardar uma posição válida antes de index, a cadeia é percorrida a
+ * partir dela, e não do primeiro cluster
+ *
+ * @param int primeiro bloco do arquivo
+ * @param int posição do cluster na cadeia, a partir de 0
+ * @param fs_file_t* arquivo com a última posição alcançada, ou NULL
+ *
+ * @return int cluster, ou -1 se a cadeia terminar antes
+*/
+static int chain_seek(int first_cluster, int index, const fs_file_t *file)
+{
+    int cluster = first_cluster, i = 0;
+
+    // a posição só vale se a cadeia não foi truncada depois de guardada
+    if (file != NULL && file->pos_cluster != 0 && file->pos_gen == file_gen[first_cluster] &&
+        (int)file->pos_index <= index)
+    {
+        cluster = file->pos_cluster;
+        i = file->pos_index;
+    }
+
+    for (; i < index && IN_CHAIN(cluster); i++)
+        cluster = fat_get(cluster);
+    return IN_CHAIN(cluster) ? cluster : -1;
+}
+
+/**
+ * Guarda em file o cluster de posição index da cadeia, para a próxima
+ * chamada de chain_seek
+ *
+ * @param int primeiro bloco do arquivo
+ * @param int posição do cluster na cadeia
+ * @param int cluster
+ * @param fs_file_t* arquivo, ou NULL
+*/
+static void chain_remember(int first_cluster, int index, int cluster, fs_file_t *file)
+{
+    if (file == NULL || !IN_CHAIN(cluster))
+        return;
+
+    file->pos_gen = file_gen[first_cluster];
+    file->pos_index = index;
+    file->pos_cluster = cluster;
+}
+
+/**
+ * Lê para buffer até len bytes do arquivo que começa no bloco
+ * first_cluster, a partir de offset. Os clusters inteiros são lidos
+ * em extensões contíguas, enviadas juntas ao io_uring
+ *
+ * @param int primeiro bloco do arquivo
+ * @param off_t tamanho atual do arquivo
+ * @param char* buffer com espaço para len bytes
+ * @param size_t quantidade de bytes pedida
+ * @param size_t posição do primeiro byte
+ * @param fs_file_t* arquivo cuja posição é usada e atualizada, ou NULL
+ *
+ * @return size_t quantidade de bytes lidos, menor que len no fim do arquivo
+*/
+static size_t read_range(int first_cluster, off_t size, char *buffer, size_t len, size_t offset, fs_file_t *file)
+{
+    if (offset >= (size_t)size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+
+    int index = offset / CLUSTER_SIZE;
+    int cluster = chain_seek(first_cluster, index, file), last = cluster, last_index = index;
+    size_t in_cluster = offset % CLUSTER_SIZE, done = 0;
+
+    // o primeiro cluster, se a leitura não o cobrir inteiro
+    if (cluster != -1 && (in_cluster != 0 || len < (size_t)CLUSTER_SIZE))
+    {
+        done = len < CLUSTER_SIZE - in_cluster ? len : CLUSTER_SIZE - in_cluster;
+        memcpy(buffer, load_data(cluster)->data + in_cluster, done);
+        cluster = fat_get(cluster);
+        index++;
+    }
+
+    io_batch_begin();
+    while (len - done >= (size_t)CLUSTER_SIZE && IN_CHAIN(cluster))
+    {
+        int count = extent_length(cluster, (len - done) / CLUSTER_SIZE);
+
+        read_extent(cluster, count, buffer + done);
+        done += (size_t)count * CLUSTER_SIZE;
+        last = cluster + count - 1;
+        last_index = index + count - 1;
+        cluster = fat_get(last);
+        index += count;
+    }
+    io_batch_end();
+
+    // o último cluster, copiado só até o fim da leitura
+    if (done < len && IN_CHAIN(cluster))
+    {
+        memcpy(buffer + done, load_data(cluster)->data, len - done);
+        done = len;
+        last = cluster;
+        last_index = index;
+    }
+
+    chain_remember(first_cluster, last_index, last, file);
+    return done;
+}
+
+/**
+ * Escreve len bytes de buffer a partir de offset no arquivo que começa
+ * no bloco first_cluster, cujos clusters já estão ocupados. Os clusters
+ * inteiros são escritos em extensões, como em write_chain
+ *
+ * @param int primeiro bloco do arquivo
+ * @param char* dados que serão escritos, ou NULL para escrever zeros
+ * @param size_t quantidade de bytes
+ * @param size_t posição do primeiro byte
+ * @param fs_file_t* arquivo cuja posição é usada e atualizada, ou NULL
+*/
+static void chain_write(int first_cluster, const char *buffer, size_t len, size_t offset, fs_file_t *file)
+{
+    int index = offset / CLUSTER_SIZE;
+    int cluster = chain_seek(first_cluster, index, file), last = cluster, last_index = index;
+    size_t in_cluster = offset % CLUSTER_SIZE, done = 0;
+    data_cluster *data;
+
+    if (in_cluster != 0 || len < (size_t)CLUSTER_SIZE)
+    {
+        done = len < CLUSTER_SIZE - in_cluster ? len : CLUSTER_SIZE - in_cluster;
+        data = load_data(cluster);
+        if (buffer == NULL)
+            memset(data->data + in_cluster, 0x00, done);
+        else
+            memcpy(data->data + in_cluster, buffer, done);
+        write_data(cluster, data);
+        cluster = fat_get(cluster);
+        index++;
+    }
+
+    io_batch_begin();
+    while (len - done >= (size_t)CLUSTER_SIZE)
+    {
+        int count = extent_length(cluster, (len - done) / CLUSTER_SIZE);
+
+        // sem dados, store_extent escreve os zeros a partir de zero_iov
+        if (buffer == NULL)
+            write_extent(cluster, count, (const char *)zero_cluster, 0);
+        else
+            write_extent(cluster, count, buffer + done, (size_t)count * CLUSTER_SIZE);
+        done += (size_t)count * CLUSTER_SIZE;
+        last = cluster + count - 1;
+        last_index = index + count - 1;
+        cluster = fat_get(last);
+        index += count;
+    }
+    io_batch_end();
+
+    if (done < len)
+    {
+        data = load_data(cluster);
+        if (buffer == NULL)
+            memset(data->data, 0x00, len - done);
+        else
+            memcpy(data->data, buffer + done, len - done);
+        write_data(cluster, data);
+        last = cluster;
+        last_index = index;
+    }
+
+    chain_remember(first_cluster, last_index, last, file);
+}
+
+/**
+ * Escreve len bytes de buffer a partir de offset no arquivo que começa
+ * no bloco first_cluster, ocupando os clusters que faltarem. Se offset
+ * passar do fim do arquivo, o intervalo entre eles é preenchido com zeros
+ *
+ * @param int primeiro bloco do arquivo
+ * @param off_t tamanho atual do arquivo
+ * @param char* dados que serão escritos
+ * @param size_t quantidade de bytes
+ * @param size_t posição do primeiro byte
+ * @param fs_file_t* arquivo cuja posição é usada e atualizada, ou NULL
+ *
+ * @return off_t novo tamanho do arquivo, ou -ENOSPC se o disco encher,
+ * quando nada é escrito
+*/
+static off_t write_range(int first_cluster, off_t size, const char *buffer, size_t len, size_t offset, fs_file_t *file)
+{
+    size_t end = offset + len;
+    if (len == 0)
+        return size;
+
+    // um arquivo vazio já ocupa o primeiro cluster
+    long allocated = size == 0 ? 1 : (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    long needed = (end + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    if (needed > allocated)
+    {
+        int tail = alloc_chain(file_last_cluster(first_cluster), needed - allocated);
+        if (tail == -1)
+            return -ENOSPC;
+        file_tail[first_cluster] = tail;
+    }
+
+    if (offset > (size_t)size)
+        chain_write(first_cluster, NULL, offset - size, size, file);
+    chain_write(first_cluster, buffer, len, offset, file);
+
+    return end > (size_t)size ? (off_t)end : size;
+}
+
+/**
+ * Copia o conteúdo do arquivo do host aberto em fd para o arquivo que
+ * começa no bloco first_cluster, em blocos de STREAM_CLUSTERS clusters
+ *
+ * @param int descritor do arquivo do host
+ * @param int primeiro bloco do arquivo
+ * @param off_t* onde é guardado o tamanho do arquivo, mesmo em caso de erro
+ *
+ * @return int 0 em caso de sucesso, -ENOSPC se o disco encher, -EFBIG se
+ * o arquivo passar de INT32_MAX bytes, -EIO se a leitura do host falhar
+ * ou -ENOMEM
+*/
+static int import_file(int fd, int first_cluster, off_t *size)
+{
+    uint8_t *buffer = get_stream_buffer();
+    ssize_t bytes;
+
+    *size = write_file((char *)buffer, 0, first_cluster);
+    if (buffer == NULL)
+        return -ENOMEM;
+    while ((bytes = SYSCALL(read(fd, buffer, (size_t)STREAM_CLUSTERS * CLUSTER_SIZE))) > 0)
+    {
+        // o tamanho da entrada não pode passar do limite das demais escritas
+        if (*size + bytes > INT32_MAX)
+            return -EFBIG;
+        off_t new_size = append_file((char *)buffer, bytes, first_cluster, *size);
+        if (new_size < 0)
+            return (int)new_size;
+        *size = new_size;
+    }
+    return bytes < 0 ? -EIO : 0;
+}
+
+/**
+ * Coloca uma tarefa no fim da fila, aumentando-a se estiver cheia
+ *
+ * @param job_queue_t* fila da thread
+ * @param import_job_t tarefa
+ *
+ * @return int 0, ou -ENOMEM, quando a fila não é alterada
+*/
+static int queue_push(job_queue_t *queue, import_job_t job)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == queue->capacity)
+    {
+        // descarta o espaço das tarefas já tiradas do começo
+        int count = queue->tail - queue->head;
+        if (queue->head > 0)
+            memmove(queue->jobs, queue->jobs + queue->head, count * sizeof(import_job_t));
+        else
+        {
+            int capacity = queue->capacity ? queue->capacity * 2 : 64;
+            import_job_t *jobs = realloc(queue->jobs, capacity * sizeof(import_job_t));
+            if (jobs == NULL)
+            {
+                pthread_mutex_unlock(&queue->lock);
+                return -ENOMEM;
+            }
+            queue->jobs = jobs;
+            queue->capacity = capacity;
+        }
+        queue->head = 0;
+        queue->tail = count;
+    }
+    queue->jobs[queue->tail++] = job;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/**
+ * Tira uma tarefa da fila, do fim se for a fila da própria thread ou do
+ * começo se ela estiver sendo roubada
+ *
+ * @param job_queue_t* fila
+ * @param import_job_t* tarefa retirada
+ * @param int flag se a tarefa está sendo roubada
+ *
+ * @return int 1 se uma tarefa foi retirada, 0 se a fila estava vazia
+*/
+static int queue_pop(job_queue_t *queue, import_job_t *job, int steal)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
+    {
+        *job = steal ? queue->jobs[queue->head++] : queue->jobs[--queue->tail];
+        found = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+/**
+ * Espera a próxima tarefa da thread id, tirada da sua fila ou roubada
+ * das filas das outras threads
+ *
+ * @param import_t* estado da importação
+ * @param int número da thread
+ * @param import_job_t* tarefa retirada
+ *
+ * @return int 1 se há uma tarefa, 0 se a importação terminou
+*/
+static int import_take(import_t *pool, int id, import_job_t *job)
+{
+    while (1)
+    {
+        int found = queue_pop(&pool->queues[id], job, 0);
+        for (int i = 1; i < pool->workers && !found; i++)
+            found = queue_pop(&pool->queues[(id + i) % pool->workers], job, 1);
+
+        if (found)
+        {
+            __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        int stop = __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 && pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop)
+            return 0;
+    }
+}
+
+/**
+ * Copia a parte chunk do arquivo: ocupa os seus clusters no mapa de bits,
+ * lê os dados do host e os grava na imagem, uma extensão contígua por
+ * vez. A fat não é alterada, isso fica para o committer
+ *
+ * @param import_file_t* arquivo
+ * @param int número da parte
+ *
+ * @return int 0 em caso de sucesso, -ENOSPC se o disco encher, -EIO se a
+ * leitura do host ou a escrita na imagem falhar ou -ENOMEM
+*/
+static int import_chunk(import_file_t *file, int chunk)
+{
+    int first = chunk * STREAM_CLUSTERS;
+    int count = file->num_blocks - first < STREAM_CLUSTERS ? file->num_blocks - first : STREAM_CLUSTERS;
+    off_t offset = (off_t)first * CLUSTER_SIZE;
+    size_t len = file->size - offset < (off_t)count * CLUSTER_SIZE ? (size_t)(file->size - offset) : (size_t)count * CLUSTER_SIZE;
+    uint8_t *buffer = get_stream_buffer();
+    if (buffer == NULL)
+        return -ENOMEM;
+
+    // o primeiro cluster é o da entrada, ocupado por create_entry
+    for (int i = first == 0 ? 1 : first; i < first + count; i++)
+    {
+        int cluster = find_free_cluster();
+        if (cluster == -1)
+            return -ENOSPC;
+        file->clusters[i] = cluster;
+    }
+
+    for (size_t got = 0; got < len;)
+    {
+        ssize_t bytes = SYSCALL(pread(file->fd, buffer + got, len - got, offset + got));
+        if (bytes <= 0)
+            return -EIO;
+        got += bytes;
+    }
+
+    for (int i = first; i < first + count;)
+    {
+        int run = 1;
+        while (i + run < first + count && file->clusters[i + run] == file->clusters[i] + run)
+            run++;
+
+        size_t start = (size_t)(i - first) * CLUSTER_SIZE;
+        size_t bytes = len - start < (size_t)run * CLUSTER_SIZE ? len - start : (size_t)run * CLUSTER_SIZE;
+        store_extent(file->clusters[i], run, (char *)buffer + start, bytes);
+        i += run;
+    }
+
+    // os erros de escrita da thread não passam por fs_leave
+    int error = pending_error;
+    pending_error = 0;
+    return error;
+}
+
+/**
+ * Laço das threads de fs_import_tree. Cada thread começa a alocar em uma
+ * região diferente do disco, para que as partes que ela copia fiquem
+ * contíguas. A thread que termina a última parte de um arquivo o
+ * entrega ao committer
+ *
+ * @param void* estado da importação
+ *
+ * @return void* sempre NULL
+*/
+static void *import_worker(void *arg)
+{
+    import_t *pool = arg;
+    int id = __atomic_fetch_add(&pool->started, 1, __ATOMIC_RELAXED);
+    import_job_t job;
+
+    free_hint = DATA_START + (int)((int64_t)(NUM_CLUSTER - DATA_START) * id / pool->workers);
+    while (import_take(pool, id, &job))
+    {
+        import_file_t *file = job.file;
+
+        // se outra parte falhou o arquivo será descartado
+        if (__atomic_load_n(&file->error, __ATOMIC_RELAXED) == 0)
+        {
+            int error = import_chunk(file, job.chunk);
+            if (error)
+                __atomic_store_n(&file->error, error, __ATOMIC_RELAXED);
+        }
+
+        if (__atomic_sub_fetch(&file->chunks_left, 1, __ATOMIC_ACQ_REL) == 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            file->next = pool->done;
+            pool->done = file;
+            pthread_cond_signal(&pool->done_cond);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+
+    __atomic_add_fetch(&pool->worker_syscalls, thread_stats.syscalls, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->worker_bytes, thread_stats.bytes, __ATOMIC_RELAXED);
+    free(stream_buffer);
+    return NULL;
+}
+
+/**
+ * Informa a quem chamou fs_import_tree um arquivo ou diretório do host
+ * que não pôde ser importado. O disco cheio é informado uma única vez
+ *
+ * @param import_t* estado da importação
+ * @param char* caminho no host
+ * @param int código de erro
+*/
+static void import_error(import_t *pool, const char *path, int error)
+{
+    if (error == -ENOSPC)
+    {
+        if (pool->disk_full)
+            return;
+        pool->disk_full = 1;
+    }
+    if (pool->result->error != NULL)
+        pool->result->error(pool->result->arg, path, error);
+}
+
+/**
+ * Encadeia na fat os clusters de um arquivo copiado pelas threads e
+ * atualiza o tamanho da entrada. Se alguma parte falhou, os clusters
+ * ocupados são devolvidos e o arquivo fica vazio
+ *
+ * @param import_t* estado da importação
+ * @param import_file_t* arquivo concluído
+*/
+static void import_commit(import_t *pool, import_file_t *file)
+{
+    int first = file->clusters[0], tail = first;
+    off_t size = file->size;
+
+    if (file->error)
+    {
+        for (int i = 1; i < file->num_blocks; i++)
+            if (file->clusters[i] != 0)
+                mark_free(file->clusters[i]);
+        size = 0;
+        import_error(pool, file->host, file->error);
+    }
+    else
+    {
+        for (int i = 1; i < file->num_blocks; i++)
+        {
+            // o cache pode ter uma cópia antiga do cluster, de antes dele ser liberado
+            if (image_map == NULL)
+                cache_drop(file->clusters[i]);
+            set_fat(tail, file->clusters[i]);
+            tail = file->clusters[i];
+        }
+        set_fat(tail, END_FILE);
+        file_tail[first] = tail;
+        pool->result->files++;
+        pool->result->bytes += size;
+    }
+
+    entry_at(file->ref)->size = size;
+    save_entry(file->ref);
+
+    close(file->fd);
+    free(file->clusters);
+    free(file);
+}
+
+/**
+ * Encadeia os arquivos que as threads já terminaram de copiar
+ *
+ * @param import_t* estado da importação
+ * @param int flag se deve esperar que ao menos um arquivo termine
+*/
+static void import_collect(import_t *pool, int wait)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (wait && pool->done == NULL)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    import_file_t *file = pool->done;
+    pool->done = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    while (file != NULL)
+    {
+        import_file_t *next = file->next;
+        import_commit(pool, file);
+        pool->in_flight--;
+        file = next;
+    }
+}
+
+/**
+ * Cria ou reaproveita a entrada name no diretório e entrega as partes do
+ * arquivo do host às filas das threads, uma fila por vez
+ *
+ * @param import_t* estado da importação
+ * @param int descritor do diretório do host
+ * @param char* nome do arquivo
+ * @param char* caminho do arquivo no host, para as mensagens
+ * @param int primeiro cluster do diretório na imagem
+*/
+static void import_add_file(import_t *pool, int dir_fd, const char *name, const char *host, int cluster)
+{
+    struct stat st;
+    int fd = openat(dir_fd, name, O_RDONLY);
+
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        import_error(pool, host, -errno);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    if (st.st_size > INT32_MAX)
+    {
+        import_error(pool, host, -EFBIG);
+        close(fd);
+        return;
+    }
+
+    int ref = dir_lookup(cluster, name);
+    if (ref == -1)
+        ref = create_entry(name, cluster, IS_FILE);
+    else if (entry_at(ref)->attributes != IS_FILE)
+        ref = ENTRY_IN_USE;
+    else
+    {
+        // o arquivo existente é substituído, como em import
+        int first = entry_cluster(entry_at(ref));
+        file_gen[first]++;
+        free_chain(fat_get(first));
+        set_fat(first, END_FILE);
+        file_tail[first] = first;
+    }
+
+    if (ref < 0)
+    {
+        import_error(pool, host, ref);
+        close(fd);
+        return;
+    }
+
+    int num_blocks = st.st_size == 0 ? 1 : (st.st_size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+    int chunks = st.st_size == 0 ? 0 : (num_blocks + STREAM_CLUSTERS - 1) / STREAM_CLUSTERS;
+    import_file_t *file = malloc(sizeof(import_file_t) + strlen(host) + 1);
+    uint32_t *clusters = file == NULL ? NULL : calloc(num_blocks, sizeof(uint32_t));
+
+    // sem memória o arquivo fica vazio, como quando uma das partes falha
+    if (clusters == NULL)
+    {
+        free(file);
+        entry_at(ref)->size = 0;
+        save_entry(ref);
+        import_error(pool, host, -ENOMEM);
+        close(fd);
+        return;
+    }
+
+    file->fd = fd;
+    file->ref = ref;
+    file->size = st.st_size;
+    file->num_blocks = num_blocks;
+    file->clusters = clusters;
+    file->clusters[0] = entry_cluster(entry_at(ref));
+    file->chunks_left = chunks;
+    file->error = 0;
+    strcpy(file->host, host);
+
+    // as threads gravam o primeiro cluster direto no disco
+    if (image_map == NULL)
+        cache_drop(file->clusters[0]);
+
+    pool->in_flight++;
+    if (chunks == 0)
+    {
+        import_commit(pool, file);
+        pool->in_flight--;
+        return;
+    }
+
+    int pushed = 0;
+    while (pushed < chunks && queue_push(&pool->queues[pool->next_queue++ % pool->workers], (import_job_t){file, pushed}) == 0)
+        pushed++;
+
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->queued, pushed, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    // as partes que não couberam nas filas contam como falhas, e quem
+    // terminar a última parte entrega o arquivo ao committer
+    if (pushed < chunks)
+    {
+        __atomic_store_n(&file->error, -ENOMEM, __ATOMIC_RELAXED);
+        if (__atomic_sub_fetch(&file->chunks_left, chunks - pushed, __ATOMIC_ACQ_REL) == 0)
+        {
+            import_commit(pool, file);
+            pool->in_flight--;
+        }
+    }
+
+    // limita os arquivos abertos e a memória das listas de clusters
+    import_collect(pool, pool->in_flight >= IMPORT_OPEN_FILES);
+}
+
+/**
+ * Percorre o diretório do host aberto em dir_fd, criando os
+ * subdiretórios na imagem e entregando os arquivos às threads
+ *
+ * @param import_t* estado da importação
+ * @param int descritor do diretório do host, fechado ao final
+ * @param char* caminho do diretório no host, para as mensagens
+ * @param int primeiro cluster do diretório na imagem
+*/
+static void import_dir(import_t *pool, int dir_fd, const char *host, int cluster)
+{
+    DIR *dir = fdopendir(dir_fd);
+    struct dirent *item;
+
+    if (dir == NULL)
+    {
+        import_error(pool, host, -errno);
+        close(dir_fd);
+        return;
+    }
+
+    while ((item = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        struct stat st;
+
+        if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", host, item->d_name);
+
+        // links simbólicos e arquivos especiais são ignorados
+        if (fstatat(dirfd(dir), item->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            import_error(pool, path, -errno);
+        else if (S_ISREG(st.st_mode))
+            import_add_file(pool, dirfd(dir), item->d_name, path, cluster);
+        else if (S_ISDIR(st.st_mode))
+        {
+            int ref = dir_lookup(cluster, item->d_name);
+            if (ref == -1)
+            {
+                ref = create_entry(item->d_name, cluster, IS_DIR);
+                pool->result->dirs += ref >= 0;
+            }
+            else if (entry_at(ref)->attributes != IS_DIR)
+                ref = ENTRY_IN_USE;
+
+            int fd = ref >= 0 ? openat(dirfd(dir), item->d_name, O_RDONLY | O_DIRECTORY) : -1;
+            if (ref < 0)
+                import_error(pool, path, ref);
+            else if (fd == -1)
+                import_error(pool, path, -errno);
+            else
+                import_dir(pool, fd, path, entry_cluster(entry_at(ref)));
+        }
+    }
+    closedir(dir);
+}
+
+/**
+ * Importa a árvore do diretório do host aberto em fd para o diretório
+ * que começa em cluster. O committer, a thread que chama a função,
+ * percorre a árvore e faz todas as alterações de entradas e da fat,
+ * enquanto as threads leem os arquivos do host, ocupam os clusters e
+ * gravam os dados em paralelo
+ *
+ * @param int descritor do diretório no host, fechado ao final
+ * @param char* caminho do diretório no host, para os erros
+ * @param int primeiro cluster do diretório de destino
+ * @param fs_import_t* contagens da importação e função de erros
+*/
+static void import_tree(int fd, const char *host, int cluster, fs_import_t *result)
+{
+    // as threads gravam direto no disco, então o cache não pode ter
+    // clusters alterados que depois sobrescrevam os dados delas
+    if (image_map == NULL)
+    {
+        open_image(0);
+        sync_image();
+    }
+
+    import_t *pool = calloc(1, sizeof(import_t));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool->workers = cpus < 2 ? 2 : cpus > IMPORT_THREADS ? IMPORT_THREADS : cpus;
+    pool->result = result;
+    result->threads = pool->workers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    for (int i = 0; i < pool->workers; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+    int saved_alloc = shared_alloc;
+    shared_alloc = 1;
+    for (int i = 0; i < pool->workers; i++)
+        pthread_create(&pool->threads[i], NULL, import_worker, pool);
+
+    import_dir(pool, fd, host, cluster);
+    while (pool->in_flight > 0)
+        import_collect(pool, 1);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workers; i++)
+        pthread_join(pool->threads[i], NULL);
+    thread_stats.syscalls += pool->worker_syscalls;
+    thread_stats.bytes += pool->worker_bytes;
+    for (int i = 0; i < pool->workers; i++)
+    {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].jobs);
+    }
+    shared_alloc = saved_alloc;
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    free(pool);
+}
+
+/**
+ * Estado de fs_mount. As estruturas do sistema de arquivos são as
+ * variáveis globais acima, então existe um único fs_t
+*/
+struct fs
+{
+    int mounted;
+    fs_options_t options;
+};
+
+static fs_t fs_instance;
+static int thread_seed = 0;
+
+/**
+ * Toma sync_lock no modo com threads, para leitura ou para escrita
+ *
+ * @param int flag se a trava é exclusiva
+*/
+static void fs_lock(int exclusive)
+{
+    if (!threaded)
+        return;
+
+    if (exclusive)
+        pthread_rwlock_wrlock(&sync_lock);
+    else
+        pthread_rwlock_rdlock(&sync_lock);
+}
+
+/**
+ * Libera a trava tomada por fs_lock
+*/
+static void fs_unlock()
+{
+    if (threaded)
+        pthread_rwlock_unlock(&sync_lock);
+}
+
+/**
+ * Começa uma função da interface: toma sync_lock, dá à thread um ponto
+ * de partida próprio no alocador e começa a medida da função
+ *
+ * @param int flag se a função precisa da trava exclusiva
+ * @param int flag se a função pode ser chamada sem imagem carregada
+ * @param stats_mark_t* onde o início da medida é guardado
+ *
+ * @return int 0, ou -ENODEV se nenhuma imagem estiver carregada, quando
+ * a trava já foi liberada
+*/
+static int fs_enter(int exclusive, int unloaded, stats_mark_t *mark)
+{
+    pending_error = 0;
+    fs_lock(exclusive);
+    if (!image_loaded && !unloaded)
+    {
+        fs_unlock();
+        return -ENODEV;
+    }
+
+    // threads diferentes procuram clusters livres em regiões diferentes
+    if (threaded && free_hint == 0 && image_loaded)
+    {
+        int seed = __atomic_add_fetch(&thread_seed, 1, __ATOMIC_RELAXED);
+        free_hint = (int)((uint64_t)seed * 40503 % NUM_CLUSTER);
+    }
+
+    *mark = STATS_BEGIN();
+    return 0;
+}
+
+/**
+ * Termina uma função começada por fs_enter
+ *
+ * @param int constante STAT_* da função
+ * @param stats_mark_t* início da medida
+ * @param ssize_t resultado da função
+ *
+ * @return ssize_t o resultado, ou o erro de E/S ou de memória guardado
+ * em pending_error durante a função
+*/
+static ssize_t fs_leave(int op, stats_mark_t *mark, ssize_t result)
+{
+    int error = pending_error;
+
+    pending_error = 0;
+    STATS_END(op, *mark);
+    fs_unlock();
+    return error ? error : result;
+}
+
+/**
+ * Copia path para buffer, já que a resolução de caminhos altera o texto
+ *
+ * @param char* caminho recebido pela interface, ou NULL para a raiz
+ * @param char* buffer com PATH_MAX bytes
+ *
+ * @return int 0, ou -ENAMETOOLONG se o caminho não couber
+*/
+static int path_copy(const char *path, char *buffer)
+{
+    size_t len = path == NULL ? 0 : strlen(path);
+    if (len >= PATH_MAX)
+        return -ENAMETOOLONG;
+
+    memcpy(buffer, path == NULL ? "" : path, len + 1);
+    return 0;
+}
+
+/**
+ * Verifica se o arquivo aberto ainda é a mesma entrada. Deve ser chamada
+ * com o diretório pai travado ou dentro de uma leitura sem trava
+ *
+ * @param fs_file_t* arquivo aberto por fs_open
+ *
+ * @return dir_entry_t* entrada do arquivo, ou NULL se ele foi excluído
+*/
+static dir_entry_t *file_entry(const fs_file_t *file)
+{
+    if (file->ref < 0 || !IN_CHAIN(REF_CLUSTER(file->ref)))
+        return NULL;
+
+    dir_entry_t *entry = entry_at(file->ref);
+    if (entry->filename[0] == '\0' || entry->attributes != IS_FILE ||
+        entry_cluster(entry) != file->first_cluster || entry->size > IMAGE_SIZE ||
+        entry_gen[file->first_cluster] != file->entry_gen)
+        return NULL;
+    return entry;
+}
+
+/**
+ * Monta o arquivo de imagem path. A imagem só é lida por fs_load ou
+ * criada por fs_format
+ *
+ * @param char* caminho do arquivo de imagem
+ * @param fs_options_t* opções, ou NULL para as padrões
+ * @param fs_t** onde o sistema de arquivos montado é guardado
+ *
+ * @return int 0, -EBUSY se já houver um montado, -ENAMETOOLONG, -EINVAL
+ * ou -ENOMEM
+*/
+int fs_mount(const char *path, const fs_options_t *options, fs_t **fs)
+{
+    fs_options_t defaults = {0, 0, 0};
+    if (options == NULL)
+        options = &defaults;
+
+    if (fs_instance.mounted)
+        return -EBUSY;
+    if (strlen(path) >= PATH_MAX)
+        return -ENAMETOOLONG;
+    if (options->uring_depth < 0 || options->uring_depth > FS_URING_MAX_DEPTH)
+        return -EINVAL;
+
+    strcpy(image_path, path);
+    fs_instance.options = *options;
+    use_mmap = options->mmap || options->threads;
+
+    static int locks_ready = 0;
+    if (options->threads && !locks_ready)
+    {
+        // os escritores têm preferência, para que fs_sync não espere para sempre
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&sync_lock, &attr);
+        for (int i = 0; i < DIR_LOCKS; i++)
+            pthread_rwlock_init(&dir_locks[i].lock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+        for (int i = 0; i < INDEX_LOCKS; i++)
+            pthread_mutex_init(&index_locks[i], NULL);
+        locks_ready = 1;
+    }
+    threaded = options->threads;
+    shared_alloc = options->threads;
+
+    // no modo mmap não há leituras nem escritas para agrupar
+    if (options->uring_depth > 0 && !use_mmap)
+        uring_setup(options->uring_depth);
+
+    if (apply_geometry() != 0)
+    {
+        uring_teardown();
+        return -ENOMEM;
+    }
+    fs_instance.mounted = 1;
+    *fs = &fs_instance;
+    return 0;
+}
+
+/**
+ * Grava e fecha a imagem. As chamadas feitas depois disso por outras
+ * threads retornam -ENODEV
+ *
+ * @param fs_t* sistema de arquivos montado
+*/
+void fs_unmount(fs_t *fs)
+{
+    fs_lock(1);
+    if (image_loaded)
+        sync_image();
+    close_image();
+    uring_teardown();
+    image_loaded = 0;
+    fs->mounted = 0;
+    fs_unlock();
+}
+
+/**
+ * Monta em g a geometria pedida a fs_format
+ *
+ * @param geometry_t* onde a geometria é guardada
+ * @param int tamanho do cluster em bytes, ou 0 para o padrão
+ * @param int número de clusters da imagem, ou 0 para o padrão
+ * @param int bits por entrada da fat, 16 ou 32, ou 0 para escolher
+ * o menor que comporte num_clusters
+ *
+ * @return int 0, ou -EINVAL se a geometria não for suportada
+*/
+static int format_geometry(geometry_t *g, int cluster_size, int num_clusters, int fat_bits)
+{
+    if (cluster_size == 0)
+        cluster_size = DEFAULT_CLUSTER_SIZE;
+    if (num_clusters == 0)
+        num_clusters = DEFAULT_NUM_CLUSTER;
+
+    *g = (geometry_t){GEOMETRY_MAGIC, cluster_size, num_clusters, fat_bits, 0};
+#ifdef FIXED_FAT_BITS
+    if (fat_bits == 0)
+        g->fat_bits = FIXED_FAT_BITS;
+#else
+    if (fat_bits == 0)
+        g->fat_bits = num_clusters <= FAT16_MAX_CLUSTER ? 16 : 32;
+#endif
+    if (cluster_size > 0 && num_clusters > 0)
+        g->journal_clusters = journal_size(num_clusters, cluster_size);
+
+    return cluster_size > 0 && num_clusters > 0 && geometry_valid(g) ? 0 : -EINVAL;
+}
+
+/**
+ * Verifica se fs_format aceitaria a geometria, sem alterar a imagem
+ *
+ * @param int tamanho do cluster em bytes, ou 0 para o padrão
+ * @param int número de clusters da imagem, ou 0 para o padrão
+ * @param int bits por entrada da fat, ou 0 para escolher
+ *
+ * @return int 0, ou -EINVAL se a geometria não for suportada
+*/
+int fs_format_check(int cluster_size, int num_clusters, int fat_bits)
+{
+    geometry_t g;
+    return format_geometry(&g, cluster_size, num_clusters, fat_bits);
+}
+
+/**
+ * Cria uma imagem vazia com a geometria pedida, apagando a anterior
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param int tamanho do cluster em bytes, ou 0 para o padrão
+ * @param int número de clusters da imagem, ou 0 para o padrão
+ * @param int bits por entrada da fat, 16 ou 32, ou 0 para escolher
+ * o menor que comporte num_clusters
+ *
+ * @return int 0, -EINVAL se a geometria não for suportada, o erro do
+ * open, -ENOMEM ou -EIO
+*/
+int fs_format(fs_t *fs, int cluster_size, int num_clusters, int fat_bits)
+{
+    (void)fs;
+    geometry_t g;
+    if (format_geometry(&g, cluster_size, num_clusters, fat_bits))
+        return -EINVAL;
+
+    stats_mark_t mark;
+    fs_enter(1, 1, &mark);
+    geometry = g;
+    int error = format_image();
+    return fs_leave(STAT_FORMAT, &mark, error);
+}
+
+/**
+ * Carrega a imagem do disco, refazendo as transações do diário
+ *
+ * @param fs_t* sistema de arquivos montado
+ *
+ * @return int número de clusters recuperados do diário, o erro do open,
+ * -EINVAL se a geometria da imagem não for suportada ou o arquivo for
+ * menor que ela, -ENOMEM ou -EIO
+*/
+int fs_load(fs_t *fs)
+{
+    (void)fs;
+    stats_mark_t mark;
+    fs_enter(1, 1, &mark);
+    int recovered = load();
+    return fs_leave(STAT_LOAD, &mark, recovered);
+}
+
+/**
+ * Carrega a imagem de novo se outro processo a alterou desde a última
+ * leitura ou gravação
+ *
+ * @param fs_t* sistema de arquivos montado
+ *
+ * @return int o mesmo que fs_load, ou 0 se a imagem não mudou
+*/
+int fs_refresh(fs_t *fs)
+{
+    if (!image_loaded || !image_changed())
+        return 0;
+    return fs_load(fs);
+}
+
+/**
+ * Grava no disco a fat e os clusters alterados
+ *
+ * @param fs_t* sistema de arquivos montado
+ *
+ * @return int 0, -EIO ou -ENODEV
+*/
+int fs_sync(fs_t *fs)
+{
+    (void)fs;
+    stats_mark_t mark;
+    int error = fs_enter(1, 0, &mark);
+    if (error)
+        return error;
+
+    sync_image();
+    return fs_leave(STAT_SYNC, &mark, 0);
+}
+
+/**
+ * Preenche info com a geometria e o espaço livre da imagem
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_info_t* onde os dados são guardados
+ *
+ * @return int 0 ou -ENODEV
+*/
+int fs_info(fs_t *fs, fs_info_t *info)
+{
+    (void)fs;
+    fs_lock(0);
+    info->uring_depth = uring_depth;
+    if (!image_loaded)
+    {
+        fs_unlock();
+        return -ENODEV;
+    }
+
+    info->cluster_size = CLUSTER_SIZE;
+    info->num_clusters = NUM_CLUSTER;
+    info->fat_bits = FAT_BITS;
+    info->free_clusters = free_count;
+    info->journaled = journal_enabled && !use_mmap;
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * Libera os buffers da thread atual, que não vai mais usar a biblioteca
+ *
+ * @param fs_t* sistema de arquivos montado
+*/
+void fs_thread_done(fs_t *fs)
+{
+    (void)fs;
+    free(stream_buffer);
+    stream_buffer = NULL;
+    stream_buffer_size = 0;
+}
+
+/**
+ * Preenche st com os dados da entrada path
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho da entrada, com componentes separados por '/'
+ * @param fs_stat_t* onde os dados são guardados
+ *
+ * @return int 0, -ENOENT, -ENAMETOOLONG ou -ENODEV
+*/
+int fs_lookup(fs_t *fs, const char *path, fs_stat_t *st)
+{
+    (void)fs;
+    char copy[PATH_MAX], *name;
+    int parent_cluster, error = path_copy(path, copy);
+    stats_mark_t mark;
+
+    if (error || (error = fs_enter(0, 0, &mark)))
+        return error;
+
+    int ref = lock_path(copy, &parent_cluster, &name, DIR_READ);
+    if (ref == -2)
+        error = -ENOENT;
+    else
+    {
+        if (name == NULL)
+        {
+            memset(st, 0x00, sizeof(*st));
+            st->is_dir = 1;
+            st->size = CLUSTER_SIZE;
+            st->first_cluster = ROOT_CLUSTER;
+        }
+        else if (ref == -1)
+            error = -ENOENT;
+        else
+            entry_stat(entry_at(ref), st);
+        dir_unlock(parent_cluster, DIR_READ);
+    }
+
+    return fs_leave(STAT_LOOKUP, &mark, error);
+}
+
+/**
+ * Lista o diretório path em entries. No modo com threads o diretório é
+ * lido sem trava e a leitura é repetida se ele mudar durante a cópia.
+ * Depois de READ_RETRIES tentativas ele é travado para leitura
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do diretório
+ * @param fs_stat_t* entradas lidas
+ * @param int espaço em entries
+ *
+ * @return int número de entradas do diretório, que pode passar de max,
+ * -ENOENT ou -ENODEV
+*/
+int fs_readdir(fs_t *fs, const char *path, fs_stat_t *entries, int max)
+{
+    (void)fs;
+    stats_mark_t mark;
+    int found = fs_enter(0, 0, &mark);
+    if (found)
+        return found;
+    if (path == NULL)
+        path = "";
+
+    for (int attempt = 0;; attempt++)
+    {
+        int locked = attempt >= READ_RETRIES;
+        uint32_t seq = 0, removals = removal_begin();
+
+        int cluster = lookup_dir(path);
+        if (cluster == -1)
+        {
+            found = -ENOENT;
+            break;
+        }
+
+        if (locked)
+            dir_lock(cluster, DIR_READ);
+        else if ((seq = dir_read_begin(cluster)) & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // o diretório pode ter sido excluído antes de seq ser lido
+        if (removal_retry(removals))
+        {
+            if (locked)
+                dir_unlock(cluster, DIR_READ);
+            continue;
+        }
+
+        found = list_dir(cluster, entries, max);
+
+        if (locked)
+            dir_unlock(cluster, DIR_READ);
+        if (locked || !dir_read_retry(cluster, seq))
+            break;
+    }
+
+    return fs_leave(STAT_READDIR, &mark, found);
+}
+
+/**
+ * Cria a entrada path com os atributos attributes
+ *
+ * @param char* caminho da nova entrada
+ * @param int IS_FILE ou IS_DIR
+ * @param int constante STAT_* da função
+ *
+ * @return int 0, -ENOENT se o pai não existir, -EINVAL para a raiz ou um
+ * erro de create_entry
+*/
+static int make_entry(const char *path, int attributes, int op)
+{
+    char copy[PATH_MAX], *name;
+    int parent_cluster, error = path_copy(path, copy);
+    stats_mark_t mark;
+
+    if (error || (error = fs_enter(0, 0, &mark)))
+        return error;
+
+    int ref = lock_path(copy, &parent_cluster, &name, DIR_WRITE);
+    if (ref == -2)
+        error = -ENOENT;
+    else
+    {
+        if (name == NULL)
+            error = -EINVAL;
+        else if (ref >= 0)
+            error = -EEXIST;
+        else
+        {
+            ref = create_entry(name, parent_cluster, attributes);
+            error = ref < 0 ? ref : 0;
+        }
+        dir_unlock(parent_cluster, DIR_WRITE);
+    }
+
+    return fs_leave(op, &mark, error);
+}
+
+/**
+ * Cria o diretório path
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do novo diretório
+ *
+ * @return int o mesmo que make_entry
+*/
+int fs_mkdir(fs_t *fs, const char *path)
+{
+    (void)fs;
+    return make_entry(path, IS_DIR, STAT_MKDIR);
+}
+
+/**
+ * Cria o arquivo vazio path
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do novo arquivo
+ *
+ * @return int o mesmo que make_entry
+*/
+int fs_create(fs_t *fs, const char *path)
+{
+    (void)fs;
+    return make_entry(path, IS_FILE, STAT_CREATE);
+}
+
+/**
+ * Exclui o arquivo ou o diretório vazio path
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho da entrada
+ *
+ * @return int 0, -EINVAL para a raiz ou um erro de del
+*/
+int fs_unlink(fs_t *fs, const char *path)
+{
+    (void)fs;
+    char copy[PATH_MAX], *name;
+    int parent_cluster, error = path_copy(path, copy);
+    stats_mark_t mark;
+
+    if (error || (error = fs_enter(0, 0, &mark)))
+        return error;
+
+    if (lock_path(copy, &parent_cluster, &name, DIR_WRITE) == -2)
+        error = -ENOENT;
+    else
+    {
+        error = name == NULL ? -EINVAL : del(name, parent_cluster);
+        dir_unlock(parent_cluster, DIR_WRITE);
+    }
+
+    return fs_leave(STAT_UNLINK, &mark, error);
+}
+
+/**
+ * Encontra o arquivo path, criando-o se não existir e flags tiver
+ * FS_CREATE, e guarda em file o que é preciso para acessá-lo. Deve ser
+ * chamada entre fs_enter e fs_leave
+ *
+ * @param char* caminho do arquivo
+ * @param int FS_CREATE ou 0
+ * @param fs_file_t* onde o arquivo é guardado
+ *
+ * @return int 0, -ENOENT, -EINVAL para a raiz, -EISDIR ou um erro de
+ * create_entry
+*/
+static int open_file(const char *path, int flags, fs_file_t *file)
+{
+    char copy[PATH_MAX], *name;
+    int parent_cluster, error = path_copy(path, copy);
+    int mode = flags & FS_CREATE ? DIR_WRITE : DIR_READ;
+
+    if (error)
+        return error;
+
+    int ref = lock_path(copy, &parent_cluster, &name, mode);
+    if (ref == -2)
+        return -ENOENT;
+
+    if (name == NULL)
+        error = -EINVAL;
+    else if (ref == -1 && (flags & FS_CREATE))
+        error = (ref = create_entry(name, parent_cluster, IS_FILE)) < 0 ? ref : 0;
+    else if (ref == -1)
+        error = -ENOENT;
+    else if (entry_at(ref)->attributes != IS_FILE)
+        error = -EISDIR;
+
+    if (error == 0)
+    {
+        memset(file, 0x00, sizeof(*file));
+        file->parent = parent_cluster;
+        file->ref = ref;
+        file->first_cluster = entry_cluster(entry_at(ref));
+        file->entry_gen = entry_gen[file->first_cluster];
+    }
+    dir_unlock(parent_cluster, mode);
+    return error;
+}
+
+/**
+ * Abre o arquivo path para fs_pread e fs_pwrite
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do arquivo
+ * @param int FS_CREATE para criar o arquivo se ele não existir, ou 0
+ * @param fs_file_t* onde o arquivo aberto é guardado
+ *
+ * @return int o mesmo que open_file, ou -ENODEV
+*/
+int fs_open(fs_t *fs, const char *path, int flags, fs_file_t *file)
+{
+    (void)fs;
+    stats_mark_t mark;
+    int error = fs_enter(0, 0, &mark);
+    if (error)
+        return error;
+
+    error = open_file(path, flags, file);
+    return fs_leave(STAT_OPEN, &mark, error);
+}
+
+/**
+ * Lê até len bytes do arquivo a partir de offset, percorrendo a cadeia a
+ * partir do último cluster alcançado pelo arquivo. No modo com threads
+ * o arquivo é lido sem travar o diretório pai, que é travado por quem
+ * escreve nele, e a leitura é repetida se o pai mudar durante a cópia.
+ * Depois de READ_RETRIES tentativas o pai é travado para leitura
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* buffer com espaço para len bytes
+ * @param size_t quantidade de bytes pedida
+ * @param off_t posição do primeiro byte
+ *
+ * @return ssize_t bytes lidos, 0 no fim do arquivo, -EINVAL, -ESTALE ou -ENODEV
+*/
+ssize_t fs_pread(fs_t *fs, fs_file_t *file, void *buffer, size_t len, off_t offset)
+{
+    (void)fs;
+    stats_mark_t mark;
+    ssize_t read = fs_enter(0, 0, &mark);
+    if (read)
+        return read;
+    if (offset < 0)
+    {
+        return fs_leave(STAT_PREAD, &mark, -EINVAL);
+    }
+
+    for (int attempt = 0;; attempt++)
+    {
+        int locked = attempt >= READ_RETRIES;
+        uint32_t seq = 0;
+
+        if (locked)
+            dir_lock(file->parent, DIR_READ);
+        else if ((seq = dir_read_begin(file->parent)) & 1)
+        {
+            sched_yield();
+            continue;
+        }
+
+        // a posição só é guardada em file se a leitura não for repetida
+        fs_file_t snapshot = *file;
+        dir_entry_t *entry = file_entry(file);
+        if (entry == NULL)
+            read = -ESTALE;
+        else
+            read = read_range(file->first_cluster, entry->size, buffer, len, offset, &snapshot);
+
+        if (locked)
+            dir_unlock(file->parent, DIR_READ);
+        if (locked || !dir_read_retry(file->parent, seq))
+        {
+            *file = snapshot;
+            break;
+        }
+    }
+
+    return fs_leave(STAT_PREAD, &mark, read);
+}
+
+/**
+ * Escreve len bytes de buffer no arquivo a partir de offset, estendendo
+ * o arquivo se preciso, como fs_pread. Um intervalo entre o fim do
+ * arquivo e offset é preenchido com zeros
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* dados que serão escritos
+ * @param size_t quantidade de bytes
+ * @param off_t posição do primeiro byte
+ *
+ * @return ssize_t bytes escritos, -EINVAL, -EFBIG, -ENOSPC, -ESTALE ou -ENODEV
+*/
+ssize_t fs_pwrite(fs_t *fs, fs_file_t *file, const void *buffer, size_t len, off_t offset)
+{
+    (void)fs;
+    stats_mark_t mark;
+    ssize_t written = fs_enter(0, 0, &mark);
+    if (written)
+        return written;
+
+    if (offset < 0)
+        written = -EINVAL;
+    else if ((uint64_t)offset + len > INT32_MAX)
+        written = -EFBIG;
+    else
+    {
+        dir_lock(file->parent, DIR_WRITE);
+        dir_entry_t *entry = file_entry(file);
+        if (entry == NULL)
+            written = -ESTALE;
+        else
+        {
+            off_t size = write_range(file->first_cluster, entry->size, buffer, len, offset, file);
+            if (size < 0)
+                written = size;
+            else
+            {
+                written = len;
+                entry = entry_at(file->ref);
+                entry->size = size;
+                save_entry(file->ref);
+            }
+        }
+        dir_unlock(file->parent, DIR_WRITE);
+    }
+
+    return fs_leave(STAT_PWRITE, &mark, written);
+}
+
+/**
+ * Muda o tamanho do arquivo para size. Ao diminuir, os clusters depois
+ * do novo fim são liberados; ao crescer, o trecho novo é preenchido com
+ * zeros como em fs_pwrite
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param off_t novo tamanho
+ *
+ * @return int 0, -EINVAL, -EFBIG, -ENOSPC, -ESTALE, -ENODEV ou -EIO se
+ * a cadeia for menor que o tamanho do arquivo
+*/
+int fs_truncate(fs_t *fs, fs_file_t *file, off_t size)
+{
+    (void)fs;
+    stats_mark_t mark;
+    int error = fs_enter(0, 0, &mark);
+    if (error)
+        return error;
+
+    if (size < 0)
+        error = -EINVAL;
+    else if (size > INT32_MAX)
+        error = -EFBIG;
+    else
+    {
+        dir_lock(file->parent, DIR_WRITE);
+        dir_entry_t *entry = file_entry(file);
+        if (entry == NULL)
+            error = -ESTALE;
+        else if (size > (off_t)entry->size)
+        {
+            off_t new_size = write_range(file->first_cluster, entry->size, NULL, size - entry->size, entry->size, file);
+            error = new_size < 0 ? new_size : 0;
+        }
+        else if (size < (off_t)entry->size)
+        {
+            // um arquivo vazio continua ocupando o primeiro cluster
+            int keep = size == 0 ? 1 : (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
+            int last = chain_seek(file->first_cluster, keep - 1, file);
+
+            if (last == -1)
+                error = -EIO;
+            else
+            {
+                file_gen[file->first_cluster]++;
+                free_chain(fat_get(last));
+                set_fat(last, END_FILE);
+                file_tail[file->first_cluster] = last;
+            }
+        }
+
+        if (error == 0)
+        {
+            entry = entry_at(file->ref);
+            entry->size = size;
+            save_entry(file->ref);
+        }
+        dir_unlock(file->parent, DIR_WRITE);
+    }
+
+    return fs_leave(STAT_TRUNCATE, &mark, error);
+}
+
+/**
+ * Muda a posição usada por fs_read e fs_write, como o lseek
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param off_t deslocamento
+ * @param int SEEK_SET, SEEK_CUR ou SEEK_END
+ *
+ * @return off_t nova posição, -EINVAL, -ESTALE ou -ENODEV
+*/
+off_t fs_seek(fs_t *fs, fs_file_t *file, off_t offset, int whence)
+{
+    (void)fs;
+    off_t base = 0;
+
+    if (whence == SEEK_CUR)
+        base = file->offset;
+    else if (whence == SEEK_END)
+    {
+        fs_lock(0);
+        if (!image_loaded)
+            base = -ENODEV;
+        else
+        {
+            dir_lock(file->parent, DIR_READ);
+            dir_entry_t *entry = file_entry(file);
+            base = entry == NULL ? -ESTALE : (off_t)entry->size;
+            dir_unlock(file->parent, DIR_READ);
+        }
+        fs_unlock();
+        if (base < 0)
+            return base;
+    }
+    else if (whence != SEEK_SET)
+        return -EINVAL;
+
+    if (base + offset < 0)
+        return -EINVAL;
+    file->offset = base + offset;
+    return file->offset;
+}
+
+/**
+ * Lê até len bytes a partir da posição do arquivo, que avança
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* buffer com espaço para len bytes
+ * @param size_t quantidade de bytes pedida
+ *
+ * @return ssize_t o mesmo que fs_pread
+*/
+ssize_t fs_read(fs_t *fs, fs_file_t *file, void *buffer, size_t len)
+{
+    ssize_t read = fs_pread(fs, file, buffer, len, file->offset);
+    if (read > 0)
+        file->offset += read;
+    return read;
+}
+
+/**
+ * Escreve len bytes de buffer na posição do arquivo, que avança
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* dados que serão escritos
+ * @param size_t quantidade de bytes
+ *
+ * @return ssize_t o mesmo que fs_pwrite
+*/
+ssize_t fs_write(fs_t *fs, fs_file_t *file, const void *buffer, size_t len)
+{
+    ssize_t written = fs_pwrite(fs, file, buffer, len, file->offset);
+    if (written > 0)
+        file->offset += written;
+    return written;
+}
+
+/**
+ * Substitui o conteúdo do arquivo, ou acrescenta ao seu final, com os
+ * len bytes de buffer
+ *
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param char* dados que serão escritos
+ * @param size_t quantidade de bytes
+ * @param int flag se os dados são acrescentados
+ * @param int constante STAT_* da função
+ *
+ * @return ssize_t novo tamanho do arquivo, -EFBIG, -ENOSPC, -ESTALE ou -ENODEV
+*/
+static ssize_t put_file(fs_file_t *file, const char *buffer, size_t len, int append, int op)
+{
+    stats_mark_t mark;
+    ssize_t size = fs_enter(0, 0, &mark);
+    if (size)
+        return size;
+
+    dir_lock(file->parent, DIR_WRITE);
+    dir_entry_t *entry = file_entry(file);
+    if (entry == NULL)
+        size = -ESTALE;
+    else if (len + (append ? entry->size : 0) > INT32_MAX)
+        size = -EFBIG;
+    else
+    {
+        if (append)
+            size = append_file(buffer, len, file->first_cluster, entry->size);
+        else
+            size = write_file(buffer, len, file->first_cluster);
+
+        // write_file esvazia o arquivo quando o disco enche
+        entry = entry_at(file->ref);
+        if (size >= 0 || !append)
+        {
+            entry->size = size < 0 ? 0 : size;
+            save_entry(file->ref);
+        }
+    }
+    dir_unlock(file->parent, DIR_WRITE);
+
+    return fs_leave(op, &mark, size);
+}
+
+/**
+ * Substitui o conteúdo do arquivo pelos len bytes de buffer
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* novo conteúdo
+ * @param size_t quantidade de bytes
+ *
+ * @return ssize_t o mesmo que put_file. Com -ENOSPC o arquivo fica vazio
+*/
+ssize_t fs_replace(fs_t *fs, fs_file_t *file, const void *buffer, size_t len)
+{
+    (void)fs;
+    return put_file(file, buffer, len, 0, STAT_REPLACE);
+}
+
+/**
+ * Acrescenta os len bytes de buffer ao final do arquivo
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param fs_file_t* arquivo aberto por fs_open
+ * @param void* dados acrescentados
+ * @param size_t quantidade de bytes
+ *
+ * @return ssize_t o mesmo que put_file. Com -ENOSPC nada é escrito
+*/
+ssize_t fs_append(fs_t *fs, fs_file_t *file, const void *buffer, size_t len)
+{
+    (void)fs;
+    return put_file(file, buffer, len, 1, STAT_APPEND);
+}
+
+/**
+ * Copia o arquivo do host aberto em fd para o arquivo path, criado se
+ * ainda não existir
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do arquivo na imagem
+ * @param int descritor do arquivo do host
+ *
+ * @return ssize_t tamanho do arquivo, um erro de open_file, -ENOSPC,
+ * -EFBIG ou -EIO. Em caso de erro o arquivo guarda o que foi copiado
+*/
+ssize_t fs_import(fs_t *fs, const char *path, int fd)
+{
+    (void)fs;
+    stats_mark_t mark;
+    fs_file_t file;
+    ssize_t error = fs_enter(0, 0, &mark);
+    if (error)
+        return error;
+
+    error = open_file(path, FS_CREATE, &file);
+    if (error == 0)
+    {
+        off_t size;
+
+        dir_lock(file.parent, DIR_WRITE);
+        if (file_entry(&file) == NULL)
+            error = -ESTALE;
+        else
+        {
+            error = import_file(fd, file.first_cluster, &size);
+            entry_at(file.ref)->size = size;
+            save_entry(file.ref);
+        }
+        dir_unlock(file.parent, DIR_WRITE);
+        if (error == 0)
+            error = size;
+    }
+
+    return fs_leave(STAT_IMPORT, &mark, error);
+}
+
+/**
+ * Importa a árvore do diretório do host aberto em fd para o diretório
+ * path, criado se ainda não existir. As demais funções ficam paradas
+ * até o fim da importação
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param int descritor do diretório no host, sempre fechado pela função
+ * @param char* caminho do diretório no host, usado nos erros
+ * @param char* caminho do diretório de destino na imagem
+ * @param fs_import_t* contagens da importação e função de erros
+ *
+ * @return int 0, -ENOENT, -ENOTDIR, um erro de create_entry ou -ENODEV
+*/
+int fs_import_tree(fs_t *fs, int fd, const char *host, const char *path, fs_import_t *result)
+{
+    (void)fs;
+    char copy[PATH_MAX], *name;
+    int parent_cluster, error = path_copy(path, copy);
+    stats_mark_t mark;
+
+    result->dirs = result->files = result->threads = 0;
+    result->bytes = 0;
+    if (error || (error = fs_enter(1, 0, &mark)))
+    {
+        close(fd);
+        return error;
+    }
+
+    int ref = resolve_path(copy, &parent_cluster, &name);
+    int cluster = ROOT_CLUSTER;
+
+    if (ref == -2)
+        error = -ENOENT;
+    else if (name != NULL && ref == -1)
+    {
+        ref = create_entry(name, parent_cluster, IS_DIR);
+        if (ref < 0)
+            error = ref;
+        else
+        {
+            result->dirs++;
+            cluster = entry_cluster(entry_at(ref));
+        }
+    }
+    else if (name != NULL && entry_at(ref)->attributes != IS_DIR)
+        error = -ENOTDIR;
+    else if (name != NULL)
+        cluster = entry_cluster(entry_at(ref));
+
+    if (error == 0)
+        import_tree(fd, host, cluster, result);
+    else
+        close(fd);
+
+    return fs_leave(STAT_IMPORT_TREE, &mark, error);
+}
+
+/**
+ * Copia o conteúdo do arquivo path para o descritor fd
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do arquivo
+ * @param int descritor de saída
+ *
+ * @return int 0, um erro de open_file, -EIO se a escrita falhar ou -ENODEV
+*/
+int fs_export(fs_t *fs, const char *path, int fd)
+{
+    (void)fs;
+    stats_mark_t mark;
+    fs_file_t file;
+    int error = fs_enter(0, 0, &mark);
+    if (error)
+        return error;
+
+    error = open_file(path, 0, &file);
+    if (error == 0)
+    {
+        dir_lock(file.parent, DIR_READ);
+        dir_entry_t *entry = file_entry(&file);
+        if (entry == NULL)
+            error = -ESTALE;
+        else if (stream_file(file.first_cluster, entry->size, fd) == -1)
+            error = -EIO;
+        dir_unlock(file.parent, DIR_READ);
+    }
+
+    return fs_leave(STAT_EXPORT, &mark, error);
+}
+
+/**
+ * Liga ou desliga a coleta de estatísticas
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param int flag se a coleta fica ligada
+*/
+void fs_stats_enable(fs_t *fs, int enabled)
+{
+    (void)fs;
+    fs_lock(1);
+    stats_enabled = enabled;
+    fs_unlock();
+}
+
+/**
+ * @param fs_t* sistema de arquivos montado
+ *
+ * @return int flag se a coleta de estatísticas está ligada
+*/
+int fs_stats_enabled(fs_t *fs)
+{
+    (void)fs;
+    fs_lock(0);
+    int enabled = stats_enabled;
+    fs_unlock();
+    return enabled;
+}
+
+/**
+ * Zera as estatísticas coletadas
+ *
+ * @param fs_t* sistema de arquivos montado
+*/
+void fs_stats_reset(fs_t *fs)
+{
+    (void)fs;
+    fs_lock(1);
+    stats_reset();
+    fs_unlock();
+}
+
+/**
+ * Escreve em out a tabela de estatísticas de cada função
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param FILE* saída
+*/
+void fs_stats_print(fs_t *fs, FILE *out)
+{
+    (void)fs;
+    fs_lock(1);
+    stats_show(out);
+    fs_unlock();
+}
+
+/**
+ * Escreve em out os acertos e as faltas do cache de clusters
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param FILE* saída
+*/
+void fs_cache_print(fs_t *fs, FILE *out)
+{
+    (void)fs;
+    fs_lock(0);
+    cache_stats(out);
+    fs_unlock();
+}
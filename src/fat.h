@@ -0,0 +1,144 @@
+#ifndef FAT_H
+#define FAT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Interface da biblioteca libfat. Todas as funções que podem falhar
+ * retornam um código de erro negativo do errno (como -ENOENT ou
+ * -ENOSPC), e os dados são lidos e escritos em buffers do chamador, sem
+ * alocações nas operações de leitura e escrita.
+ *
+ * O estado do sistema de arquivos é global ao processo, então só uma
+ * imagem pode estar montada por vez. Com a opção threads as funções
+ * podem ser chamadas por várias threads ao mesmo tempo
+*/
+
+#define FS_NAME_MAX 17
+#define FS_URING_MAX_DEPTH 4096
+#define FS_CREATE 1
+
+typedef struct fs fs_t;
+
+/**
+ * Opções de fs_mount. mmap acessa a imagem mapeada na memória em vez do
+ * cache de clusters, uring_depth ativa o io_uring com essa profundidade
+ * de fila (0 para E/S síncrona) e threads permite chamadas concorrentes,
+ * o que implica mmap.
+ *
+ * Com mmap as alterações vão direto para as páginas mapeadas, que o
+ * kernel pode gravar na imagem a qualquer momento, então o diário não é
+ * usado: uma queda no meio de uma operação pode deixar a fat e os
+ * diretórios inconsistentes. Só o modo com o cache de clusters, sem mmap
+ * e sem threads, confirma as alterações no diário antes de gravá-las
+*/
+typedef struct
+{
+    int mmap;
+    int uring_depth;
+    int threads;
+} fs_options_t;
+
+/**
+ * Geometria e estado da imagem montada. uring_depth é 0 se o io_uring
+ * não foi pedido ou não está disponível, e journaled é 0 se as
+ * alterações não passam pelo diário, como no modo mmap
+*/
+typedef struct
+{
+    int cluster_size;
+    int num_clusters;
+    int fat_bits;
+    int free_clusters;
+    int uring_depth;
+    int journaled;
+} fs_info_t;
+
+/**
+ * Entrada de diretório, preenchida por fs_lookup e fs_readdir
+*/
+typedef struct
+{
+    char name[FS_NAME_MAX + 1];
+    int is_dir;
+    uint32_t size;
+    uint32_t first_cluster;
+} fs_stat_t;
+
+/**
+ * Arquivo aberto por fs_open. O chamador guarda a estrutura, que não
+ * precisa ser liberada nem pode ser usada por duas threads ao mesmo
+ * tempo. Se o arquivo for excluído as operações sobre ele retornam
+ * -ESTALE, e ele não continua válido depois de fs_load ou fs_format.
+ *
+ * entry_gen distingue o arquivo de outro criado depois da exclusão com o
+ * mesmo primeiro cluster. offset é a posição de fs_read e fs_write. Os
+ * campos pos_* guardam o último cluster alcançado na cadeia, para que o
+ * acesso sequencial não percorra a cadeia desde o primeiro cluster a
+ * cada chamada
+*/
+typedef struct
+{
+    int parent;
+    int ref;
+    uint32_t first_cluster;
+    uint32_t entry_gen;
+    off_t offset;
+    uint32_t pos_gen;
+    uint32_t pos_index;
+    uint32_t pos_cluster;
+} fs_file_t;
+
+/**
+ * Resultado de fs_import_tree. error, se não for NULL, é chamada para
+ * cada arquivo ou diretório que não pôde ser importado
+*/
+typedef struct
+{
+    int dirs;
+    int files;
+    long long bytes;
+    int threads;
+    void (*error)(void *arg, const char *path, int error);
+    void *arg;
+} fs_import_t;
+
+int fs_mount(const char *path, const fs_options_t *options, fs_t **fs);
+void fs_unmount(fs_t *fs);
+int fs_format_check(int cluster_size, int num_clusters, int fat_bits);
+int fs_format(fs_t *fs, int cluster_size, int num_clusters, int fat_bits);
+int fs_load(fs_t *fs);
+int fs_refresh(fs_t *fs);
+int fs_sync(fs_t *fs);
+int fs_info(fs_t *fs, fs_info_t *info);
+void fs_thread_done(fs_t *fs);
+
+int fs_lookup(fs_t *fs, const char *path, fs_stat_t *st);
+int fs_readdir(fs_t *fs, const char *path, fs_stat_t *entries, int max);
+int fs_mkdir(fs_t *fs, const char *path);
+int fs_create(fs_t *fs, const char *path);
+int fs_unlink(fs_t *fs, const char *path);
+
+int fs_open(fs_t *fs, const char *path, int flags, fs_file_t *file);
+ssize_t fs_pread(fs_t *fs, fs_file_t *file, void *buffer, size_t len, off_t offset);
+ssize_t fs_pwrite(fs_t *fs, fs_file_t *file, const void *buffer, size_t len, off_t offset);
+off_t fs_seek(fs_t *fs, fs_file_t *file, off_t offset, int whence);
+ssize_t fs_read(fs_t *fs, fs_file_t *file, void *buffer, size_t len);
+ssize_t fs_write(fs_t *fs, fs_file_t *file, const void *buffer, size_t len);
+ssize_t fs_replace(fs_t *fs, fs_file_t *file, const void *buffer, size_t len);
+ssize_t fs_append(fs_t *fs, fs_file_t *file, const void *buffer, size_t len);
+int fs_truncate(fs_t *fs, fs_file_t *file, off_t size);
+
+ssize_t fs_import(fs_t *fs, const char *path, int fd);
+int fs_import_tree(fs_t *fs, int fd, const char *host, const char *path, fs_import_t *result);
+int fs_export(fs_t *fs, const char *path, int fd);
+
+void fs_stats_enable(fs_t *fs, int enabled);
+int fs_stats_enabled(fs_t *fs);
+void fs_stats_reset(fs_t *fs);
+void fs_stats_print(fs_t *fs, FILE *out);
+void fs_cache_print(fs_t *fs, FILE *out);
+
+#endif
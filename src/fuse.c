@@ -0,0 +1,447 @@
+#define FUSE_USE_VERSION 31
+#define _GNU_SOURCE
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "fat.h"
+
+#define FAT_NAME "fat.part"
+#define FUSE_IO_MAX (1 << 20)
+#define FUSE_DIR_ENTRIES 64
+
+/**
+ * Servidor FUSE da imagem FAT, cliente da libfat como o shell. A imagem
+ * é montada com threads, então o laço multithread do FUSE chama a
+ * biblioteca de várias threads ao mesmo tempo. O cache de escrita do
+ * kernel e leituras de até FUSE_IO_MAX bytes são pedidos em fuse_init.
+ * Enquanto estiver montada a imagem não deve ser alterada pelo shell
+ *
+ * Uso: ./fatfuse [--image=arquivo] <ponto de montagem> [opções do FUSE]
+*/
+
+/**
+ * Arquivo aberto, guardado em fi->fh. A posição na cadeia guardada em
+ * file é compartilhada pelas threads que usam o mesmo arquivo, então
+ * cada operação trabalha em uma cópia e só a devolve no final
+*/
+typedef struct
+{
+    pthread_mutex_t lock;
+    fs_file_t file;
+} fuse_file_t;
+
+/**
+ * Opções da linha de comando lidas por fuse_opt_parse
+*/
+typedef struct
+{
+    const char *image;
+} fuse_options_t;
+
+/**
+ * Sistema de arquivos montado em main
+*/
+fs_t *fs = NULL;
+
+/**
+ * Tamanho do cluster da imagem, usado como tamanho de bloco em stat
+*/
+int cluster_size;
+
+static const struct fuse_opt option_spec[] = {
+    {"--image=%s", offsetof(fuse_options_t, image), 1},
+    FUSE_OPT_END,
+};
+
+/**
+ * Copia a posição de handle para file
+ *
+ * @param fuse_file_t* arquivo aberto
+ * @param fs_file_t* onde a cópia é guardada
+*/
+static void file_get(fuse_file_t *handle, fs_file_t *file)
+{
+    pthread_mutex_lock(&handle->lock);
+    *file = handle->file;
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Devolve a handle a posição alcançada por uma operação
+ *
+ * @param fuse_file_t* arquivo aberto
+ * @param fs_file_t* cópia usada pela operação
+*/
+static void file_put(fuse_file_t *handle, const fs_file_t *file)
+{
+    pthread_mutex_lock(&handle->lock);
+    handle->file = *file;
+    pthread_mutex_unlock(&handle->lock);
+}
+
+/**
+ * Preenche st com os dados de uma entrada da imagem
+ *
+ * @param fs_stat_t* entrada lida por fs_lookup ou fs_readdir
+ * @param struct stat* onde os dados são guardados
+*/
+static void fill_stat(const fs_stat_t *entry, struct stat *st)
+{
+    memset(st, 0x00, sizeof(*st));
+    st->st_mode = entry->is_dir ? S_IFDIR | 0755 : S_IFREG | 0644;
+    st->st_nlink = entry->is_dir ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = entry->size;
+    st->st_blksize = cluster_size;
+    st->st_blocks = ((off_t)entry->size + cluster_size - 1) / cluster_size * (cluster_size / 512);
+    st->st_ino = entry->first_cluster;
+}
+
+/**
+ * Configura a conexão: cache de escrita do kernel, se houver, e
+ * operações de até FUSE_IO_MAX bytes. O libfuse calcula o máximo de
+ * páginas por pedido a partir de max_write, o que vale também para as
+ * leituras
+*/
+static void *fat_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    conn->max_write = FUSE_IO_MAX;
+    conn->max_readahead = FUSE_IO_MAX;
+
+    // só o servidor altera a imagem, então o cache de páginas continua
+    // válido entre aberturas do mesmo arquivo
+    cfg->kernel_cache = 1;
+    cfg->use_ino = 1;
+    return NULL;
+}
+
+/**
+ * Grava a imagem e a desmonta quando o FUSE termina
+*/
+static void fat_destroy(void *data)
+{
+    (void)data;
+    fs_sync(fs);
+    fs_unmount(fs);
+}
+
+/**
+ * Preenche st com os dados da entrada path
+*/
+static int fat_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+    (void)fi;
+    fs_stat_t entry;
+    int error = fs_lookup(fs, path, &entry);
+
+    if (error == 0)
+        fill_stat(&entry, st);
+    return error;
+}
+
+/**
+ * Lista o diretório path, com "." e ".."
+*/
+static int fat_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset,
+                       struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    (void)offset;
+    (void)fi;
+    (void)flags;
+    int max = FUSE_DIR_ENTRIES;
+    fs_stat_t *entries = malloc(max * sizeof(fs_stat_t)), *grown;
+    int found = -ENOMEM;
+
+    // o diretório pode crescer entre as chamadas, então a lista é pedida de novo
+    while (entries != NULL && (found = fs_readdir(fs, path, entries, max)) > max)
+    {
+        max = found;
+        if ((grown = realloc(entries, max * sizeof(fs_stat_t))) == NULL)
+        {
+            found = -ENOMEM;
+            break;
+        }
+        entries = grown;
+    }
+
+    if (found >= 0)
+    {
+        filler(buffer, ".", NULL, 0, 0);
+        filler(buffer, "..", NULL, 0, 0);
+    }
+    for (int i = 0; i < found; i++)
+    {
+        struct stat st;
+        fill_stat(&entries[i], &st);
+        if (filler(buffer, entries[i].name, &st, 0, 0))
+            break;
+    }
+    free(entries);
+    return found < 0 ? found : 0;
+}
+
+/**
+ * Cria o diretório path. As entradas não guardam permissões
+*/
+static int fat_mkdir(const char *path, mode_t mode)
+{
+    (void)mode;
+    return fs_mkdir(fs, path);
+}
+
+/**
+ * Exclui o arquivo path. Diretórios só são excluídos por fat_rmdir
+*/
+static int fat_unlink(const char *path)
+{
+    fs_stat_t entry;
+    int error = fs_lookup(fs, path, &entry);
+
+    if (error == 0 && entry.is_dir)
+        error = -EISDIR;
+    return error ? error : fs_unlink(fs, path);
+}
+
+/**
+ * Exclui o diretório vazio path
+*/
+static int fat_rmdir(const char *path)
+{
+    fs_stat_t entry;
+    int error = fs_lookup(fs, path, &entry);
+
+    if (error == 0 && !entry.is_dir)
+        error = -ENOTDIR;
+    return error ? error : fs_unlink(fs, path);
+}
+
+/**
+ * Abre path, criando-o se flags tiver FS_CREATE, e guarda o arquivo em fi
+ *
+ * @param char* caminho do arquivo
+ * @param int flags de fs_open
+ * @param struct fuse_file_info* onde o arquivo aberto é guardado
+ *
+ * @return int 0 ou um erro de fs_open
+*/
+static int open_handle(const char *path, int flags, struct fuse_file_info *fi)
+{
+    fuse_file_t *handle = malloc(sizeof(fuse_file_t));
+    if (handle == NULL)
+        return -ENOMEM;
+
+    int error = fs_open(fs, path, flags, &handle->file);
+    if (error)
+    {
+        free(handle);
+        return error;
+    }
+
+    pthread_mutex_init(&handle->lock, NULL);
+    fi->fh = (uintptr_t)handle;
+    return 0;
+}
+
+/**
+ * Abre o arquivo path, que precisa existir
+*/
+static int fat_open(const char *path, struct fuse_file_info *fi)
+{
+    return open_handle(path, 0, fi);
+}
+
+/**
+ * Abre o arquivo path, criando-o se ele não existir
+*/
+static int fat_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void)mode;
+    return open_handle(path, FS_CREATE, fi);
+}
+
+/**
+ * Libera o arquivo aberto por fat_open ou fat_create
+*/
+static int fat_release(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    fuse_file_t *handle = (fuse_file_t *)(uintptr_t)fi->fh;
+
+    pthread_mutex_destroy(&handle->lock);
+    free(handle);
+    return 0;
+}
+
+/**
+ * Lê até len bytes a partir de offset, continuando da posição na cadeia
+ * guardada pela leitura anterior do mesmo arquivo
+*/
+static int fat_read(const char *path, char *buffer, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+    (void)path;
+    fuse_file_t *handle = (fuse_file_t *)(uintptr_t)fi->fh;
+    fs_file_t file;
+
+    file_get(handle, &file);
+    ssize_t read = fs_pread(fs, &file, buffer, len, offset);
+    file_put(handle, &file);
+    return read;
+}
+
+/**
+ * Escreve len bytes a partir de offset, estendendo o arquivo se preciso
+*/
+static int fat_write(const char *path, const char *buffer, size_t len, off_t offset, struct fuse_file_info *fi)
+{
+    (void)path;
+    fuse_file_t *handle = (fuse_file_t *)(uintptr_t)fi->fh;
+    fs_file_t file;
+
+    file_get(handle, &file);
+    ssize_t written = fs_pwrite(fs, &file, buffer, len, offset);
+    file_put(handle, &file);
+    return written;
+}
+
+/**
+ * Muda o tamanho do arquivo com fs_truncate, pelo arquivo aberto em fi
+ * ou, sem ele, abrindo path
+*/
+static int fat_truncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    fs_file_t file;
+
+    if (fi == NULL)
+    {
+        int error = fs_open(fs, path, 0, &file);
+        return error ? error : fs_truncate(fs, &file, size);
+    }
+
+    fuse_file_t *handle = (fuse_file_t *)(uintptr_t)fi->fh;
+    file_get(handle, &file);
+    int error = fs_truncate(fs, &file, size);
+    file_put(handle, &file);
+    return error;
+}
+
+/**
+ * As entradas não guardam datas, então só o sucesso é informado, para
+ * que programas como touch e tar funcionem
+*/
+static int fat_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi)
+{
+    (void)tv;
+    (void)fi;
+    fs_stat_t entry;
+    return fs_lookup(fs, path, &entry);
+}
+
+/**
+ * Preenche st com o tamanho e o espaço livre da imagem
+*/
+static int fat_statfs(const char *path, struct statvfs *st)
+{
+    (void)path;
+    fs_info_t info;
+    int error = fs_info(fs, &info);
+
+    if (error)
+        return error;
+    memset(st, 0x00, sizeof(*st));
+    st->f_bsize = info.cluster_size;
+    st->f_frsize = info.cluster_size;
+    st->f_blocks = info.num_clusters;
+    st->f_bfree = info.free_clusters;
+    st->f_bavail = info.free_clusters;
+    st->f_namemax = FS_NAME_MAX;
+    return 0;
+}
+
+/**
+ * Grava no disco a fat e os clusters alterados
+*/
+static int fat_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void)path;
+    (void)datasync;
+    (void)fi;
+    return fs_sync(fs);
+}
+
+static const struct fuse_operations fat_operations = {
+    .init = fat_init,
+    .destroy = fat_destroy,
+    .getattr = fat_getattr,
+    .readdir = fat_readdir,
+    .mkdir = fat_mkdir,
+    .unlink = fat_unlink,
+    .rmdir = fat_rmdir,
+    .open = fat_open,
+    .create = fat_create,
+    .release = fat_release,
+    .read = fat_read,
+    .write = fat_write,
+    .truncate = fat_truncate,
+    .utimens = fat_utimens,
+    .statfs = fat_statfs,
+    .fsync = fat_fsync,
+};
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    fuse_options_t options = {FAT_NAME};
+    char image[PATH_MAX];
+
+    if (fuse_opt_parse(&args, &options, option_spec, NULL) == -1)
+        return 1;
+
+    // o FUSE muda o diretório atual ao rodar em segundo plano
+    if (realpath(options.image, image) == NULL)
+    {
+        fprintf(stderr, "O arquivo %s não existe, crie-o com init\n", options.image);
+        return 1;
+    }
+
+    fs_options_t mount_options = {0, 0, 1};
+    int error = fs_mount(image, &mount_options, &fs);
+    if (error != 0)
+    {
+        fprintf(stderr, "Erro ao abrir o arquivo\n");
+        return 1;
+    }
+
+    error = fs_load(fs);
+    if (error == -EINVAL)
+        fprintf(stderr, "A geometria de %s não é suportada\n", image);
+    else if (error < 0)
+        fprintf(stderr, "Erro ao abrir o arquivo\n");
+    if (error < 0)
+    {
+        fs_unmount(fs);
+        return 1;
+    }
+    if (error > 0)
+        fprintf(stderr, "Recuperados %d clusters do diário\n", error);
+
+    fs_info_t info;
+    fs_info(fs, &info);
+    cluster_size = info.cluster_size;
+    if (!info.journaled)
+        fprintf(stderr, "Aviso: a imagem mapeada não usa o diário, uma queda pode deixá-la inconsistente\n");
+
+    int status = fuse_main(args.argc, args.argv, &fat_operations, NULL);
+    fuse_opt_free_args(&args);
+    return status;
+}
@@ -1,883 +1,833 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
-#include <math.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include "fat.h"
 
-#define SECTOR_SIZE 512
-#define CLUSTER_SIZE (2 * SECTOR_SIZE)
-#define ENTRY_BY_CLUSTER (CLUSTER_SIZE / sizeof(dir_entry_t))
-#define NUM_CLUSTER 4096
 #define FAT_NAME "fat.part"
-#define END_FILE 0xffff
-#define CLUSTER_START (CLUSTER_SIZE) * 10
-#define IS_FILE 0
-#define IS_DIR 1
-#define CLUSTER_FREE 0
-#define CLUSTER_OCCUPIED 1
+#define PROMPT "SHELL V-POWER → "
+#define OUT (client_out != NULL ? client_out : stdout)
+#define BATCH_SYNC 4096
+#define SERVER_BACKLOG 64
+#define SERVER_SYNC_MS 1000
+#define STATS_ENV "FAT_STATS"
+#define LS_ENTRIES 64
+#define SHELL_FILES 16
+#define READ_CHUNK (64 << 10)
 
 /**
- * Estrutura que representa uma entrada de arquivo ou diretório
+ * Shell da imagem FAT, cliente da libfat. Os comandos são lidos da
+ * entrada padrão, de um script ou, no modo servidor, de conexões em um
+ * socket Unix, e os códigos de erro da biblioteca viram as mensagens
+ * mostradas ao usuário
 */
-typedef struct
-{
-    uint8_t filename[18];
-    uint8_t attributes;
-    uint8_t reserved[7];
-    uint16_t first_block;
-    uint32_t size;
-} dir_entry_t;
 
 /**
- * Estrutura que representa um cluster na memoria, e pode conter dados ou entradas para outros diretórios
+ * Sistema de arquivos montado em main
 */
-typedef union
-{
-    dir_entry_t dir[CLUSTER_SIZE / sizeof(dir_entry_t)];
-    uint8_t data[CLUSTER_SIZE];
-} data_cluster;
+fs_t *fs;
+
+/**
+ * Entrada de onde as respostas de init são lidas no modo não interativo.
+ * No modo servidor cada cliente tem a sua, assim como a saída client_out
+*/
+__thread FILE *batch_input = NULL;
+__thread FILE *client_out = NULL;
+volatile sig_atomic_t server_stop = 0;
 
-uint8_t boot_block[CLUSTER_SIZE];
-uint16_t fat[NUM_CLUSTER];
-dir_entry_t root_dir[ENTRY_BY_CLUSTER];
-data_cluster clusters[4086];
-uint8_t free_clusters[NUM_CLUSTER];
+/**
+ * Arquivos abertos pelo comando open, identificados pela posição. No
+ * modo servidor cada cliente tem os seus
+*/
+__thread fs_file_t files[SHELL_FILES];
+__thread int file_used[SHELL_FILES];
 
 /**
- * Encontra a primeira posição de cluster livre na tabela fat, percorrendo o array free_clusters
+ * Retorna o último componente de path, usado nas mensagens
+ *
+ * @param char* caminho, com componentes separados por '/'
  *
- * @return int representa o posição do cluster na tabela fat
+ * @return char* nome do último componente
 */
-int find_free_cluster()
+const char *base_name(const char *path)
 {
-    for (int cluster_entry = 9; cluster_entry < NUM_CLUSTER; cluster_entry++)
-    {
-        if (free_clusters[cluster_entry] == CLUSTER_FREE)
-        {
-            free_clusters[cluster_entry] = CLUSTER_OCCUPIED;
-
-            return cluster_entry;
-        }
-    }
-
-    return -1;
+    const char *slash = strrchr(path, '/');
+    return slash == NULL ? path : slash + 1;
 }
 
 /**
- * Escreve no arquivo FAT_NAME os dados de um cluster
+ * Mostra que o diretório pai de path não existe
  *
- * @param int posição do cluster que será salvo
- * @param data_cluster cluster que será salvo
+ * @param char* caminho cujo pai não foi encontrado
 */
-void write_data(int cluster, data_cluster data)
+void parent_error(const char *path)
 {
-    FILE *file = fopen(FAT_NAME, "rb+");
-    fseek(file, (cluster * CLUSTER_SIZE), SEEK_SET);
-    fwrite(&data, sizeof(data), 1, file);
-    fclose(file);
+    const char *name = base_name(path);
+    int len = name - path > 0 ? (int)(name - path) - 1 : 0;
+    fprintf(OUT, "O diretorio \"%.*s\" não existe\n", len, path);
 }
 
 /**
- * Lê do arquivo FAT_NAME os dados de um cluster
- * 
- * @param int posição do cluster que será lido
- * 
- * @return data_cluster cluster lido pela função
+ * Mostra a mensagem de um erro da criação de uma entrada
+ *
+ * @param int código de erro
+ * @param char* nome da entrada
 */
-data_cluster load_data(int cluster)
+void entry_error(int error, const char *name)
 {
-    data_cluster data;
-    if (cluster < 9)
-    {
-        printf("Cluster inválido\n");
-        return data;
-    }
-    else if (cluster == 9)
-    {
-        memcpy(&data, root_dir, sizeof(root_dir));
-        return data;
-    }
-
-    FILE *file = fopen(FAT_NAME, "rb+");
-    fseek(file, (cluster * CLUSTER_SIZE), SEEK_SET);
-    fread(&data, sizeof(data), 1, file);
-    fclose(file);
-    return data;
+    if (error == -ENAMETOOLONG)
+        fprintf(OUT, "O nome \"%s\" é muito longo\n", name);
+    else if (error == -EEXIST)
+        fprintf(OUT, "O nome \"%s\" já está em uso\n", name);
+    else if (error == -ENOSPC)
+        fprintf(OUT, "O disco está cheio!\n");
+    else if (error == -ENODEV)
+        fprintf(OUT, "O arquivo %s não existe, crie-o com init\n", FAT_NAME);
+    else if (error == -ENOMEM)
+        fprintf(OUT, "Memória insuficiente\n");
+    else
+        fprintf(OUT, "Entrada inválida!\n");
 }
 
 /**
- * Atualiza a tabela fat no arquivo FAT_NAME
+ * Mostra um arquivo ou diretório do host que fs_import_tree não importou
+ *
+ * @param void* não usado
+ * @param char* caminho no host
+ * @param int código de erro
 */
-void write_fat()
+void import_tree_error(void *arg, const char *path, int error)
 {
-    //Lê o arquivo
-    FILE *file = fopen(FAT_NAME, "rb+");
-    fseek(file, CLUSTER_SIZE, SEEK_SET);
-    fwrite(&fat, sizeof(fat), 1, file);
-    fclose(file);
+    (void)arg;
+
+    if (error == -ENAMETOOLONG || error == -EEXIST || error == -ENOSPC)
+        entry_error(error, base_name(path));
+    else if (error == -EFBIG)
+        fprintf(OUT, "O arquivo \"%s\" é muito grande\n", path);
+    else if (error == -EIO)
+        fprintf(OUT, "Erro ao ler \"%s\"\n", path);
+    else
+        fprintf(OUT, "Não foi possível abrir \"%s\"\n", path);
 }
 
 /**
- * Função que preenche na memória os dados padrões determinados pelo PDF da atividade
+ * Pede a confirmação e formata a imagem com a geometria pedida
+ *
+ * @param int tamanho do cluster, ou 0 para o padrão
+ * @param int número de clusters, ou 0 para o padrão
+ * @param int bits por entrada da fat, ou 0 para escolher
 */
-void init()
+void init(int cluster_size, int num_clusters, int fat_bits)
 {
-    char response;
-    printf("Todos os seus arquivos serão excluídos no processo, deseja continuar? [s/N] ");
-
-    setbuf(stdin, NULL);
-    response = getc(stdin);
-    if (response != 's' && response != 'S')
-        return;
-
-    FILE *file = fopen(FAT_NAME, "wb");
-    if (file == NULL)
-    {
-        printf("Erro ao abrir o arquivo\n");
-        exit(1);
-    }
-    //Preenche o boot block com o padrão 0xbb, e o escreve no arquivo
-    for (int i = 0; i < CLUSTER_SIZE; i++)
+    if (cluster_size < 0 || num_clusters < 0 || fs_format_check(cluster_size, num_clusters, fat_bits) != 0)
     {
-        boot_block[i] = 0xbb;
+        fprintf(OUT, "Geometria inválida!\n");
+        return;
     }
-    fwrite(&boot_block, sizeof(boot_block), 1, file);
-
-    //Preenche a fat
-    fat[0] = 0xfffd;
-    for (int i = 1; i < 9; i++)
-        fat[i] = 0xfffe;
-    fat[9] = END_FILE;
-    for (int i = 10; i < NUM_CLUSTER; i++)
-        fat[i] = 0x0000;
-    fwrite(&fat, sizeof(fat), 1, file);
 
-    //Preenche o root_dir com o padrão 0x00, e o escreve no arquivo
-    memset(root_dir, 0x00, sizeof(root_dir));
-    fwrite(&root_dir, sizeof(root_dir), 1, file);
+    char response;
+    FILE *answer = batch_input != NULL ? batch_input : stdin;
+    fprintf(OUT, "Todos os seus arquivos serão excluídos no processo, deseja continuar? [s/N] ");
+    fflush(OUT);
+
+    // no modo não interativo a resposta é a próxima linha do script
+    if (batch_input == NULL)
+        setbuf(stdin, NULL);
+    response = getc(answer);
+    if (response != 's' && response != 'S')
+        return;
 
-    //Preenche os clusters com o padrão 0x00, e o escreve no arquivo
-    memset(clusters, 0x00, sizeof(clusters));
-    fwrite(&clusters, sizeof(clusters), 1, file);
+    int error = fs_format(fs, cluster_size, num_clusters, fat_bits);
 
-    fclose(file);
-    setbuf(stdin, NULL);
-    getc(stdin);
+    if (batch_input == NULL)
+        setbuf(stdin, NULL);
+    getc(answer);
 
-    printf("Operação concluída!\n");
+    if (error)
+        fprintf(OUT, "Erro ao abrir o arquivo\n");
+    else
+        fprintf(OUT, "Operação concluída!\n");
 }
 
 /**
- * Carrega o boot block, a fat e o root dir do 
- * arquivo FAT_NAME para a memória
- * 
- * @param int flag se a mensagem de "Operação concluída"
- * deve ser mostrada, usada para a atualização automática
- * entre as operações do shell
+ * Carrega a imagem, mostrando quantos clusters o diário recuperou
+ *
+ * @param int flag se a mensagem de "Operação concluída" deve ser mostrada
+ * @param int resultado de fs_load ou fs_refresh
 */
-void load(int flag)
+void show_load(int flag, int recovered)
 {
-    FILE *file;
-    file = fopen(FAT_NAME, "rb");
-    if (file == NULL)
-    {
-        printf("Erro ao abrir o arquivo &\n");
-        exit(1);
-    }
-
-    fread(&boot_block, sizeof(boot_block), 1, file);
-    fread(&fat, sizeof(fat), 1, file);
-    fread(&root_dir, sizeof(root_dir), 1, file);
-    fclose(file);
-    for (int i = 0; i < NUM_CLUSTER; i++)
+    if (recovered == -EINVAL)
+        fprintf(OUT, "A geometria de %s não é suportada\n", FAT_NAME);
+    else if (recovered < 0)
+        fprintf(OUT, "Erro ao abrir o arquivo\n");
+    else
     {
-        free_clusters[i] = fat[i] == CLUSTER_FREE ? CLUSTER_FREE : CLUSTER_OCCUPIED;
+        if (recovered > 0)
+            fprintf(OUT, "Recuperados %d clusters do diário\n", recovered);
+        if (flag)
+            fprintf(OUT, "Operação concluída!\n");
     }
-    if (flag)
-        printf("Operação concluída!\n");
 }
 
-/** 
- * Cria uma nova entrada de nome dir no parent_dir. Os 
- * attributes podem ser ou IS_DIR para criar um diretório 
- * ou IS_FILE para criar um arquivo
- * 
- * @param char[18] nome da entrada que será adicionada
- * @param data_cluster data cluster do diretório pai
- * @param int cluster onde o pai está
- * @param int atributos da entrada
+/**
+ * Mostra todas as entradas do diretório path
+ *
+ * @param char* caminho do diretório
 */
-void new_entry(char dir[18], data_cluster parent_dir, int parent_cluster, int attributes)
+void ls(const char *path)
 {
-    int cluster_entry = find_free_cluster();
+    int max = LS_ENTRIES;
+    fs_stat_t *entries = malloc(max * sizeof(fs_stat_t)), *grown;
+    int found = -ENOMEM;
 
-    int dir_entry, flag = 0;
-    for (dir_entry = 0; dir_entry < ENTRY_BY_CLUSTER; dir_entry++)
+    // o diretório pode crescer entre as chamadas, então a lista é pedida de novo
+    while (entries != NULL && (found = fs_readdir(fs, path, entries, max)) > max)
     {
-        if (strcmp(dir, parent_dir.dir[dir_entry].filename) == 0)
+        max = found;
+        if ((grown = realloc(entries, max * sizeof(fs_stat_t))) == NULL)
         {
-            flag = 1;
+            found = -ENOMEM;
             break;
         }
-        else if (parent_dir.dir[dir_entry].size == 0)
-            break;
+        entries = grown;
     }
 
-    if (flag)
-    {
-        printf("O nome \"%s\" já está em uso\n", dir);
-        return;
-    }
+    if (found == -ENOENT)
+        fprintf(OUT, "O diretorio \"%s\" não existe\n", path);
+    else if (found < 0)
+        entry_error(found, path);
+    else if (found == 0)
+        fprintf(OUT, "Diretório vazio\n");
+    for (int i = 0; i < found; i++)
+        fprintf(OUT, "%s - %s - %uB\n", entries[i].is_dir ? "D" : "A", entries[i].name, entries[i].size);
+    free(entries);
+}
 
-    if (dir_entry == ENTRY_BY_CLUSTER)
-    {
-        printf("Impossível criar o novo diretório\nDiretório pai está cheio!\n");
-        return;
-    }
+/**
+ * Mostra o arquivo path. Com threads o conteúdo é lido por fs_pread,
+ * que não trava o diretório pai enquanto ele não mudar, em pedaços de
+ * READ_CHUNK bytes; sem threads ele é enviado direto para a saída padrão
+ *
+ * @param char* caminho do arquivo
+*/
+void read_command(const char *path)
+{
+    fs_stat_t st;
+    fs_file_t file;
+    int error = fs_lookup(fs, path, &st);
 
-    if (cluster_entry == -1)
+    if (error == 0 && st.is_dir)
+        error = -EISDIR;
+    if (error == 0 && client_out == NULL)
     {
-        printf("Impossível criar o novo diretório\nO disco está cheio!\n");
-        return;
+        fflush(stdout);
+        error = fs_export(fs, path, STDOUT_FILENO);
     }
+    else if (error == 0 && (error = fs_open(fs, path, 0, &file)) == 0)
+    {
+        char buffer[READ_CHUNK];
+        ssize_t len;
 
-    fat[cluster_entry] = END_FILE;
-
-    dir_entry_t entry;
-    strcpy(entry.filename, dir);
-    entry.attributes = attributes;
-    entry.first_block = cluster_entry;
-    entry.size = CLUSTER_SIZE;
-
-    parent_dir.dir[dir_entry] = entry;
-
-    data_cluster new_entry;
-    memset(&new_entry, 0x00, sizeof(new_entry));
-
-    // atualiza a pasta pai
-    write_data(parent_cluster, parent_dir);
-
-    // limpa a memória para a nova entrada
-    write_data(cluster_entry, new_entry);
-
-    // atualiza o fat no disco
-    write_fat();
+        while ((len = fs_read(fs, &file, buffer, sizeof(buffer))) > 0)
+            fwrite(buffer, 1, len, OUT);
+        error = len < 0 ? len : 0;
+    }
 
-    if (attributes)
-        printf("Diretório \"%s\" criado!\n", dir);
+    if (error)
+        fprintf(OUT, "Entrada inválida!\n");
     else
-        printf("Arquivo \"%s\" criado!\n", dir);
+        fprintf(OUT, "\n");
 }
 
 /**
- * Mostra todas as entradas de diretório válidas 
- * no parent_dir
- * 
- * @param data_cluster data cluster do diretório pai
+ * Retorna o arquivo aberto com o número text
+ *
+ * @param char* número do arquivo, como mostrado por open
+ *
+ * @return fs_file_t* arquivo, ou NULL se o número não for de um arquivo aberto
 */
-void ls(data_cluster parent_dir)
+fs_file_t *shell_file(const char *text)
 {
-    int i;
-    for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-    {
-        if (parent_dir.dir[i].size == 0)
-            break;
-        printf(parent_dir.dir[i].attributes == IS_DIR ? "D - " : "A - ");
-        printf("%s - %dB\n", parent_dir.dir[i].filename, parent_dir.dir[i].size);
-    }
-    if (i == 0)
+    char *end;
+    long id = text == NULL ? -1 : strtol(text, &end, 10);
+
+    if (id < 0 || id >= SHELL_FILES || *end != '\0' || !file_used[id])
     {
-        printf("Diretório vazio\n");
+        fprintf(OUT, "Descritor inválido\n");
+        return NULL;
     }
+    return &files[id];
 }
 
 /**
- * Exclui a entrada dir no parent dir
- * 
- * @param char* nome da entrada a ser excluída
- * @param data_cluster data cluster do diretório pai
- * @param int número do cluster do pai
+ * Interpreta e executa uma linha de comando. As alterações ficam em
+ * memória até a próxima chamada de fs_sync
+ *
+ * @param char* linha com o comando, alterada por strtok_r
 */
-void del(char dir[18], data_cluster parent_dir, int parent_cluster)
+void run_command(char *input)
 {
-    int i;
-    for (i = 0; i < ENTRY_BY_CLUSTER; i++)
+    char *save;
+    char *command = strtok_r(input, " ", &save);
+    if (command == NULL)
+        return;
+
+    if (strcmp(command, "init") == 0)
     {
-        if (strcmp(dir, parent_dir.dir[i].filename) == 0)
-        {
-            break;
-        }
+        char *cluster_size = strtok_r(NULL, " ", &save);
+        char *num_clusters = strtok_r(NULL, " ", &save);
+        char *fat_bits = strtok_r(NULL, " ", &save);
+
+        init(cluster_size != NULL ? atoi(cluster_size) : 0,
+             num_clusters != NULL ? atoi(num_clusters) : 0,
+             fat_bits != NULL ? atoi(fat_bits) : 0);
     }
-    if (i == ENTRY_BY_CLUSTER)
+    else if (strcmp(command, "load") == 0)
     {
-        printf("O arquivo ou diretório \"%s\" não existe", dir);
-        return;
+        show_load(1, fs_load(fs));
+    }
+    else if (strcmp(command, "cache") == 0)
+    {
+        fs_cache_print(fs, OUT);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        char *action = strtok_r(NULL, " ", &save);
+
+        if (action != NULL && strcmp(action, "on") == 0)
+            fs_stats_enable(fs, 1);
+        else if (action != NULL && strcmp(action, "off") == 0)
+            fs_stats_enable(fs, 0);
+        else if (action != NULL && strcmp(action, "reset") == 0)
+            fs_stats_reset(fs);
+        else if (action != NULL)
+            fprintf(OUT, "Uso: stats [on|off|reset]\n");
+        else if (!fs_stats_enabled(fs))
+            fprintf(OUT, "A coleta está desligada, use stats on\n");
+        else
+            fs_stats_print(fs, OUT);
     }
+    else if (strcmp(command, "mkdir") == 0 || strcmp(command, "create") == 0)
+    {
+        char *path = strtok_r(NULL, "", &save);
+        int dir = strcmp(command, "mkdir") == 0;
+        int error = dir ? fs_mkdir(fs, path) : fs_create(fs, path);
+
+        if (error == -EINVAL)
+            fprintf(OUT, dir ? "Não é possível criar a pasta raiz\n" : "Nome inválido\n");
+        else if (error == -ENOENT)
+            parent_error(path);
+        else if (error == -ENOSPC)
+            fprintf(OUT, "Impossível criar o novo diretório\nO disco está cheio!\n");
+        else if (error)
+            entry_error(error, base_name(path));
+        else
+            fprintf(OUT, dir ? "Diretório \"%s\" criado!\n" : "Arquivo \"%s\" criado!\n", base_name(path));
+    }
+    else if (strcmp(command, "ls") == 0)
+    {
+        char *path = strtok_r(NULL, "", &save);
+        ls(path == NULL ? "" : path);
+    }
+    else if (strcmp(command, "unlink") == 0)
+    {
+        char *path = strtok_r(NULL, "", &save);
+        fs_stat_t st;
+        int error = fs_lookup(fs, path, &st);
+
+        if (error == 0)
+            error = fs_unlink(fs, path);
+
+        if (error == -EINVAL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (error == -ENOENT)
+            fprintf(OUT, "O arquivo ou diretório \"%s\" não existe\n", base_name(path));
+        else if (error == -EBUSY)
+            fprintf(OUT, "O diretório \"%s\" está em uso\n", base_name(path));
+        else if (error == -ENOTEMPTY)
+            fprintf(OUT, "O diretório \"%s\" não está vazio\n", base_name(path));
+        else if (error)
+            entry_error(error, base_name(path));
+        else
+            fprintf(OUT, st.is_dir ? "Diretório deletado com sucesso!\n" : "Arquivo deletado com sucesso!\n");
+    }
+    else if (strcmp(command, "write") == 0 || strcmp(command, "append") == 0)
+    {
+        char *stream = strtok_r(NULL, "\"", &save);
+        char *path = strtok_r(NULL, " ", &save);
+        fs_file_t file;
+        ssize_t error;
+
+        if (stream == NULL || path == NULL)
+            error = -EINVAL;
+        else if ((error = fs_open(fs, path, 0, &file)) == 0)
+        {
+            if (strcmp(command, "write") == 0)
+                error = fs_replace(fs, &file, stream, strlen(stream));
+            else
+                error = fs_append(fs, &file, stream, strlen(stream));
+        }
 
-    if (parent_dir.dir[i].attributes == IS_FILE)
+        if (error == -EINVAL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (error < 0)
+            entry_error(error, base_name(path));
+    }
+    else if (strcmp(command, "import") == 0)
     {
-        int block = parent_dir.dir[i].first_block, aux;
-        while (block != END_FILE)
+        char *host = strtok_r(NULL, " ", &save);
+        int recursive = host != NULL && strcmp(host, "-r") == 0;
+        if (recursive)
+            host = strtok_r(NULL, " ", &save);
+        char *path = strtok_r(NULL, "", &save);
+
+        int fd = host == NULL || path == NULL ? -1 : open(host, recursive ? O_RDONLY | O_DIRECTORY : O_RDONLY);
+        if (host == NULL || path == NULL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (fd == -1)
+            fprintf(OUT, "Não foi possível abrir \"%s\"\n", host);
+        else if (recursive)
         {
-            aux = block;
-            block = fat[block];
-            fat[aux] = 0x00;
+            fs_import_t result = {.error = import_tree_error};
+            struct timespec start, end;
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            int error = fs_import_tree(fs, fd, host, path, &result);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            if (error == -ENOENT)
+                parent_error(path);
+            else if (error)
+                entry_error(error, base_name(path));
+            else
+                fprintf(OUT, "%d diretórios e %d arquivos importados, %lld bytes em %.3fs (%.1f MB/s, %d threads)\n",
+                        result.dirs, result.files, result.bytes, elapsed,
+                        elapsed > 0 ? result.bytes / elapsed / 1e6 : 0.0, result.threads);
+        }
+        else
+        {
+            ssize_t error = fs_import(fs, path, fd);
+
+            if (error == -ENOENT)
+                parent_error(path);
+            else if (error == -EIO)
+                fprintf(OUT, "Erro ao ler \"%s\"\n", host);
+            else if (error == -EFBIG)
+                fprintf(OUT, "O arquivo \"%s\" é muito grande\n", host);
+            else if (error < 0)
+                entry_error(error, base_name(path));
+            close(fd);
         }
-        fat[block] = 0x00;
-        printf("Arquivo deletado com sucesso!\n");
-        return;
     }
+    else if (strcmp(command, "export") == 0)
+    {
+        char *path = strtok_r(NULL, " ", &save);
+        char *host = strtok_r(NULL, "", &save);
+        fs_stat_t st;
+
+        if (host == NULL || path == NULL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (fs_lookup(fs, path, &st) != 0 || st.is_dir)
+            fprintf(OUT, "Entrada inválida!\n");
+        else
+        {
+            int fd = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-    data_cluster data = load_data(parent_dir.dir[i].first_block);
-
-    if (data.dir[0].size != 0)
+            if (fd == -1)
+                fprintf(OUT, "Não foi possível abrir \"%s\"\n", host);
+            else
+            {
+                int error = fs_export(fs, path, fd);
+                if (error == -EIO)
+                    fprintf(OUT, "Erro ao escrever em \"%s\"\n", host);
+                else if (error)
+                    fprintf(OUT, "Entrada inválida!\n");
+                close(fd);
+            }
+        }
+    }
+    else if (strcmp(command, "read") == 0)
     {
-        printf("O diretório \"%s\" não está vazio\n", parent_dir.dir[i].filename);
-        return;
+        char *path = strtok_r(NULL, "", &save);
+        read_command(path == NULL ? "" : path);
     }
-    fat[parent_dir.dir[i].first_block] = 0x00;
-    memset(&(parent_dir.dir[i]), 0x00, sizeof(parent_dir.dir[i]));
-    write_fat();
-    write_data(parent_cluster, parent_dir);
-    printf("Diretório deletado com sucesso!\n");
-}
-
-/**
- * Escreve stream no arquivo que começa no
- * bloco first_cluster
- * 
- * @param char* primeiro bloco do arquivo
- * @param int tamanho atual do arquivo
- * 
- * @return int com o tamanho do arquivo
-*/
-int write_file(char *stream, int first_cluster)
-{
-    long num_blocks = ceil((float)strlen(stream) / CLUSTER_SIZE);
-    int curr_cluster = first_cluster;
-
-    while (fat[curr_cluster] != END_FILE)
+    else if (strcmp(command, "open") == 0)
     {
-        int aux = curr_cluster;
-        curr_cluster = fat[aux];
-        fat[aux] = 0x00;
+        char *path = strtok_r(NULL, "", &save);
+        int id = 0;
+
+        while (id < SHELL_FILES && file_used[id])
+            id++;
+
+        int error = id == SHELL_FILES ? 0 : fs_open(fs, path, 0, &files[id]);
+        if (id == SHELL_FILES)
+            fprintf(OUT, "Muitos arquivos abertos\n");
+        else if (error == -EINVAL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (error)
+            entry_error(error, path);
+        else
+        {
+            file_used[id] = 1;
+            fprintf(OUT, "Arquivo aberto como %d\n", id);
+        }
+    }
+    else if (strcmp(command, "close") == 0)
+    {
+        fs_file_t *file = shell_file(strtok_r(NULL, " ", &save));
+        if (file != NULL)
+            file_used[file - files] = 0;
     }
-    fat[curr_cluster] = 0x00;
+    else if (strcmp(command, "seek") == 0)
+    {
+        fs_file_t *file = shell_file(strtok_r(NULL, " ", &save));
+        char *offset = strtok_r(NULL, " ", &save);
 
-    fat[first_cluster] = END_FILE;
-    curr_cluster = first_cluster;
-    for (int i = 1; i < num_blocks; i++)
+        if (file != NULL && (offset == NULL || fs_seek(fs, file, atoll(offset), SEEK_SET) < 0))
+            fprintf(OUT, "Posição inválida\n");
+    }
+    else if (strcmp(command, "pread") == 0)
     {
-        int free_cluster = find_free_cluster();
-        if (free_cluster == -1)
+        // sem a posição, a leitura começa onde a anterior parou
+        fs_file_t *file = shell_file(strtok_r(NULL, " ", &save));
+        char *len = strtok_r(NULL, " ", &save);
+        char *offset = strtok_r(NULL, " ", &save);
+
+        if (file != NULL && (len == NULL || atoll(len) < 0))
+            fprintf(OUT, "Tamanho inválido\n");
+        else if (file != NULL)
         {
-            fat[curr_cluster] = END_FILE;
-            printf("O disco está cheio!\n");
+            // o tamanho vem do usuário, então a leitura é feita em pedaços de READ_CHUNK
+            char buffer[READ_CHUNK];
+            long long left = atoll(len);
+            off_t position = offset == NULL ? 0 : atoll(offset);
+            ssize_t read = 0;
 
-            int curr_cluster = first_cluster;
-            while (fat[curr_cluster] != END_FILE)
+            while (left > 0)
             {
-                int aux = curr_cluster;
-                curr_cluster = fat[aux];
-                fat[aux] = 0x00;
+                size_t chunk = left < READ_CHUNK ? (size_t)left : READ_CHUNK;
+                read = offset == NULL ? fs_read(fs, file, buffer, chunk) :
+                                        fs_pread(fs, file, buffer, chunk, position);
+                if (read <= 0)
+                    break;
+                fwrite(buffer, 1, read, OUT);
+                left -= read;
+                position += read;
+                if ((size_t)read < chunk)
+                    break;
             }
-            fat[curr_cluster] = 0x00;
-            fat[first_cluster] = END_FILE;
-
-            return CLUSTER_SIZE;
+            if (read < 0)
+                entry_error(read, "");
+            else
+                fprintf(OUT, "\n");
         }
-        fat[curr_cluster] = free_cluster;
-        curr_cluster = fat[curr_cluster];
     }
-    fat[curr_cluster] = END_FILE;
-
-    curr_cluster = first_cluster;
-    for (int i = 0; i < num_blocks; i++)
+    else if (strcmp(command, "pwrite") == 0)
     {
-        data_cluster data;
-        memset(&data, 0x00, sizeof(data));
-
-        if (i + 1 == num_blocks)
-            memcpy(&data, stream, strlen(stream));
-        else
-            memcpy(&data, stream, CLUSTER_SIZE);
+        char *stream = strtok_r(NULL, "\"", &save);
+        fs_file_t *file = stream == NULL ? NULL : shell_file(strtok_r(NULL, " ", &save));
+        char *offset = strtok_r(NULL, " ", &save);
 
-        write_data(curr_cluster, data);
-        stream += 1024;
-        curr_cluster = fat[curr_cluster];
+        if (stream == NULL)
+            fprintf(OUT, "Nome inválido\n");
+        else if (file != NULL)
+        {
+            ssize_t written = offset == NULL ? fs_write(fs, file, stream, strlen(stream)) :
+                                               fs_pwrite(fs, file, stream, strlen(stream), atoll(offset));
+            if (written == -EFBIG || written == -EINVAL)
+                fprintf(OUT, "Posição inválida\n");
+            else if (written < 0)
+                entry_error(written, "");
+        }
+    }
+    else
+    {
+        fprintf(OUT, "Comando inválido!\n");
     }
-    write_fat();
-    return num_blocks * CLUSTER_SIZE;
 }
 
 /**
- * Lê e retorna um conjunto de caracteres do arquivo
- * que começa no bloco first_cluster
- * 
- * @param int primeiro bloco do arquivo
- * @param int tamanho atual do arquivo
- * 
- * @return char* com o texto contido no arquivo
+ * Executa os comandos do arquivo path, ou da entrada padrão se path for
+ * NULL, sem readline. Os metadados só são gravados a cada sync_every
+ * comandos e no fim do script, e ao final é mostrada a vazão obtida
+ *
+ * @param char* caminho do script, ou NULL
+ * @param long número de comandos entre gravações, ou 0 para gravar só no fim
+ *
+ * @return int código de saída do programa
 */
-char *read_file(int first_cluster, int size)
+int run_batch(const char *path, long sync_every)
 {
-    int curr_cluster = first_cluster, num_blocks = size / CLUSTER_SIZE;
+    FILE *in = path != NULL ? fopen(path, "r") : stdin;
+    if (in == NULL)
+    {
+        fprintf(OUT, "Não foi possível abrir \"%s\"\n", path);
+        return 1;
+    }
+    batch_input = in;
 
-    data_cluster file_data[num_blocks];
-    char *stream = (char *)file_data;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    for (int i = 0; i < num_blocks; i++)
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    long commands = 0;
+
+    while ((len = getline(&line, &capacity, in)) != -1)
     {
-        file_data[i] = load_data(curr_cluster);
-        curr_cluster = fat[curr_cluster];
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        run_command(line);
+        commands++;
+        if (sync_every > 0 && commands % sync_every == 0)
+            fs_sync(fs);
     }
+    fs_sync(fs);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fflush(stdout);
+    fprintf(stderr, "%ld comandos em %.3fs (%.0f comandos/s)\n", commands, elapsed,
+            elapsed > 0 ? commands / elapsed : 0.0);
+
+    free(line);
+    if (in != stdin)
+        fclose(in);
+    batch_input = NULL;
+    return 0;
+}
 
-    return stream;
+/**
+ * Pede ao laço de run_server que termine, ao receber SIGINT ou SIGTERM
+ *
+ * @param int sinal recebido
+*/
+void stop_server(int sig)
+{
+    (void)sig;
+    server_stop = 1;
 }
 
 /**
- * Escreve stream no final do arquivo que começa no
- * bloco first_cluster
- * 
- * @param char* texto que será inserido no final do arquivo
- * @param int primeiro bloco do arquivo
- * @param int tamanho atual do arquivo
- * 
- * @return int com o tamanho do arquivo
+ * Atende uma conexão do modo servidor. Cada linha recebida é executada
+ * como um comando, e a resposta termina com PROMPT, para que o cliente
+ * saiba quando o comando terminou
+ *
+ * @param void* descritor da conexão
+ *
+ * @return void* sempre NULL
 */
-int append_file(char *stream, int first_cluster, int curr_size)
+void *serve_client(void *arg)
 {
-    int curr_cluster = first_cluster, num_blocks = curr_size / CLUSTER_SIZE, final_cluster;
-    data_cluster file_data;
-    char *file_stream;
-    int new_blocks = 0;
+    int fd = (int)(intptr_t)arg;
 
-    while (curr_cluster != END_FILE)
+    batch_input = fdopen(fd, "r");
+    client_out = fdopen(dup(fd), "w");
+    if (batch_input == NULL || client_out == NULL)
     {
-        final_cluster = curr_cluster;
-        curr_cluster = fat[curr_cluster];
+        close(fd);
+        return NULL;
     }
 
-    file_stream = read_file(final_cluster, CLUSTER_SIZE);
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t len;
 
-    int len_final_cluster = strlen(file_stream);
-    if (len_final_cluster == CLUSTER_SIZE)
-        new_blocks = ceil((float)strlen(stream) / CLUSTER_SIZE);
-    else
-        new_blocks = ceil((float)(strlen(stream) + len_final_cluster) / CLUSTER_SIZE) - 1;
-
-    for (int i = 0; i < new_blocks; i++)
+    fputs(PROMPT, client_out);
+    fflush(client_out);
+    while ((len = getline(&line, &capacity, batch_input)) != -1)
     {
-        int free_cluster = find_free_cluster();
-        if (free_cluster == -1)
-        {
-            fat[curr_cluster] = END_FILE;
-            printf("O disco está cheio!\n");
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
 
-            int curr_cluster = final_cluster;
-            while (fat[curr_cluster] != END_FILE)
-            {
-                int aux = curr_cluster;
-                curr_cluster = fat[aux];
-                fat[aux] = 0x00;
-                free_clusters[aux] = CLUSTER_FREE;
-            }
-            fat[curr_cluster] = 0x00;
-            free_clusters[curr_cluster] = CLUSTER_FREE;
-            fat[final_cluster] = END_FILE;
-
-            return CLUSTER_SIZE;
-        }
-        fat[curr_cluster] = free_cluster;
-        curr_cluster = fat[curr_cluster];
+        run_command(line);
+        fputs(PROMPT, client_out);
+        fflush(client_out);
     }
-    fat[curr_cluster] = END_FILE;
 
-    if (len_final_cluster < CLUSTER_SIZE)
-    {
-        FILE *file = fopen(FAT_NAME, "rb+");
-        fseek(file, final_cluster * CLUSTER_SIZE + len_final_cluster, SEEK_SET);
+    free(line);
+    fclose(batch_input);
+    fclose(client_out);
+    fs_thread_done(fs);
+    return NULL;
+}
 
-        if (strlen(stream) >= CLUSTER_SIZE - len_final_cluster)
-        {
-            fwrite(stream, CLUSTER_SIZE - len_final_cluster, 1, file);
-            stream += CLUSTER_SIZE - len_final_cluster;
-        }
-        else
-        {
-            fwrite(stream, strlen(stream), 1, file);
-            fclose(file);
-            return curr_size;
-        }
+/**
+ * Atende clientes pelo socket Unix path, com uma thread por conexão,
+ * até receber SIGINT ou SIGTERM. Os metadados são gravados a cada
+ * SERVER_SYNC_MS milissegundos por fs_sync, que para os comandos
+ *
+ * @param char* caminho do socket
+ *
+ * @return int código de saída do programa
+*/
+int run_server(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    fs_info_t info;
 
-        fclose(file);
+    if (fs_info(fs, &info) != 0)
+    {
+        fprintf(OUT, "O arquivo %s não existe, crie-o com init antes de iniciar o servidor\n", FAT_NAME);
+        return 1;
     }
-
-    curr_cluster = fat[final_cluster];
-    for (int i = 0; i < new_blocks; i++)
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        data_cluster data;
-        memset(&data, 0x00, sizeof(data));
-
-        if (i + 1 == new_blocks)
-            memcpy(&data, stream, strlen(stream));
-        else
-            memcpy(&data, stream, CLUSTER_SIZE);
-
-        write_data(curr_cluster, data);
-        stream += 1024;
-        curr_cluster = fat[curr_cluster];
+        fprintf(OUT, "O caminho \"%s\" é muito longo\n", path);
+        return 1;
     }
+    strcpy(addr.sun_path, path);
 
-    return curr_size + (new_blocks * CLUSTER_SIZE);
-}
-
-int main()
-{
-    char *input;
-    while ((input = readline("SHELL V-POWER → ")) != 0)
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (server == -1 || bind(server, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(server, SERVER_BACKLOG) == -1)
     {
-        add_history(input);
-        char *command = strtok(input, " ");
+        fprintf(OUT, "Não foi possível criar o socket \"%s\"\n", path);
+        return 1;
+    }
 
-        if (strcmp(command, "init") == 0)
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stop_server);
+    signal(SIGTERM, stop_server);
+    fprintf(OUT, "Servidor ouvindo em %s\n", path);
+    if (!info.journaled)
+        fprintf(OUT, "Aviso: a imagem mapeada não usa o diário, uma queda pode deixá-la inconsistente\n");
+    fflush(OUT);
+
+    struct timespec last, now;
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    while (!server_stop)
+    {
+        struct pollfd listener = {server, POLLIN, 0};
+        if (poll(&listener, 1, SERVER_SYNC_MS) > 0)
         {
-            init();
+            int client = accept(server, NULL, NULL);
+            pthread_t thread;
+
+            if (client != -1 && pthread_create(&thread, NULL, serve_client, (void *)(intptr_t)client) == 0)
+                pthread_detach(thread);
+            else if (client != -1)
+                close(client);
         }
-        else if (strcmp(command, "load") == 0)
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= SERVER_SYNC_MS)
         {
-            load(1);
+            fs_sync(fs);
+            last = now;
         }
-        else if (strcmp(command, "mkdir") == 0)
-        {
-            char *next = NULL;
-            char *dir = strtok(NULL, "/");
-            int parent_cluster = 9;
+    }
 
-            while (1)
-            {
-                next = strtok(NULL, "/");
-                data_cluster parent_dir = load_data(parent_cluster);
-
-                if (next == NULL)
-                {
-                    if (dir == NULL)
-                    {
-                        printf("Não é possível criar a pasta raiz\n");
-                        break;
-                    }
-
-                    new_entry(dir, parent_dir, parent_cluster, IS_DIR);
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(dir, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", dir);
-                    break;
-                }
+    // os comandos que chegarem depois disso recebem -ENODEV
+    fs_unmount(fs);
+    close(server);
+    unlink(path);
+    return 0;
+}
 
-                dir = next;
-            }
-        }
-        else if (strcmp(command, "ls") == 0)
-        {
-            char *dir = NULL;
-            int parent_cluster = 9;
+/**
+ * Mostra as estatísticas na saída de erros ao fim do programa
+*/
+void stats_dump()
+{
+    fs_stats_print(fs, stderr);
+}
 
-            while (1)
-            {
-                data_cluster parent_dir = load_data(parent_cluster);
+int main(int argc, char **argv)
+{
+    char *input;
+    char *script = NULL, *socket_path = NULL;
+    long sync_every = BATCH_SYNC;
+    fs_options_t options = {0, 0, 0};
 
-                if ((dir = strtok(NULL, "/")) == NULL)
-                {
-                    ls(parent_dir);
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(dir, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", dir);
-                    break;
-                }
-            }
-        }
-        else if (strcmp(command, "create") == 0)
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mmap") == 0)
+            options.mmap = 1;
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+            script = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            sync_every = atol(argv[++i]);
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+            options.uring_depth = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
         {
-            char *next = NULL;
-            char *dir = strtok(NULL, "/");
-            int parent_cluster = 9;
-
-            while (1)
-            {
-                next = strtok(NULL, "/");
-                data_cluster parent_dir = load_data(parent_cluster);
-
-                if (next == NULL)
-                {
-                    if (dir == NULL)
-                    {
-                        printf("Nome inválido\n");
-                        break;
-                    }
-
-                    new_entry(dir, parent_dir, parent_cluster, IS_FILE);
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(dir, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", dir);
-                    break;
-                }
-
-                dir = next;
-            }
+            // os clientes compartilham a imagem mapeada, sem o cache de clusters
+            socket_path = argv[++i];
+            options.threads = 1;
         }
-        else if (strcmp(command, "unlink") == 0)
+        else
         {
-            char *next = NULL;
-            char *dir = strtok(NULL, "/");
-            int parent_cluster = 9;
-
-            while (1)
-            {
-                next = strtok(NULL, "/");
-                data_cluster parent_dir = load_data(parent_cluster);
-
-                if (next == NULL)
-                {
-                    if (dir == NULL)
-                    {
-                        printf("Nome inválido\n");
-                        break;
-                    }
-
-                    del(dir, parent_dir, parent_cluster);
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(dir, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", dir);
-                    break;
-                }
-
-                dir = next;
-            }
+            fprintf(OUT, "Uso: %s [-m|--mmap] [-f script] [-n comandos] [-s socket] [-u profundidade]\n", argv[0]);
+            return 1;
         }
-        else if (strcmp(command, "write") == 0)
-        {
-            char *stream = strtok(NULL, "\"");
-            char *path = strtok(NULL, " ");
-            char *next = NULL;
-            char *file = strtok(path, "/");
-            int parent_cluster = 9;
-
-            while (1)
-            {
-                next = strtok(NULL, "/");
-                data_cluster parent_dir = load_data(parent_cluster);
-
-                if (next == NULL)
-                {
-                    if (file == NULL)
-                    {
-                        printf("Nome inválido\n");
-                        break;
-                    }
-
-                    for (int i = 0; i < ENTRY_BY_CLUSTER; i++)
-                    {
-                        if (strcmp(parent_dir.dir[i].filename, file) == 0)
-                        {
-                            parent_dir.dir[i].size = write_file(stream, parent_dir.dir[i].first_block);
-                            write_data(parent_cluster, parent_dir);
-                        }
-                    }
+    }
 
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(file, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", file);
-                    break;
-                }
+    if (options.uring_depth < 0 || options.uring_depth > FS_URING_MAX_DEPTH)
+    {
+        fprintf(OUT, "A profundidade deve estar entre 1 e %d\n", FS_URING_MAX_DEPTH);
+        return 1;
+    }
 
-                file = next;
-            }
-        }
-        else if (strcmp(command, "read") == 0)
-        {
-            char *next = NULL;
-            char *entry = strtok(NULL, "/");
-            int curr_cluster = 9;
-            uint32_t size;
+    fs_info_t info;
+    if (fs_mount(FAT_NAME, &options, &fs) != 0)
+    {
+        fprintf(OUT, "Erro ao abrir o arquivo\n");
+        return 1;
+    }
+    fs_info(fs, &info);
+    if (options.uring_depth > 0 && !options.mmap && !options.threads && info.uring_depth == 0)
+        fprintf(OUT, "io_uring indisponível, usando E/S síncrona\n");
+
+    // com a variável definida as estatísticas são coletadas desde o início
+    // e mostradas na saída de erros ao fim do programa
+    char *stats_env = getenv(STATS_ENV);
+    if (stats_env != NULL && *stats_env != '\0' && strcmp(stats_env, "0") != 0)
+    {
+        fs_stats_enable(fs, 1);
+        atexit(stats_dump);
+    }
 
-            while (1)
-            {
-                data_cluster parent_dir = load_data(curr_cluster);
-                if ((next = strtok(NULL, "/")) == NULL)
-                {
-                    if (entry == NULL)
-                    {
-                        printf("Entrada inválida!\n");
-                        break;
-                    }
-
-                    int i;
-                    for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                    {
-                        if (strcmp(entry, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_FILE)
-                        {
-                            curr_cluster = parent_dir.dir[i].first_block;
-                            size = parent_dir.dir[i].size;
-                            break;
-                        }
-                    }
-
-                    if (i == ENTRY_BY_CLUSTER)
-                    {
-                        printf("Entrada inválida!\n");
-                        break;
-                    }
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (parent_dir.dir[i].size == 0)
-                    {
-                        i = ENTRY_BY_CLUSTER;
-                        break;
-                    }
-                    else if (strcmp(entry, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        curr_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", entry);
-                    break;
-                }
+    if (access(FAT_NAME, F_OK) == 0)
+        show_load(0, fs_load(fs));
 
-                entry = next;
-            }
-        }
-        else if (strcmp(command, "append") == 0)
-        {
-            char *stream = strtok(NULL, "\"");
-            char *path = strtok(NULL, " ");
-            char *next = NULL;
-            char *file = strtok(path, "/");
-            int parent_cluster = 9;
+    if (socket_path != NULL)
+        return run_server(socket_path);
 
-            while (1)
-            {
-                next = strtok(NULL, "/");
-                data_cluster parent_dir = load_data(parent_cluster);
-                if (next == NULL)
-                {
-                    if (file == NULL)
-                    {
-                        printf("Nome inválido\n");
-                        break;
-                    }
-
-                    for (int i = 0; i < ENTRY_BY_CLUSTER; i++)
-                    {
-                        if (strcmp(parent_dir.dir[i].filename, file) == 0)
-                        {
-                            parent_dir.dir[i].size = append_file(stream, parent_dir.dir[i].first_block, parent_dir.dir[i].size);
-                            write_data(parent_cluster, parent_dir);
-                        }
-                    }
+    if (script != NULL || !isatty(STDIN_FILENO))
+    {
+        int status = run_batch(script, sync_every);
+        fs_unmount(fs);
+        return status;
+    }
 
-                    break;
-                }
-
-                int i;
-                for (i = 0; i < ENTRY_BY_CLUSTER; i++)
-                {
-                    if (strcmp(file, parent_dir.dir[i].filename) == 0 && parent_dir.dir[i].attributes == IS_DIR)
-                    {
-                        parent_cluster = parent_dir.dir[i].first_block;
-                        break;
-                    }
-                }
-
-                if (i == ENTRY_BY_CLUSTER)
-                {
-                    printf("O diretorio \"%s\" não existe\n", file);
-                    break;
-                }
+    while ((input = readline(PROMPT)) != 0)
+    {
+        add_history(input);
 
-                file = next;
-            }
-        }
-        else
-        {
-            printf("Comando inválido!\n");
-        }
+        // recarrega os metadados apenas se outro processo alterou o arquivo
+        show_load(0, fs_refresh(fs));
 
-        load(0);
+        run_command(input);
+        fs_sync(fs);
+        free(input);
     }
+    fs_unmount(fs);
 }
@@ -0,0 +1,525 @@
+/**
+ * Testes de regressão da libfat, usados por make check. Cada caso monta
+ * uma imagem nova em um diretório temporário e usa só a interface de
+ * fat.h. Os casos que falham são mostrados na saída de erro, e o código
+ * de saída é o número de falhas
+ *
+ * Uso: ./test_regress
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../src/fat.h"
+
+#define IMAGE_NAME "fat.part"
+#define BIG_LEN ((1 << 24) + 1)
+#define APPEND_LEN (BIG_LEN + 4096 - 1024)
+#define DEEP_LEVELS 10
+#define FAT32_CLUSTERS 70000
+#define EXTENT_CLUSTERS 4
+#define EXTENT_ROUNDS 16
+#define HOST_DIR "host"
+#define EXPORT_NAME "export.out"
+#define THREADS 4
+#define THREAD_FILES 64
+
+int failures = 0;
+fs_t *threads_fs;
+
+/**
+ * Conta uma falha se cond for falsa, mostrando a condição e a linha
+*/
+#define CHECK(cond)                                                    \
+    do                                                                 \
+    {                                                                  \
+        if (!(cond))                                                   \
+        {                                                              \
+            fprintf(stderr, "%s:%d: falhou: %s\n", __func__, __LINE__, #cond); \
+            failures++;                                                \
+        }                                                              \
+    } while (0)
+
+/**
+ * Monta e formata uma imagem nova
+ *
+ * @param int tamanho do cluster
+ * @param int número de clusters
+ *
+ * @return fs_t* sistema de arquivos montado, ou NULL em caso de erro
+*/
+fs_t *fresh_image(int cluster_size, int num_clusters)
+{
+    fs_t *fs;
+
+    unlink(IMAGE_NAME);
+    if (fs_mount(IMAGE_NAME, NULL, &fs) != 0)
+        return NULL;
+    if (fs_format(fs, cluster_size, num_clusters, 0) != 0)
+    {
+        fs_unmount(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+/**
+ * Verifica o tamanho e o último byte do arquivo path
+ *
+ * @param fs_t* sistema de arquivos montado
+ * @param char* caminho do arquivo
+ * @param size_t tamanho esperado
+ * @param char último byte esperado
+*/
+void check_tail(fs_t *fs, const char *path, size_t size, char last)
+{
+    fs_stat_t st;
+    fs_file_t file;
+    char byte = 0;
+
+    CHECK(fs_lookup(fs, path, &st) == 0 && st.size == size);
+    CHECK(fs_open(fs, path, 0, &file) == 0);
+    CHECK(fs_pread(fs, &file, &byte, 1, size - 1) == 1);
+    CHECK(byte == last);
+}
+
+/**
+ * Arquivos com pouco mais de 2^24 bytes, onde a divisão em float
+ * arredondava o número de clusters para baixo. No acréscimo são os
+ * bytes que não cabem no último cluster que passam de 2^24
+*/
+void test_large_length()
+{
+    fs_t *fs = fresh_image(4096, 16384);
+    char *data = malloc(APPEND_LEN);
+    fs_file_t file;
+
+    CHECK(fs != NULL && data != NULL);
+    if (fs == NULL || data == NULL)
+        return;
+    for (size_t i = 0; i < APPEND_LEN; i++)
+        data[i] = (char)(i % 251);
+
+    CHECK(fs_open(fs, "/big", FS_CREATE, &file) == 0);
+    CHECK(fs_replace(fs, &file, data, BIG_LEN) == BIG_LEN);
+    check_tail(fs, "/big", BIG_LEN, data[BIG_LEN - 1]);
+
+    CHECK(fs_open(fs, "/log", FS_CREATE, &file) == 0);
+    CHECK(fs_replace(fs, &file, data, 1024) == 1024);
+    CHECK(fs_append(fs, &file, data, APPEND_LEN) == 1024 + APPEND_LEN);
+    check_tail(fs, "/log", 1024 + APPEND_LEN, data[APPEND_LEN - 1]);
+
+    free(data);
+    fs_unmount(fs);
+}
+
+/**
+ * Diretórios com caminho maior que a chave do cache de caminhos, que
+ * era truncada e deixava o conteúdo do diretório inalcançável
+*/
+void test_long_path()
+{
+    fs_t *fs = fresh_image(1024, 1024);
+    char path[DEEP_LEVELS * 17 + 16] = "";
+    fs_stat_t st;
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+
+    for (int level = 0; level < DEEP_LEVELS; level++)
+    {
+        strcat(path, "/diretorio_longo");
+        CHECK(fs_mkdir(fs, path) == 0);
+    }
+    CHECK(strlen(path) > 128);
+
+    strcat(path, "/f");
+    CHECK(fs_create(fs, path) == 0);
+    CHECK(fs_lookup(fs, path, &st) == 0 && !st.is_dir);
+
+    path[strlen(path) - 2] = '\0';
+    CHECK(fs_readdir(fs, path, &st, 1) == 1 && strcmp(st.name, "f") == 0);
+    fs_unmount(fs);
+}
+
+/**
+ * fs_truncate libera os clusters depois do novo fim, e ao crescer o
+ * trecho novo é lido como zeros, mesmo onde o arquivo tinha dados antes
+*/
+void test_truncate()
+{
+    fs_t *fs = fresh_image(1024, 1024);
+    char data[8 * 1024], byte = 1;
+    fs_info_t before, after;
+    fs_file_t file;
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+    memset(data, 'x', sizeof(data));
+
+    CHECK(fs_open(fs, "/t", FS_CREATE, &file) == 0);
+    CHECK(fs_info(fs, &before) == 0);
+    CHECK(fs_replace(fs, &file, data, sizeof(data)) == sizeof(data));
+    CHECK(fs_pread(fs, &file, &byte, 1, 6000) == 1 && byte == 'x');
+
+    CHECK(fs_truncate(fs, &file, 1500) == 0);
+    CHECK(fs_info(fs, &after) == 0 && after.free_clusters == before.free_clusters - 1);
+    check_tail(fs, "/t", 1500, 'x');
+
+    CHECK(fs_truncate(fs, &file, 6001) == 0);
+    check_tail(fs, "/t", 6001, '\0');
+    CHECK(fs_pread(fs, &file, &byte, 1, 1500) == 1 && byte == '\0');
+
+    CHECK(fs_truncate(fs, &file, 0) == 0);
+    CHECK(fs_info(fs, &after) == 0 && after.free_clusters == before.free_clusters);
+    CHECK(fs_truncate(fs, &file, -1) == -EINVAL);
+    fs_unmount(fs);
+}
+
+/**
+ * Um arquivo aberto e depois excluído não lê o arquivo criado no seu
+ * lugar, mesmo quando ele ocupa a mesma entrada e o mesmo primeiro cluster
+*/
+void test_reused_entry()
+{
+    fs_t *fs = fresh_image(1024, 1024);
+    fs_file_t old, file;
+    fs_info_t info;
+    fs_stat_t st;
+    char byte, *fill;
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+
+    // o disco fica cheio, então o arquivo novo recebe o cluster liberado
+    CHECK(fs_open(fs, "/a", FS_CREATE, &old) == 0);
+    CHECK(fs_open(fs, "/cheio", FS_CREATE, &file) == 0);
+    CHECK(fs_info(fs, &info) == 0);
+    fill = calloc(info.free_clusters + 1, 1024);
+    CHECK(fill != NULL && fs_replace(fs, &file, fill, (info.free_clusters + 1) * 1024) > 0);
+    free(fill);
+    CHECK(fs_unlink(fs, "/a") == 0);
+    CHECK(fs_open(fs, "/b", FS_CREATE, &file) == 0);
+    CHECK(fs_replace(fs, &file, "novo", 4) == 4);
+    CHECK(file.ref == old.ref && file.first_cluster == old.first_cluster);
+
+    CHECK(fs_pread(fs, &old, &byte, 1, 0) == -ESTALE);
+    CHECK(fs_write(fs, &old, "x", 1) == -ESTALE);
+    CHECK(fs_lookup(fs, "/b", &st) == 0 && st.size == 4);
+    fs_unmount(fs);
+}
+
+/**
+ * O diário reserva cerca de 1% dos clusters da imagem, e geometrias sem
+ * espaço para o diário mínimo são recusadas
+*/
+void test_journal_size()
+{
+    fs_t *fs = fresh_image(4096, 262144);
+    fs_info_t info;
+
+    CHECK(fs_format_check(4096, 128, 0) == -EINVAL);
+    CHECK(fs_format_check(4096, 1024, 0) == 0);
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+    CHECK(fs_info(fs, &info) == 0);
+    CHECK(info.free_clusters < 262144 - 2621 && info.free_clusters > 262144 - 2621 - 512);
+    fs_unmount(fs);
+}
+
+/**
+ * Uma imagem menor que a sua geometria é recusada com -EINVAL no modo
+ * mmap, em vez de encerrar o processo
+*/
+void test_short_image()
+{
+    fs_options_t options = {1, 0, 0};
+    fs_t *fs;
+    int fd = open(IMAGE_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    CHECK(fd != -1 && ftruncate(fd, 5000) == 0);
+    close(fd);
+    CHECK(fs_mount(IMAGE_NAME, &options, &fs) == 0);
+    CHECK(fs_load(fs) == -EINVAL);
+    CHECK(fs_create(fs, "/f") == -ENODEV);
+    fs_unmount(fs);
+}
+
+/**
+ * Uma transação confirmada por fs_sync é refeita por fs_load se o
+ * processo terminar sem desmontar a imagem e a gravação do cluster no
+ * seu lugar se perder, o que é simulado zerando o cluster na imagem
+*/
+void test_journal_replay()
+{
+    int pipe_fd[2];
+    uint32_t cluster = 0;
+    fs_stat_t st;
+    fs_t *fs;
+
+    CHECK(pipe(pipe_fd) == 0);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fs = fresh_image(1024, 4096);
+        if (fs == NULL || fs_mkdir(fs, "/d") != 0 || fs_sync(fs) != 0 || fs_lookup(fs, "/d", &st) != 0 ||
+            fs_create(fs, "/d/f") != 0 || fs_sync(fs) != 0)
+            _exit(1);
+        // termina sem fs_unmount, com a transação ainda no diário
+        _exit(write(pipe_fd[1], &st.first_cluster, sizeof(st.first_cluster)) == sizeof(st.first_cluster) ? 0 : 1);
+    }
+
+    int status = -1;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(read(pipe_fd[0], &cluster, sizeof(cluster)) == sizeof(cluster));
+    close(pipe_fd[0]);
+    close(pipe_fd[1]);
+    if (cluster == 0)
+        return;
+
+    char zeros[1024] = {0};
+    int fd = open(IMAGE_NAME, O_WRONLY);
+    CHECK(fd != -1 && pwrite(fd, zeros, sizeof(zeros), (off_t)cluster * sizeof(zeros)) == sizeof(zeros));
+    close(fd);
+
+    CHECK(fs_mount(IMAGE_NAME, NULL, &fs) == 0);
+    CHECK(fs_load(fs) > 0);
+    CHECK(fs_lookup(fs, "/d/f", &st) == 0 && !st.is_dir);
+    fs_unmount(fs);
+
+    // o diário é limpo depois de refeito
+    CHECK(fs_mount(IMAGE_NAME, NULL, &fs) == 0);
+    CHECK(fs_load(fs) == 0);
+    fs_unmount(fs);
+}
+
+/**
+ * Imagens com mais clusters que uma fat de 16 bits comporta usam
+ * entradas de 32 bits, e os clusters depois do limite de 16 bits
+ * continuam na cadeia depois de recarregar a imagem
+*/
+void test_fat32()
+{
+    fs_t *fs;
+    fs_info_t info;
+    fs_file_t file;
+    size_t len = (size_t)(FAT32_CLUSTERS - 4000) * 512;
+    char *data = malloc(len);
+
+    CHECK(fs_format_check(512, FAT32_CLUSTERS, 16) == -EINVAL);
+    CHECK(fs_format_check(512, FAT32_CLUSTERS, 32) == 0);
+
+    unlink(IMAGE_NAME);
+    CHECK(data != NULL && fs_mount(IMAGE_NAME, NULL, &fs) == 0);
+    if (data == NULL)
+        return;
+    CHECK(fs_format(fs, 512, FAT32_CLUSTERS, 32) == 0);
+    CHECK(fs_info(fs, &info) == 0 && info.fat_bits == 32 && info.num_clusters == FAT32_CLUSTERS);
+
+    for (size_t i = 0; i < len; i++)
+        data[i] = (char)(i % 253);
+    CHECK(fs_open(fs, "/grande", FS_CREATE, &file) == 0);
+    CHECK(fs_replace(fs, &file, data, len) == (ssize_t)len);
+    fs_unmount(fs);
+
+    CHECK(fs_mount(IMAGE_NAME, NULL, &fs) == 0);
+    CHECK(fs_load(fs) == 0);
+    CHECK(fs_info(fs, &info) == 0 && info.fat_bits == 32);
+    check_tail(fs, "/grande", len, data[len - 1]);
+    free(data);
+    fs_unmount(fs);
+}
+
+/**
+ * Arquivos fragmentados, com acréscimos intercalados de dois arquivos,
+ * são lidos por extensões com fs_pread e exportados por fs_export com
+ * o mesmo conteúdo que foi escrito
+*/
+void test_extent_export()
+{
+    fs_t *fs = fresh_image(1024, 1024);
+    size_t chunk = EXTENT_CLUSTERS * 1024, len = chunk * EXTENT_ROUNDS;
+    char *data = malloc(len), *back = malloc(len);
+    fs_file_t a, b;
+
+    CHECK(fs != NULL && data != NULL && back != NULL);
+    if (fs == NULL || data == NULL || back == NULL)
+        return;
+    for (size_t i = 0; i < len; i++)
+        data[i] = (char)(i % 251);
+
+    CHECK(fs_open(fs, "/a", FS_CREATE, &a) == 0);
+    CHECK(fs_open(fs, "/b", FS_CREATE, &b) == 0);
+    for (int i = 0; i < EXTENT_ROUNDS; i++)
+    {
+        CHECK(fs_append(fs, &a, data + i * chunk, chunk) == (ssize_t)((i + 1) * chunk));
+        CHECK(fs_append(fs, &b, "b", 1) == i + 1);
+    }
+
+    // a leitura começa no meio de um cluster e atravessa todas as extensões
+    CHECK(fs_pread(fs, &a, back, len - 100, 100) == (ssize_t)(len - 100));
+    CHECK(memcmp(back, data + 100, len - 100) == 0);
+
+    int fd = open(EXPORT_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd != -1 && fs_export(fs, "/a", fd) == 0);
+    CHECK(pread(fd, back, len, 0) == (ssize_t)len && memcmp(back, data, len) == 0);
+    CHECK(fs_export(fs, "/nada", fd) == -ENOENT);
+    close(fd);
+    unlink(EXPORT_NAME);
+
+    free(data);
+    free(back);
+    fs_unmount(fs);
+}
+
+/**
+ * fs_import_tree copia os arquivos e subdiretórios do host, como o
+ * comando import -r
+*/
+void test_import_tree()
+{
+    fs_t *fs = fresh_image(1024, 1024);
+    fs_import_t result = {0};
+    fs_stat_t st;
+    fs_file_t file;
+    char buffer[8] = "";
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+
+    CHECK(mkdir(HOST_DIR, 0755) == 0 && mkdir(HOST_DIR "/sub", 0755) == 0);
+    int fd = open(HOST_DIR "/a.txt", O_WRONLY | O_CREAT, 0644);
+    CHECK(fd != -1 && write(fd, "raiz", 4) == 4);
+    close(fd);
+    fd = open(HOST_DIR "/sub/b.txt", O_WRONLY | O_CREAT, 0644);
+    CHECK(fd != -1 && write(fd, "sub", 3) == 3);
+    close(fd);
+
+    fd = open(HOST_DIR, O_RDONLY | O_DIRECTORY);
+    CHECK(fd != -1 && fs_import_tree(fs, fd, HOST_DIR, "/imp", &result) == 0);
+    CHECK(result.dirs == 2 && result.files == 2 && result.bytes == 7);
+
+    CHECK(fs_lookup(fs, "/imp/sub", &st) == 0 && st.is_dir);
+    CHECK(fs_lookup(fs, "/imp/a.txt", &st) == 0 && st.size == 4);
+    CHECK(fs_open(fs, "/imp/sub/b.txt", 0, &file) == 0);
+    CHECK(fs_read(fs, &file, buffer, sizeof(buffer)) == 3 && memcmp(buffer, "sub", 3) == 0);
+
+    unlink(HOST_DIR "/sub/b.txt");
+    unlink(HOST_DIR "/a.txt");
+    rmdir(HOST_DIR "/sub");
+    rmdir(HOST_DIR);
+    fs_unmount(fs);
+}
+
+/**
+ * Cada thread cria os seus arquivos no mesmo diretório, grava o seu
+ * número neles e exclui metade, com a opção threads
+ *
+ * @param void* número da thread
+ *
+ * @return void* número de chamadas que falharam
+*/
+void *create_unlink(void *arg)
+{
+    fs_t *fs = threads_fs;
+    int id = (int)(long)arg;
+    long failed = 0;
+    char path[32];
+    fs_file_t file;
+
+    for (int i = 0; i < THREAD_FILES; i++)
+    {
+        snprintf(path, sizeof(path), "/t/f%d_%d", id, i);
+        failed += fs_open(fs, path, FS_CREATE, &file) != 0 || fs_replace(fs, &file, &id, sizeof(id)) != sizeof(id);
+        if (i % 2)
+            failed += fs_unlink(fs, path) != 0;
+    }
+    fs_thread_done(fs);
+    return (void *)failed;
+}
+
+/**
+ * Criações e exclusões concorrentes no mesmo diretório não perdem nem
+ * misturam entradas, e o resultado continua lá depois de recarregar
+*/
+void test_threads()
+{
+    fs_options_t options = {0, 0, 1};
+    fs_stat_t entries[THREADS * THREAD_FILES];
+    pthread_t threads[THREADS];
+    fs_t *fs = fresh_image(1024, 4096);
+
+    CHECK(fs != NULL);
+    if (fs == NULL)
+        return;
+    fs_unmount(fs);
+    CHECK(fs_mount(IMAGE_NAME, &options, &fs) == 0 && fs_load(fs) == 0);
+    CHECK(fs_mkdir(fs, "/t") == 0);
+
+    threads_fs = fs;
+    for (long i = 0; i < THREADS; i++)
+        CHECK(pthread_create(&threads[i], NULL, create_unlink, (void *)i) == 0);
+    for (int i = 0; i < THREADS; i++)
+    {
+        void *failed;
+        CHECK(pthread_join(threads[i], &failed) == 0 && failed == NULL);
+    }
+    fs_unmount(fs);
+
+    CHECK(fs_mount(IMAGE_NAME, NULL, &fs) == 0 && fs_load(fs) == 0);
+    CHECK(fs_readdir(fs, "/t", entries, THREADS * THREAD_FILES) == THREADS * THREAD_FILES / 2);
+    for (int id = 0; id < THREADS; id++)
+    {
+        for (int i = 0; i < THREAD_FILES; i += 2)
+        {
+            char path[32];
+            int value = -1;
+            fs_file_t file;
+
+            snprintf(path, sizeof(path), "/t/f%d_%d", id, i);
+            CHECK(fs_open(fs, path, 0, &file) == 0);
+            CHECK(fs_read(fs, &file, &value, sizeof(value)) == sizeof(value) && value == id);
+        }
+    }
+    fs_unmount(fs);
+}
+
+int main()
+{
+    char dir[] = "/tmp/fat_regressXXXXXX";
+
+    if (mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        fprintf(stderr, "Erro ao criar o diretório temporário\n");
+        return 1;
+    }
+
+    test_large_length();
+    test_long_path();
+    test_truncate();
+    test_reused_entry();
+    test_journal_size();
+    test_short_image();
+    test_journal_replay();
+    test_fat32();
+    test_extent_export();
+    test_import_tree();
+    test_threads();
+
+    unlink(IMAGE_NAME);
+    chdir("/");
+    rmdir(dir);
+    printf("%s\n", failures ? "FALHOU" : "OK");
+    return failures;
+}